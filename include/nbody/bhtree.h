@@ -1,7 +1,10 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <vector>
 #include <functional>
+#include <type_traits>
 #include "vector.h"
 #include "bounds.h"
 #include "ray.h"
@@ -17,14 +20,53 @@ namespace nbody
             float mass = 0;
             uint32_t next = 0; // index of the next node at this level, or the parent's next
             uint32_t children = 0; // index of the first child
-            uint32_t __pad0 = 0;
-            uint32_t __pad1 = 0;
+            uint32_t first = 0; // a leaf's bodies, as a range of Tree::points() and Tree::slots()
+            uint32_t count = 0;
+        };
+
+        // How the tree spreads bulk work across threads. Called as parallel(n, block), it must
+        // run block(begin, end) over a partition of [0, n) and return once all of it has run.
+        // The tree owns no threads of its own: the solvers hand it their pool (see
+        // detail::executor), and an empty one runs everything on the calling thread.
+        using Parallel = std::function<void(size_t, const std::function<void(size_t, size_t)>&)>;
+
+        // A body as the tree sees it.
+        struct Point
+        {
+            Vector pos;
+            float mass = 0;
+        };
+
+        // A node's traceless quadrupole moment about its center of mass, the sum over its bodies
+        // of m * (3 d d^T - |d|^2 I) for d each body's offset from it. Symmetric, so six terms,
+        // padded to 32 bytes for the GPU's copy. Must match shaders/include/common.glsl.
+        struct Quadrupole
+        {
+            float xx = 0, yy = 0, zz = 0;
+            float xy = 0, xz = 0, yz = 0;
+            float __pad0 = 0;
+            float __pad1 = 0;
+        };
+
+        // When Tree::refit() gives up on moving bodies between leaves and rebuilds instead.
+        struct RefitLimits
+        {
+            // Fraction of the bodies that left their leaf since the last step. Each migrant
+            // costs a descent and possibly a split, so past a few percent a build is cheaper.
+            float max_migrated = .05f;
+
+            // Refits in a row. Splits append their nodes to the end of the array, away from
+            // the depth-first order build() lays out, so traversal slowly loses locality.
+            uint32_t max_refits = 16;
         };
 
         class Tree
         {
         public:
 
+            // No slot: apply() skips nothing.
+            static constexpr uint32_t no_slot = ~uint32_t(0);
+
             // initialize tree with bounds and a root node
             explicit Tree(const Bounds& bounds = { .size=1 }) : _nodes{ {.bounds = bounds, .com = {0, 0, 0}, .mass = 0, .children = 0 } } { }
 
@@ -34,6 +76,66 @@ namespace nbody
             // insert a point mass into the tree
             void insert(const Vector& position, const float mass);
 
+            // Rebuild from scratch over `count` bodies, equivalent to clear(new_bounds) and an
+            // insert() per body but built from a morton sort instead, which parallelizes. The
+            // node array comes out in the layout insert() produces -- the same cells split, and
+            // eight contiguous children per split -- ordered depth first.
+            //
+            // Templated so the solvers can build straight out of whatever they hold: Item must
+            // expose .pos and .mass, as Body and BodyPosMass both do.
+            template <typename Item>
+            void build(const Bounds& new_bounds, const Item* items, const size_t count, const Parallel& parallel = {})
+            {
+                load(items, count, parallel);
+                build(new_bounds, parallel);
+            }
+
+            // Most bodies a leaf built by build() or refit() may hold before it is split. A leaf
+            // that fails the opening test in apply() is then summed body by body. Past one, that
+            // trades a few direct interactions for several-fold fewer nodes; insert() always
+            // splits a leaf at its second body, whatever this is.
+            void set_leaf_capacity(const uint32_t capacity)
+            {
+                if (capacity == _leaf_capacity)
+                    return;
+                _leaf_capacity = capacity < 1 ? 1 : capacity;
+                _leaf_of.clear();   // the leaves are the wrong size to refit from
+            }
+            [[nodiscard]] uint32_t leaf_capacity() const { return _leaf_capacity; }
+
+            // Whether build() and refit() also total a quadrupole moment per node, for visitors
+            // that ask apply() for one. Good enough at a wider opening angle to more than pay
+            // for the extra pass.
+            void set_quadrupoles(const bool enabled)
+            {
+                if (enabled == _quadrupole)
+                    return;
+                _quadrupole = enabled;
+                _leaf_of.clear();   // the next refit() has to compute them from scratch
+            }
+            [[nodiscard]] bool quadrupoles_enabled() const { return _quadrupole; }
+
+            // Bring the tree up to date with the same bodies, in the same order, as the last
+            // build(), after they have moved. Only the bodies that left their leaf are moved
+            // into the leaf they now fall in, splitting it if need be; the moments are then
+            // totalled again bottom up. Leaves emptied along the way stay in place, massless.
+            //
+            // Falls back to build() when the bounds or the body count changed, when there was
+            // no build() to refit, or past the refit limits. Returns whether it refit in place.
+            template <typename Item>
+            bool refit(const Bounds& new_bounds, const Item* items, const size_t count, const Parallel& parallel = {})
+            {
+                const bool refittable = refittable_to(new_bounds, count);
+                load(items, count, parallel);
+                if (refittable && refit(parallel))
+                    return true;
+                build(new_bounds, parallel);
+                return false;
+            }
+
+            void set_refit_limits(const RefitLimits& limits) { _refit_limits = limits; }
+            [[nodiscard]] const RefitLimits& refit_limits() const { return _refit_limits; }
+
             // clear all masses and set new bounds
             void clear(const Bounds& new_bounds);
 
@@ -43,22 +145,280 @@ namespace nbody
             // apply a function to all masses around a point, using the barnes-hut approximation
             void apply(const Vector& pos, const std::function<void(const Node& node)>& func, const float theta = .5f) const;
 
+            // The same walk with the visitor inlined into it rather than called through a
+            // std::function, which matters in a solver's per-body force sum: one indirect call
+            // per node accepted, and nothing the compiler can vectorize across. A lambda picks
+            // this overload; a std::function still gets the one above.
+            //
+            // A visitor that also takes a `const Quadrupole&` is handed each node's, or zero for
+            // a single body and for a tree built without them.
+            //
+            // `skip` is a slot (see slots()) whose body is passed over where it would be visited
+            // alone: the walker's own, in a tree built before it moved, which would otherwise
+            // pull it toward where it was. Inside a node accepted whole it still counts, from at
+            // least the node's opening distance away.
+            template <typename Visitor>
+            void apply(const Vector& pos, Visitor&& visit, const float theta = .5f, const uint32_t skip = no_slot) const
+            {
+                const float theta_sq = theta * theta;
+                static constexpr Quadrupole none;
+                static constexpr uint32_t body = ~uint32_t(0);
+                const auto accept = [this, &visit](const Node& node, const uint32_t index)
+                {
+                    if constexpr (std::is_invocable_v<Visitor&, const Node&, const Quadrupole&>)
+                        visit(node, index == body || _quadrupoles.empty() ? none : _quadrupoles[index]);
+                    else
+                        visit(node);
+                };
+
+                uint32_t node_index = 0;
+                do
+                {
+                    const Node& node = _nodes[node_index];
+
+                    // If the node is empty, skip it
+                    if (node.mass == 0)
+                    {
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    // If the node is a single body, apply function directly, and increment
+                    // node_index by one to indicate
+                    if (node.children == 0 && node.count <= 1)
+                    {
+                        if (node.count == 0 || node.first != skip)
+                            accept(node, node_index);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    // If the node is far enough away apply the node function
+                    const float node_size_sq = node.bounds.size * node.bounds.size;
+                    const Vector delta = node.com - pos;
+                    const float dist_sq = dot(delta, delta);
+                    if (dist_sq > node_size_sq * theta_sq)
+                    {
+                        accept(node, node_index);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    // If it is a leaf too close to treat as one mass, apply the function to each
+                    // of its bodies in turn
+                    if (node.children == 0)
+                    {
+                        const Point* const points = _leaf_points.data();
+                        for (uint32_t i = node.first, end = node.first + node.count; i < end; ++i)
+                            if (i != skip)
+                                accept(Node{ .bounds = node.bounds, .com = points[i].pos, .mass = points[i].mass }, body);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    // If we need to drill down, start looking at the node's children
+                    node_index = node.children;
+                } while (0 < node_index && node_index < _nodes.size());
+            }
+
+            // The same walk for a whole group of bodies at once, those inside the box from `min`
+            // to `max`: a node is accepted only if it passes the opening test from the point of
+            // the box nearest to it, and so from every body in it. A solver walks the tree once
+            // per group rather than once per body, and sums the nodes visited for each of the
+            // group's bodies in turn.
+            template <typename Visitor>
+            void apply_group(const Vector& min, const Vector& max, Visitor&& visit, const float theta = .5f) const
+            {
+                const float theta_sq = theta * theta;
+                static constexpr Quadrupole none;
+                static constexpr uint32_t body = ~uint32_t(0);
+                const auto accept = [this, &visit](const Node& node, const uint32_t index)
+                {
+                    if constexpr (std::is_invocable_v<Visitor&, const Node&, const Quadrupole&>)
+                        visit(node, index == body || _quadrupoles.empty() ? none : _quadrupoles[index]);
+                    else
+                        visit(node);
+                };
+
+                uint32_t node_index = 0;
+                do
+                {
+                    const Node& node = _nodes[node_index];
+                    if (node.mass == 0)
+                    {
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    if (node.children == 0 && node.count <= 1)
+                    {
+                        accept(node, node_index);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    // Distance from the node's center of mass to the nearest point of the box,
+                    // zero along any axis the box spans it on.
+                    const Vector nearest = {
+                        std::clamp(node.com.x, min.x, max.x),
+                        std::clamp(node.com.y, min.y, max.y),
+                        std::clamp(node.com.z, min.z, max.z),
+                    };
+                    const Vector delta = node.com - nearest;
+                    const float node_size_sq = node.bounds.size * node.bounds.size;
+                    if (dot(delta, delta) > node_size_sq * theta_sq)
+                    {
+                        accept(node, node_index);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    if (node.children == 0)
+                    {
+                        const Point* const points = _leaf_points.data();
+                        for (uint32_t i = node.first, end = node.first + node.count; i < end; ++i)
+                            accept(Node{ .bounds = node.bounds, .com = points[i].pos, .mass = points[i].mass }, body);
+                        node_index = node.next;
+                        continue;
+                    }
+
+                    node_index = node.children;
+                } while (0 < node_index && node_index < _nodes.size());
+            }
+
             // apply a function to each node which intersects a ray
             void query(const Ray& ray, const std::function<bool(const Node&)>& visitor) const;
 
+            // The same, inlined; the visitor returns false to stop the walk.
+            template <typename Visitor>
+            void query(const Ray& ray, Visitor&& visit) const
+            {
+                uint32_t node_index = 0;
+                do
+                {
+                    const Node& node = _nodes[node_index];
+                    if (!node.bounds.ray_intersect(ray))
+                    {
+                        node_index = node.next;
+                        continue;
+                    }
+                    if (!visit(node))
+                        break;
+                    node_index
+                        = node.children
+                        ? node.children
+                        : node.next;
+                }
+                while (node_index != 0);
+            }
+
             // get root node bounds
             const Bounds& bounds() const { return _nodes[0].bounds; }
 
             // get list of all nodes
             const std::vector<Node>& nodes() const { return _nodes; }
 
+            // Body indices, grouped by leaf: leaf node n holds slots()[n.first, n.first + n.count).
+            // Filled in by build() and refit() only, not by insert(). A refit() leaves slots no
+            // leaf refers to any more, until the next build() packs them again.
+            const std::vector<uint32_t>& slots() const { return _slots; }
+
+            // The bodies' positions and masses in slot order, so a leaf's are contiguous.
+            const std::vector<Point>& points() const { return _leaf_points; }
+
+            // One per node while quadrupoles are enabled and the tree came from build() or
+            // refit(); empty otherwise.
+            const std::vector<Quadrupole>& quadrupoles() const { return _quadrupoles; }
+
         private:
 
+            // A point's position along the morton curve, and its index into _points.
+            struct Keyed
+            {
+                uint64_t key;
+                uint32_t index;
+            };
+
+            // build()'s helpers, defined alongside it
+            struct Subtree;
+            class Emitter;
+
+            // Run `block` over [0, n), through `parallel` if there is one.
+            static void run(const Parallel& parallel, size_t n, const std::function<void(size_t, size_t)>& block);
+
+            // Copy the bodies' positions and masses into _points.
+            template <typename Item>
+            void load(const Item* items, const size_t count, const Parallel& parallel)
+            {
+                _points.resize(count);
+                run(parallel, count, [this, items](const size_t begin, const size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                        _points[i] = { items[i].pos, items[i].mass };
+                });
+            }
+
+            // build() proper, over the points already gathered into _points
+            void build(const Bounds& new_bounds, const Parallel& parallel);
+
+            // Lay out the nodes and total their masses, the bulk of build().
+            void emit(const Bounds& new_bounds, const Parallel& parallel);
+
+            // Record the slots and each body's leaf, once emit() has laid out the nodes.
+            void locate(const Parallel& parallel);
+
+            // Copy the bodies into slot order, for points().
+            void arrange(const Parallel& parallel);
+
+            // refit() proper. False, having changed nothing, if too many bodies migrated.
+            bool refit(const Parallel& parallel);
+
+            // Whether this tree came from build() over `count` bodies in `new_bounds`, and is
+            // still within the refit limits.
+            [[nodiscard]] bool refittable_to(const Bounds& new_bounds, size_t count) const;
+
+            // The leaf a position falls in, by the same quadrant tests insert() descends by.
+            [[nodiscard]] uint32_t descend(const Vector& pos) const;
+
+            // Split a leaf holding more bodies than the leaf capacity, recursively.
+            void split(uint32_t index);
+
+            // Total the mass and center of mass of every node under `index`, not descending
+            // into `done`, a sorted list of nodes already totalled.
+            void total(uint32_t index, const std::vector<uint32_t>& done);
+
+            // The same for the quadrupoles, once the masses and centers are in place: under
+            // each of _anchors on the workers, then the top, like refit() totals the masses.
+            void total_quadrupoles(const Parallel& parallel);
+            void total_quadrupoles(uint32_t index, const std::vector<uint32_t>& done);
+
             // accumulate mass to a node
             void accumulate(const uint32_t node_index, const Vector& position, const float mass);
 
             // array of all nodes in data structure
             std::vector<Node> _nodes;
+
+            // build() scratch, kept between builds so a step does not reallocate it
+            std::vector<Point> _points;
+            std::vector<Keyed> _keys;
+            std::vector<Keyed> _keys_merge;
+            std::vector<std::vector<Node>> _subtrees;
+
+            // refit() state: the slots, and for each body the leaf it was last found in and
+            // its slot there; the roots of the subtrees build() handed out, sorted, which
+            // refit() totals in parallel; scratch for the leaf each body is in now; and the
+            // bodies in slot order, for points().
+            std::vector<uint32_t> _leaf_of;
+            std::vector<uint32_t> _slots;
+            std::vector<uint32_t> _anchors;
+            std::vector<uint32_t> _slot_of;
+            std::vector<uint32_t> _found;
+            std::vector<Point> _leaf_points;
+            uint32_t _refits = 0;
+            RefitLimits _refit_limits;
+            uint32_t _leaf_capacity = 1;
+            bool _quadrupole = false;
+            std::vector<Quadrupole> _quadrupoles;
         };
     }
 }
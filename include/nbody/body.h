@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include "vector.h"
 
 namespace nbody
@@ -15,6 +16,10 @@ namespace nbody
 
         // dynamics
         Vector acc = { 0,0,0 };
-        float __pad = 0;
+
+        // Which body this is, for as long as it lives: what was padding to 16 bytes. Sim
+        // numbers a body that has none, and nothing else ever changes it, so it goes
+        // wherever the body goes -- see Sim::index_of(). Zero for not numbered yet.
+        uint32_t id = 0;
     };
 }
\ No newline at end of file
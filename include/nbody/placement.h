@@ -0,0 +1,22 @@
+#pragma once
+
+namespace nbody
+{
+    // Where a Sim's worker threads run, and where the arrays they share live, on a host with
+    // more than one NUMA node. Fixed for the life of the Sim: see Sim::Sim().
+    enum class Placement : int
+    {
+        // Threads wherever the OS puts them, and memory on whichever node first wrote it.
+        Unpinned = 0,
+
+        // Each worker pinned to its own logical cpu, filling one node before starting on the
+        // next: a pool no larger than a socket never leaves it, and two sims side by side
+        // stay out of each other's caches.
+        Compact,
+
+        // Each worker pinned to its own logical cpu, taking the nodes in turn, and the
+        // bodies and the tree interleaved page by page across all of them, for a pool that
+        // spans sockets and wants the memory bandwidth of each.
+        Spread,
+    };
+}
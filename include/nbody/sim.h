@@ -1,12 +1,17 @@
 #pragma once
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 #include "body.h"
 #include "bhtree.h"
+#include "placement.h"
 #include "state.h"
+#include "stats.h"
 #include "variant.h"
 
 namespace nbody
@@ -25,8 +30,10 @@ namespace nbody
     public:
 
         // Defaults to CpuBarnesHut: always available, and never touches Vulkan.
+        // `placement` decides where the worker threads run for as long as the Sim lives, and
+        // is no business of the variant's: see Placement.
         Sim();
-        explicit Sim(Variant variant);
+        explicit Sim(Variant variant, Placement placement = Placement::Unpinned);
         ~Sim();
 
         // Movable, but a moved-from Sim holds neither a state nor a solver: it may only
@@ -42,6 +49,18 @@ namespace nbody
         [[nodiscard]] static const VariantInfo& info(Variant v);
         [[nodiscard]] static bool available(Variant v);
 
+        // Where the GPU variants keep their compiled pipelines between processes, so that
+        // every process after the first brings its device up without compiling the shaders
+        // again: one file per device and driver, written by the first process to find none.
+        // Empty keeps none. Defaults to the NBODY_PIPELINE_CACHE_DIR environment variable,
+        // when it is set.
+        //
+        // Read when a Sim first brings up a device; one already up keeps the directory it
+        // started with. Not synchronized, like the variant table: set it before any Sim goes
+        // to a GPU variant.
+        static void set_pipeline_cache_dir(std::string directory);
+        [[nodiscard]] static const std::string& pipeline_cache_dir();
+
         // --- variant selection ----------------------------------------------------
         [[nodiscard]] Variant variant() const { return _variant; }
 
@@ -51,6 +70,9 @@ namespace nbody
 
         [[nodiscard]] const std::string& last_error() const { return _last_error; }
 
+        // How the worker threads were placed when this Sim was made.
+        [[nodiscard]] Placement placement() const;
+
         // --- state ------------------------------------------------------------------
         // Reads route through the active solver so that a variant holding its own
         // representation gets the chance to materialize it first.
@@ -75,17 +97,108 @@ namespace nbody
         [[nodiscard]] float theta() const;
         void set_theta(float v);
 
+        [[nodiscard]] bool quadrupole() const;
+        void set_quadrupole(bool v);
+
+        [[nodiscard]] bool gpu_tree() const;
+        void set_gpu_tree(bool v);
+
+        [[nodiscard]] int frames_in_flight() const;
+        void set_frames_in_flight(int v);
+
+        [[nodiscard]] int fmm_order() const;
+        void set_fmm_order(int v);
+
+        [[nodiscard]] size_t block_targets() const;
+        void set_block_targets(size_t v);
+
+        [[nodiscard]] size_t block_sources() const;
+        void set_block_sources(size_t v);
+
+        [[nodiscard]] bool symmetric() const;
+        void set_symmetric(bool v);
+
         [[nodiscard]] float gravity() const;
         void set_gravity(float v);
 
         [[nodiscard]] bool wrap() const;
         void set_wrap(bool v);
 
+        [[nodiscard]] Integrator integrator() const;
+        void set_integrator(Integrator v);
+
+        [[nodiscard]] Precision precision() const;
+        void set_precision(Precision v);
+
+        [[nodiscard]] size_t reorder_every() const;
+        void set_reorder_every(size_t v);
+
+        [[nodiscard]] int timestep_levels() const;
+        void set_timestep_levels(int v);
+
+        [[nodiscard]] float timestep_accuracy() const;
+        void set_timestep_accuracy(float v);
+
+        [[nodiscard]] float timestep_eta() const;
+        void set_timestep_eta(float v);
+
+        // Advanced by update(), integrate() and step(); set it to start the clock elsewhere.
+        [[nodiscard]] double time() const;
+        void set_time(double v);
+
         // --- stepping ------------------------------------------------------------
+        // update() steps with State::integrator. accelerate() and integrate() are its two
+        // halves under euler, and integrate() is always an euler step of the accelerations
+        // the bodies hold.
         void update(float dt);
         void accelerate();
         void integrate(float dt);
 
+        // Adaptive stepping. step() takes one step of State::integrator, no longer than
+        // `max_dt` and cut to State::timestep_eta of the shortest free-fall time among the
+        // bodies, and returns the step it took. The bound is found in the same pass as the
+        // forces it follows from, so it costs no pass of its own.
+        //
+        // run_until() steps so until time() reaches `t`, shortening the last step to land on
+        // it exactly, and returns the number of steps. It stops early, rather than spin,
+        // should the bound ever allow no step at all.
+        float step(float max_dt);
+        size_t run_until(double t, float max_dt);
+
+        // `steps` steps of `dt` with the bodies left to the solver in between, for a caller
+        // that looks at them only now and then: a GPU brute-force variant submits the steps
+        // together and reads back once. `observer` is called after every `observe_every`
+        // steps and after the last; zero observes only the end.
+        void run(size_t steps, float dt, size_t observe_every = 0, const std::function<void(const Sim&)>& observer = {});
+
+        // --- statistics --------------------------------------------------------------
+        // What the last update(), step() or batch of run() cost. A GPU variant also says how
+        // much of it its device spent moving data and how much computing, and waits for the
+        // step if it is still queued. Work between steps -- an accelerate() or integrate()
+        // on its own, a read that brings the bodies back -- is counted in the next one.
+        [[nodiscard]] StepStats stats() const;
+
+        // --- body order ------------------------------------------------------------
+        // Sort the bodies along a morton curve through the world, as the steps do every
+        // State::reorder_every of them. Neighbours in space become neighbours in memory, so a
+        // block of bodies walks one part of a tree rather than all of it, and the GPU's
+        // adjacent invocations take the same paths through it.
+        void reorder();
+
+        // bodies()[i] is the body the caller put at permutation()[i], however the reorders
+        // have moved it since. Bodies the caller appends take the next indices along. One the
+        // caller removes leaves no way to tell which it was, so fewer bodies than last time
+        // start the count afresh from the order they are in; a caller who removes and appends
+        // as many between two calls gets indices for neither.
+        [[nodiscard]] std::span<const uint32_t> permutation() const;
+
+        // Where the body with Body::id `id` is in bodies(), or nothing if no body has it. Sim
+        // numbers bodies the first time it looks at them after a mutable_bodies(): one with
+        // no id, one with an id Sim has not handed out, or the second of two with the same
+        // id -- a copy -- takes the next free one. Ids are carried through every step,
+        // reorder and variant switch, and unlike permutation() they survive removals.
+        [[nodiscard]] std::optional<size_t> index_of(uint32_t id) const;
+
         // --- visualization ---------------------------------------------------------
         // The barnes-hut tree, or nullptr when the active variant builds none.
         [[nodiscard]] const bh::Tree* tree() const;
@@ -94,7 +207,7 @@ namespace nbody
         // there is no tree.
         //
         // WARNING: the returned span is invalidated by the next accelerate()/update(),
-        // which rebuilds and reserves the node array. Use it immediately; never store
+        // which refits or rebuilds the node array. Use it immediately; never store
         // it across a step.
         [[nodiscard]] std::span<const bh::Node> nodes() const;
 
@@ -105,6 +218,16 @@ namespace nbody
         // drive it -- see Solver::ingest().
         void sync_solver() const;
 
+        // Give each body that needs one a Body::id, then index them all by it. Before
+        // ingest, so that a solver copying whole bodies takes the ids along.
+        void number_bodies() const;
+
+        // Rebuild _slots from the ids the bodies carry, after something has moved them.
+        void index_bodies() const;
+
+        // Reorder if State::reorder_every says so, `steps` more steps on.
+        void count_steps(size_t steps);
+
         std::shared_ptr<Context> _context;
         StateRef _state;
         std::unique_ptr<Solver> _solver;
@@ -114,5 +237,28 @@ namespace nbody
         // The State::revision the active solver last ingested. Mutable because
         // sync_solver() is const; it tracks a cache, not the simulation.
         mutable uint64_t _synced_revision = 0;
+
+        // Whether the bodies' accelerations are those at their current positions, as a
+        // leapfrog step leaves them and the next one's opening kick needs them. Anything
+        // that moves the bodies or changes the forces under them clears it. Mutable for the
+        // same reason as _synced_revision.
+        mutable bool _accelerated = false;
+
+        // Steps since the last reorder, against State::reorder_every.
+        size_t _since_reorder = 0;
+
+        // stats() as the host saw the last step: its step count and time. The device's side
+        // is the solver's to fill in.
+        StepStats _stats;
+
+        // Close a step that began at `start`, for stats().
+        void end_step(size_t steps, std::chrono::steady_clock::time_point start);
+
+        // For each id Sim has handed out, the slot in bodies() holding it, or no_slot. Only
+        // a reorder moves bodies between slots, and it marks this stale rather than paying
+        // for an index nobody may ask for.
+        static constexpr uint32_t no_slot = ~uint32_t{0};
+        mutable std::vector<uint32_t> _slots;
+        mutable bool _slots_stale = false;
     };
 }
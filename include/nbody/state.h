@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -7,6 +8,47 @@
 
 namespace nbody
 {
+    // How Sim::update() advances the bodies by a step.
+    enum class Integrator : int
+    {
+        // Semi-implicit euler: kick by the accelerations at the current positions, then
+        // drift. One force evaluation per step.
+        Euler = 0,
+
+        // Kick-drift-kick leapfrog: half a kick, a full drift, the forces at the new
+        // positions, and the other half kick. Second order and symplectic, so energy stays
+        // bounded at steps several times longer than euler needs, for the same one force
+        // evaluation per step: the closing forces are the next step's opening ones. Step for
+        // step the same update as velocity verlet, and the velocities are synchronized with
+        // the positions at the end of each step.
+        Leapfrog,
+
+        // Leapfrog with power-of-two block timesteps. Each body steps at dt / 2^level, its
+        // level picked afresh each step from how fast its velocity is changing, and each
+        // sub-step sums forces only for the bodies whose own step ends there: the whole
+        // system no longer steps at the rate its fastest few bodies need. See
+        // State::timestep_levels and State::timestep_accuracy. The CPU variants only; the
+        // GPU ones step it as plain leapfrog.
+        Hierarchical,
+    };
+
+    // What the CPU variants carry the bodies' positions and velocities in between steps.
+    enum class Precision : int
+    {
+        // Body's floats. At a world of 10000 a position near the edge is good to about 5e-4,
+        // so a step that moves a body less than that rounds to nothing or to a whole 5e-4;
+        // the wrap, which shifts by half the world first, rounds to twice that. Over a long
+        // run the rounding of every step adds up.
+        Single = 0,
+
+        // Doubles, held by the solver beside the bodies and rounded into them each step.
+        // Only the integration is widened: the forces are still summed in float from the
+        // rounded positions, where an error of an ulp in a position does not accumulate.
+        // The doubles survive neither a mutation of the bodies nor a variant switch, after
+        // which they start again from the floats. The GPU variants step in single.
+        Double,
+    };
+
     // The canonical, backend-independent simulation state: everything that defines the
     // simulation and must survive a change of variant. Derived data (the barnes-hut
     // tree) and resources (the thread pool, the vulkan device) deliberately live
@@ -25,18 +67,80 @@ namespace nbody
         // barnes-hut opening angle; ignored by brute-force variants
         float theta = .5f;
 
+        // whether barnes-hut variants add each accepted node's quadrupole moment to its
+        // monopole, buying accuracy at a given theta for a little more work per node
+        bool quadrupole = false;
+
+        // whether the GPU barnes-hut variants build their tree on the device, from the bodies
+        // already there, rather than on the host from positions read back every step. Off
+        // until the device build has been run against the host's on a software driver.
+        bool gpu_tree = false;
+
+        // How many steps the GPU SoA variants may have queued on the device at once, 1 to 3.
+        // Above 1, update() returns once its step is submitted, and only a read of the
+        // bodies, or a tree built on the host from their positions, waits for it. The
+        // interleaved GPU variants always wait; other variants ignore it.
+        int frames_in_flight = 1;
+
+        // order of the fast multipole method's expansions, 1 to 6; ignored by other variants
+        int fmm_order = 4;
+
+        // Cache blocking of the CPU brute-force sum: how many target bodies are swept
+        // together over how many source bodies at a time. Tuning only -- any values give
+        // the same forces -- and best set per host; see the "brute-force blocking"
+        // benchmark. Ignored by other variants.
+        size_t block_targets = 256;
+        size_t block_sources = 8192;
+
+        // whether the CPU brute-force sum evaluates each pair once for both bodies rather
+        // than once from each side: half the arithmetic, the same forces up to the order
+        // they are summed in; ignored by other variants
+        bool symmetric = false;
+
         // gravitational constant
         float gravity = G;
 
         // whether space wraps into a 3-torus
         bool wrap = true;
 
+        // how update() steps; honoured by every variant
+        Integrator integrator = Integrator::Euler;
+
+        // what the CPU variants integrate in
+        Precision precision = Precision::Single;
+
+        // How many steps apart Sim puts the bodies back in order along a space-filling curve,
+        // so that bodies near each other in space are near each other in memory; zero never.
+        size_t reorder_every = 0;
+
+        // For Integrator::Hierarchical: the deepest level a body may step at, dt / 2^levels,
+        // and the share of the time its velocity takes to change by itself, |v| / |a|, that
+        // one of its steps may span.
+        int timestep_levels = 6;
+        float timestep_accuracy = .05f;
+
+        // For Sim::step() and Sim::run_until(): the share of the least sqrt(radius / |a|) over
+        // the bodies, the time the most accelerated of them takes to fall through its own
+        // radius, up to a constant, that an adaptive step may span.
+        float timestep_eta = .2f;
+
+        // the simulated time, advanced by every step
+        double time = 0;
+
         // The canonical body array. For a variant that works on this vector directly it
         // IS the simulation; for one holding its own representation it is a cache that
         // Solver::state() materializes on demand. Either way it is guaranteed current
         // when Sim::state() or Sim::bodies() returns.
         std::vector<Body> bodies;
 
+        // For each body, the index the caller knows it by: bodies[i] was put at permutation[i]
+        // by the caller, before any reordering moved it. Empty for none yet, the identity.
+        std::vector<uint32_t> permutation;
+
+        // The id Sim gives the next body it numbers. Ids are never handed out twice, so one
+        // whose body is gone stays unused.
+        uint32_t next_id = 1;
+
         // Bumped whenever a caller takes mutating access. Sim compares this against the
         // revision the active solver last ingested to decide whether that solver needs
         // to re-converge, so this is the single source of truth for staleness in the
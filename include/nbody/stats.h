@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+
+namespace nbody
+{
+    // Where the time of the last step went: see Sim::stats(). All times are in seconds.
+    struct StepStats
+    {
+        // How many steps the numbers cover: one after update() or step(), the last batch's
+        // worth after run(). Zero before the first.
+        size_t steps = 0;
+
+        // How long the call took to return, on the host. For a GPU variant that queues its
+        // steps (State::frames_in_flight) that is the recording and submitting, not the
+        // work itself.
+        double host = 0;
+
+        // Whether the device timed its work. False for the CPU variants, and on a device
+        // whose compute queue cannot write timestamps; every device time below is then zero.
+        bool device_timed = false;
+
+        // The device's own account of the step, read off timestamps it wrote between the
+        // segments of each submission, so none of the host's waiting is in it. A segment
+        // counts from the end of the one before, so the barriers ahead of it are its own.
+        double upload = 0;       // copies from staging into the device's buffers
+        double tree = 0;         // building the barnes-hut tree, when the device builds it
+        double accelerate = 0;   // summing the forces
+        double integrate = 0;    // kicking and drifting
+        double readback = 0;     // copies from the device's buffers back into staging
+
+        [[nodiscard]] double transfer() const { return upload + readback; }
+        [[nodiscard]] double compute() const { return tree + accelerate + integrate; }
+    };
+}
@@ -12,6 +12,7 @@ namespace nbody
         GpuBruteForce,      // vulkan compute, exact summation
         GpuBarnesHutSoA,    // vulkan compute, tree approximation, rough SoA memory layout
         GpuBruteForceSoA,   // vulkan compute, exact summation, rough SoA memory layout
+        CpuFmm,             // O(n) fast multipole method over the same tree, multithreaded
 
         Count
     };
@@ -0,0 +1,76 @@
+// The brute-force sum, shared by accelerate.comp and accelerate_split.comp, tiled through
+// shared memory. Each workgroup takes N2_TARGETS * N2_TILE bodies, N2_TARGETS to an
+// invocation, and walks every body as a source one tile at a time: the workgroup loads a
+// tile of positions and masses together, one source per invocation, then every invocation
+// sums the whole tile into each of its targets. A source leaves the storage buffer once per
+// workgroup rather than once per invocation, and leaves shared memory once per invocation
+// rather than once per target.
+//
+// The including shader defines the three functions declared below, which are all that
+// differs between the layouts.
+#ifndef NBODY_ACCELERATE_N2_GLSL
+#define NBODY_ACCELERATE_N2_GLSL
+
+#include "common.glsl"
+
+// Sources per tile, one for each invocation of a workgroup: see local_size_x.
+const uint N2_TILE = 256;
+
+// Targets per invocation. Must match nbody::n2_targets_per_invocation (source/gpu.h), which
+// sizes the dispatch.
+const uint N2_TARGETS = 2;
+
+vec4 body_pos_mass(uint i);          // position in xyz, mass in w
+float body_radius(uint i);
+void store_acc(uint i, vec3 acc);
+
+shared vec4 n2_tile[N2_TILE];
+
+// Every invocation of the dispatch must call this, in or out of range: each loads its share
+// of every tile, and the barriers wait for all of them.
+void accelerate_n2_tiled()
+{
+    const uint n = uint(pc.num_bodies);
+    const uint local = gl_LocalInvocationID.x;
+
+    // An invocation's targets are a workgroup's width apart, so each load and store of them
+    // is one contiguous run across the workgroup.
+    const uint first = gl_WorkGroupID.x * N2_TILE * N2_TARGETS + local;
+
+    vec3 pos[N2_TARGETS];
+    float radius[N2_TARGETS];
+    vec3 acc[N2_TARGETS];
+    for (uint k = 0; k < N2_TARGETS; ++k)
+    {
+        const uint i = first + k * N2_TILE;
+        pos[k] = i < n ? body_pos_mass(i).xyz : vec3(0);
+        radius[k] = i < n ? body_radius(i) : 0.;
+        acc[k] = vec3(0);
+    }
+
+    for (uint start = 0; start < n; start += N2_TILE)
+    {
+        const uint j = start + local;
+        n2_tile[local] = j < n ? body_pos_mass(j) : vec4(0);
+        barrier();   // the whole tile is in before anyone reads it
+
+        // The last tile is short; the count is the same for the whole workgroup.
+        const uint count = min(N2_TILE, n - start);
+        for (uint s = 0; s < count; ++s)
+        {
+            const vec4 source = n2_tile[s];
+            for (uint k = 0; k < N2_TARGETS; ++k)
+                acc[k] += accelerate(pos[k], radius[k], source.xyz, source.w);
+        }
+        barrier();   // and read by everyone before the next one overwrites it
+    }
+
+    for (uint k = 0; k < N2_TARGETS; ++k)
+    {
+        const uint i = first + k * N2_TILE;
+        if (i < n)
+            store_acc(i, acc[k]);
+    }
+}
+
+#endif // NBODY_ACCELERATE_N2_GLSL
@@ -11,7 +11,7 @@ struct Body
     vec3 vel;
     float mass;
     vec3 acc;
-    float __pad;
+    uint id;   // never read or written here; it only rides along with the body
 };
 
 layout(std430, binding = 0) buffer Bodies {
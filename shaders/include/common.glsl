@@ -3,8 +3,9 @@
 // changes.
 //
 // Everything here is independent of the body layout, so that the two being compared share
-// one copy of the force law and the tree traversal. Define NBODY_NODE_BINDING before
-// including to also get the node buffer and the traversal that reads it.
+// one copy of the force law and the tree traversal. Define NBODY_NODE_BINDING,
+// NBODY_POINT_BINDING and NBODY_QUADRUPOLE_BINDING before including to also get the tree's
+// buffers and the traversal that reads them.
 #ifndef NBODY_COMMON_GLSL
 #define NBODY_COMMON_GLSL
 
@@ -19,13 +20,29 @@ struct Node
     float mass;
     uint next;
     uint children;
-    uint __pad0;
-    uint __pad1;
+    uint first;
+    uint count;
+};
+
+// must match nbody::bh::Point (include/nbody/bhtree.h) field for field
+struct Point
+{
+    vec3 pos;
+    float mass;
+};
+
+// must match nbody::bh::Quadrupole (include/nbody/bhtree.h) field for field
+struct Quadrupole
+{
+    float xx, yy, zz;
+    float xy, xz, yz;
+    float pad0;
+    float pad1;
 };
 
 // must match nbody::PushConstants (source/gpu.h) field for field
 layout(push_constant) uniform PushConstants {
-    float dt;
+    float kick;
     float theta;
     float G;
     int num_bodies;
@@ -33,6 +50,12 @@ layout(push_constant) uniform PushConstants {
     int mode;
     float size;
     int wrap;
+    int quadrupole;
+    float drift;
+    uint sort_pass;      // the tree build's: which radix sort pass a dispatch is
+    int level;           // which level of the tree it works on
+    int max_nodes;       // how many nodes the node buffer holds
+    int leaf_capacity;   // and how many bodies a leaf may before it is split
 } pc;
 
 const int N2 = 0;
@@ -55,12 +78,41 @@ vec3 accelerate(vec3 body_pos, float body_radius, vec3 node_pos, float node_mass
     return (pc.G * node_mass * inv_dist_cubed) * delta;
 }
 
+// The quadrupole term of an accepted node, to add to accelerate()'s monopole. Mirrors the
+// quadrupole overload of nbody::detail::gravity() (source/detail/physics.h).
+vec3 accelerate_quadrupole(vec3 body_pos, float body_radius, vec3 node_pos, Quadrupole q)
+{
+    const vec3 r = body_pos - node_pos;
+    const float r_sq = dot(r, r);
+    if (r_sq <= body_radius * body_radius)
+        return vec3(0);
+
+    const vec3 qr = vec3(
+        q.xx * r.x + q.xy * r.y + q.xz * r.z,
+        q.xy * r.x + q.yy * r.y + q.yz * r.z,
+        q.xz * r.x + q.yz * r.y + q.zz * r.z);
+    const float inv_r = inversesqrt(r_sq);
+    const float inv_r2 = inv_r * inv_r;
+    const float inv_r5 = inv_r2 * inv_r2 * inv_r;
+    return pc.G * inv_r5 * (qr - (2.5 * dot(r, qr) * inv_r2) * r);
+}
+
 #ifdef NBODY_NODE_BINDING
 
 layout(std430, binding = NBODY_NODE_BINDING) buffer Nodes {
     Node nodes[];
 };
 
+// The leaves' bodies, leaf by leaf: a leaf's are points[first, first + count).
+layout(std430, binding = NBODY_POINT_BINDING) buffer Points {
+    Point points[];
+};
+
+// One per node, and only when pc.quadrupole is set: otherwise a one-element placeholder.
+layout(std430, binding = NBODY_QUADRUPOLE_BINDING) buffer Quadrupoles {
+    Quadrupole quadrupoles[];
+};
+
 // Reads nothing but the tree, so it is the same code for either body layout.
 vec3 accelerate_nlogn(vec3 pos, float radius)
 {
@@ -77,9 +129,9 @@ vec3 accelerate_nlogn(vec3 pos, float radius)
             continue;
         }
 
-        // If the node has no children, apply function directly, and increment
+        // If the node is a single body, apply function directly, and increment
         // i by one to indicate
-        if (nodes[i].children == 0)
+        if (nodes[i].children == 0 && nodes[i].count <= 1)
         {
             acc += accelerate(pos, radius, nodes[i].com, nodes[i].mass);
             i = nodes[i].next;
@@ -94,6 +146,19 @@ vec3 accelerate_nlogn(vec3 pos, float radius)
         if (dist_sq > node_size_sq * theta_sq)
         {
             acc += accelerate(pos, radius, nodes[i].com, nodes[i].mass);
+            if (pc.quadrupole != 0)
+                acc += accelerate_quadrupole(pos, radius, nodes[i].com, quadrupoles[i]);
+            i = nodes[i].next;
+            continue;
+        }
+
+        // If it is a leaf too close to treat as one mass, sum its bodies directly
+        if (nodes[i].children == 0)
+        {
+            const uint first = nodes[i].first;
+            const uint last = first + nodes[i].count;
+            for (uint b = first; b < last; ++b)
+                acc += accelerate(pos, radius, points[b].pos, points[b].mass);
             i = nodes[i].next;
             continue;
         }
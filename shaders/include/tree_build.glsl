@@ -0,0 +1,118 @@
+// Shared by the tree_*.comp stages, which build the barnes-hut tree on the device out of the
+// bodies already there: morton keys, a radix sort by them, the node array top down a level
+// at a time, and the masses and moments bottom up. The result is the same Node, Point and
+// Quadrupole arrays bh::Tree would have uploaded, so accelerate.comp cannot tell the two
+// apart.
+//
+// Bindings 0-2 are the bodies, in whichever layout; only the key stage reads them. The tree
+// sits at 3-5 as it does in the split layout, and the build's own buffers follow.
+#ifndef NBODY_TREE_BUILD_GLSL
+#define NBODY_TREE_BUILD_GLSL
+
+#define NBODY_NODE_BINDING 3
+#define NBODY_POINT_BINDING 4
+#define NBODY_QUADRUPOLE_BINDING 5
+#include "common.glsl"
+
+// Levels below the root: a key is two words of ten three-bit octants each. Must match
+// nbody::device_tree_depth (source/gpu.h).
+const int TREE_DEPTH = 20;
+
+// Bodies per radix sort tile, one workgroup's worth, and buckets per pass: four bits of key.
+const uint TILE = 256;
+const uint RADIX = 16;
+
+// Each body's morton key as (high word, low word), and the sort's second copy to scatter into.
+layout(std430, binding = 6) buffer Keys {
+    uvec2 keys[];
+};
+
+layout(std430, binding = 7) buffer KeysAlt {
+    uvec2 keys_alt[];
+};
+
+// The body each key belongs to, carried through the sort beside it.
+layout(std430, binding = 8) buffer Order {
+    uint order[];
+};
+
+layout(std430, binding = 9) buffer OrderAlt {
+    uint order_alt[];
+};
+
+// A sort pass's count of each digit in each tile, digit major, then where each starts.
+layout(std430, binding = 10) buffer Histogram {
+    uint histogram[];
+};
+
+// The bodies' positions and masses in their own order, for the gather into leaf order.
+layout(std430, binding = 11) buffer Sources {
+    Point sources[];
+};
+
+// must match nbody::TreeBuildState (source/gpu.h) field for field
+layout(std430, binding = 12) buffer TreeState {
+    uvec4 dispatch[TREE_DEPTH + 1];     // indirect workgroup counts for each level's nodes
+    uint node_count;                    // nodes allocated so far
+    uint node_limit;                    // the first allocation that did not fit, if any
+    uint level_begin[TREE_DEPTH + 2];   // level L is nodes [level_begin[L], level_begin[L + 1])
+} tree;
+
+uint tiles()
+{
+    return (uint(pc.num_bodies) + TILE - 1) / TILE;
+}
+
+// Which of 2^20 cells along one axis a coordinate falls in, counted from the top so that a
+// set bit means the lower half, as Bounds::quadrant() has it. Mirrors cell() in
+// source/bhtree.cpp, clamping included.
+uint cell(float x)
+{
+    const uint last = (1u << 20) - 1u;
+    const float c = (x + .5 * pc.size) * (float(1u << 20) / pc.size);
+    if (!(c > 0.))
+        return last;
+    if (c >= float(last))
+        return 0u;
+    return last - uint(c);
+}
+
+// Spread the low 10 bits of v out to every third bit.
+uint spread_bits(uint v)
+{
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8)) & 0x0300f00fu;
+    v = (v | (v << 4)) & 0x030c30c3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+// The key stage's work for body i, whichever layout it came from.
+void write_key(uint i, vec3 pos, float mass)
+{
+    const uvec3 c = uvec3(cell(pos.x), cell(pos.y), cell(pos.z));
+    const uvec3 hi = c >> 10;
+    const uvec3 lo = c & 0x3ffu;
+    keys[i] = uvec2(
+        spread_bits(hi.x) | (spread_bits(hi.y) << 1) | (spread_bits(hi.z) << 2),
+        spread_bits(lo.x) | (spread_bits(lo.y) << 1) | (spread_bits(lo.z) << 2));
+    order[i] = i;
+    sources[i] = Point(pos, mass);
+}
+
+// The digit a radix sort pass orders by: the low word's eight first, then the high word's.
+uint sort_digit(uvec2 key, uint sort_pass)
+{
+    const uint word = sort_pass < 8 ? key.y : key.x;
+    return (word >> (4 * (sort_pass % 8))) & 0xfu;
+}
+
+// The octant of a node at `level` that a key lies in, as Bounds::quadrant() numbers them.
+uint octant(uvec2 key, int level)
+{
+    const int shift = 3 * (TREE_DEPTH - 1 - level);
+    return shift >= 30 ? (key.x >> (shift - 30)) & 7u : (key.y >> shift) & 7u;
+}
+
+#endif // NBODY_TREE_BUILD_GLSL
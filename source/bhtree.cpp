@@ -1,9 +1,248 @@
+#include <algorithm>
+#include <limits>
 #include "nbody/bhtree.h"
 #include "nbody/profile.h"
 
+using nbody::Bounds;
+using nbody::Vector;
 using nbody::bh::Node;
+using nbody::bh::Point;
+using nbody::bh::Quadrupole;
 using nbody::bh::Tree;
 
+namespace
+{
+    // Bits of key per axis. Three axes of 21 fill a 64-bit key, which resolves a cell of
+    // size/2^21 -- about 5e-3 at the default world size. Bodies closer together than that
+    // share a key, and the builder separates them by position instead.
+    constexpr uint32_t morton_bits = 21;
+
+    // Bodies per subtree handed to a worker. Below this, splitting the work further costs
+    // more in bookkeeping than it wins back.
+    constexpr size_t min_subtree_bodies = 2048;
+
+    // Sorted runs each worker starts from before the pairwise merges.
+    constexpr size_t sort_run = size_t(1) << 14;
+
+    // Placeholder `next` for the last child of a subtree's top block, whose real target lies
+    // outside the subtree and is only known once it is stitched into place.
+    constexpr uint32_t subtree_exit = std::numeric_limits<uint32_t>::max();
+
+    // Spread the low 21 bits of v out to every third bit.
+    uint64_t spread_bits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8) & 0x100f00f00f00f00f;
+        v = (v | v << 4) & 0x10c30c30c30c30c3;
+        v = (v | v << 2) & 0x1249249249249249;
+        return v;
+    }
+
+    // Which of 2^21 cells along one axis a coordinate falls in, counted from the *top*: a set
+    // bit in Bounds::quadrant() means the lower half, and counting downward makes every three
+    // bits of the key read as exactly the quadrant insert() would have descended into.
+    //
+    // Clamped, so a body outside the bounds lands in the edge cell. That is also where the
+    // quadrant tests in insert() put it, one comparison against the center at a time.
+    uint64_t cell(const float x, const float lo, const float scale)
+    {
+        constexpr uint64_t last = (uint64_t(1) << morton_bits) - 1;
+        const float c = (x - lo) * scale;
+        if (!(c > 0.f))   // also catches NaN
+            return last;
+        if (c >= float(last))
+            return 0;
+        return last - uint64_t(c);
+    }
+
+    uint64_t morton_key(const Vector& pos, const Vector& lo, const float scale)
+    {
+        return
+            (spread_bits(cell(pos.x, lo.x, scale)) << 0) |
+            (spread_bits(cell(pos.y, lo.y, scale)) << 1) |
+            (spread_bits(cell(pos.z, lo.z, scale)) << 2);
+    }
+
+    // Set a node's mass and center of mass from the eight children that follow `first`.
+    void gather(Node& node, const Node* const children)
+    {
+        Vector weighted = { 0, 0, 0 };
+        float mass = 0;
+        for (uint8_t q = 0; q < 8; ++q)
+        {
+            weighted += children[q].com * children[q].mass;
+            mass += children[q].mass;
+        }
+        node.mass = mass;
+        if (mass > 0)
+            node.com = weighted / mass;
+    }
+
+    // Set a leaf's mass and center of mass from the `count` bodies body(0) .. body(count - 1).
+    template <typename BodyAt>
+    void total_leaf(Node& node, const size_t count, const BodyAt& body)
+    {
+        if (count == 1)
+        {
+            node.com = body(0).pos;
+            node.mass = body(0).mass;
+            return;
+        }
+
+        Vector weighted = { 0, 0, 0 };
+        float mass = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Point& point = body(i);
+            weighted += point.pos * point.mass;
+            mass += point.mass;
+        }
+        node.mass = mass;
+        if (mass > 0)
+            node.com = weighted / mass;
+    }
+}
+
+// A cell of at most min_subtree_bodies bodies, left for a worker to split.
+struct Tree::Subtree
+{
+    uint32_t node;
+    size_t begin;
+    size_t end;
+    uint32_t level;
+};
+
+// Emits the node array from bodies already in morton order. A cell's bodies are then a
+// contiguous run of the sorted array, and its eight children are eight consecutive runs
+// within it, so splitting a cell is a handful of binary searches rather than a pass over
+// its bodies.
+class Tree::Emitter
+{
+public:
+
+    Emitter(Keyed* const sorted, const Point* const points, const uint32_t capacity)
+        : _sorted(sorted), _points(points), _capacity(capacity) {}
+
+    // Append the eight children of a cell at `level` holding sorted[begin, end), then
+    // recurse depth first into each that holds more than one body. Returns the index of
+    // the first child, for the caller to store as the cell's `children`.
+    //
+    // With `defer`, a child small enough to be a worker's share is recorded there instead
+    // of split, and everything above it is left for a bottom-up pass to total.
+    //
+    // `bounds` by value: callers pass a node's own, and `out` grows underneath it.
+    uint32_t split(
+        std::vector<Node>& out,
+        const Bounds bounds,
+        const uint32_t exit,
+        const size_t begin,
+        const size_t end,
+        const uint32_t level,
+        std::vector<Subtree>* const defer = nullptr)
+    {
+        size_t ranges[9];
+        partition(bounds, begin, end, level, ranges);
+
+        // The same block insert() appends when it splits a node.
+        const uint32_t first = uint32_t(out.size());
+        for (uint8_t q = 0; q < 8; ++q)
+            out.push_back({ .bounds = bounds.quadrant_bounds(q), .next = q < 7 ? first + q + 1 : exit });
+
+        for (uint8_t q = 0; q < 8; ++q)
+        {
+            const uint32_t child = first + q;
+            const size_t child_begin = ranges[q];
+            const size_t child_end = ranges[q + 1];
+            const size_t count = child_end - child_begin;
+            if (count == 0)
+                continue;
+
+            // Few enough bodies for one leaf, or bodies too close together to split any
+            // further: insert()'s epsilon cutoff, applied to the node that would be split.
+            if (count <= _capacity || out[child].bounds.size < std::numeric_limits<float>::epsilon())
+            {
+                leaf(out[child], child_begin, child_end);
+                continue;
+            }
+
+            if (defer && count <= min_subtree_bodies)
+            {
+                defer->push_back({ child, child_begin, child_end, level + 1 });
+                continue;
+            }
+
+            // `out` may reallocate in here, so nothing above holds a reference into it.
+            const uint32_t children = split(out, out[child].bounds, out[child].next, child_begin, child_end, level + 1, defer);
+            out[child].children = children;
+            gather(out[child], &out[children]);
+        }
+
+        return first;
+    }
+
+    // Total the bodies of a cell that is not split any further. The sorted order becomes the
+    // tree's slot order, so they are also the leaf's slots.
+    void leaf(Node& node, const size_t begin, const size_t end) const
+    {
+        node.first = uint32_t(begin);
+        node.count = uint32_t(end - begin);
+        total_leaf(node, end - begin, [this, begin](const size_t i) -> const Point& { return _points[_sorted[begin + i].index]; });
+    }
+
+private:
+
+    // Split sorted[begin, end) into the runs for each of the eight quadrants of `bounds`.
+    void partition(const Bounds& bounds, const size_t begin, const size_t end, const uint32_t level, size_t (&ranges)[9]) const
+    {
+        ranges[0] = begin;
+        ranges[8] = end;
+
+        if (level < morton_bits)
+        {
+            const uint32_t shift = 3 * (morton_bits - 1 - level);
+
+            // Most cells near the leaves hold a handful of bodies, where counting them beats
+            // seven binary searches.
+            if (end - begin <= 16)
+            {
+                size_t counts[8] = {};
+                for (size_t i = begin; i < end; ++i)
+                    ++counts[(_sorted[i].key >> shift) & 7];
+                for (uint8_t q = 0; q < 7; ++q)
+                    ranges[q + 1] = ranges[q] + counts[q];
+                return;
+            }
+
+            for (uint8_t q = 0; q < 7; ++q)
+                ranges[q + 1] = size_t(std::partition_point(
+                    _sorted + ranges[q], _sorted + end,
+                    [shift, q](const Keyed& k) { return ((k.key >> shift) & 7) <= q; }) - _sorted);
+            return;
+        }
+
+        // Past the resolution of the keys, so every body here shares one. Only bodies
+        // within a few thousandths of each other get this far; order them by the quadrant
+        // tests insert() uses and carry on.
+        const auto quadrant = [this, &bounds](const Keyed& k) { return bounds.quadrant(_points[k.index].pos); };
+        std::sort(_sorted + begin, _sorted + end, [&quadrant](const Keyed& a, const Keyed& b)
+        {
+            const uint8_t qa = quadrant(a);
+            const uint8_t qb = quadrant(b);
+            return qa < qb || (qa == qb && a.index < b.index);
+        });
+        for (uint8_t q = 0; q < 7; ++q)
+            ranges[q + 1] = size_t(std::partition_point(
+                _sorted + ranges[q], _sorted + end,
+                [&quadrant, q](const Keyed& k) { return quadrant(k) <= q; }) - _sorted);
+    }
+
+    Keyed* const _sorted;
+    const Point* const _points;
+    const uint32_t _capacity;
+};
+
 void Tree::reserve(const size_t max_nodes)
 {
     NBODY_PROFILE_ZONE();
@@ -13,6 +252,11 @@ void Tree::reserve(const size_t max_nodes)
 
 void Tree::insert(const Vector& position, const float mass)
 {
+    // The tree no longer holds just the bodies of its last build(), so refit() must not
+    // start from it.
+    _leaf_of.clear();
+    _quadrupoles.clear();
+
     uint32_t node_index = 0;
 
     // Recurse until we find a leaf node
@@ -84,57 +328,446 @@ void Tree::insert(const Vector& position, const float mass)
     }
 }
 
-void Tree::accumulate(const uint32_t node_index, const Vector& position, const float mass)
+void Tree::run(const Parallel& parallel, const size_t n, const std::function<void(size_t, size_t)>& block)
 {
-    const Vector node_position = _nodes[node_index].com;
-    const float node_mass = _nodes[node_index].mass;
-    const float total_mass = mass + node_mass;
-    const Vector total_position = ((position * mass) + (node_position * node_mass)) / total_mass;
-    _nodes[node_index].mass = total_mass;
-    _nodes[node_index].com = total_position;
+    if (n == 0)
+        return;
+    if (parallel)
+        parallel(n, block);
+    else
+        block(0, n);
 }
 
-void Tree::apply(const Vector& pos, const std::function<void(const Node& node)>& func, const float theta) const
+void Tree::build(const Bounds& new_bounds, const Parallel& parallel)
+{
+    emit(new_bounds, parallel);
+    locate(parallel);
+    if (_quadrupole)
+        total_quadrupoles(parallel);
+    else
+        _quadrupoles.clear();
+}
+
+void Tree::emit(const Bounds& new_bounds, const Parallel& parallel)
 {
     NBODY_PROFILE_ZONE();
 
-    const float theta_sq = theta * theta;
+    _nodes.clear();
+    _nodes.push_back({ new_bounds });
+    _anchors.clear();
+    _refits = 0;
+
+    const size_t count = _points.size();
+    if (count == 0)
+        return;
 
-    uint32_t node_index = 0;
-    do
     {
-        const Node& node = _nodes[node_index];
+        NBODY_PROFILE_ZONE_NAMED("morton keys");
+        const Vector lo = new_bounds.min();
+        const float scale = float(uint64_t(1) << morton_bits) / new_bounds.size;
+        _keys.resize(count);
+        run(parallel, count, [this, lo, scale](const size_t begin, const size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                _keys[i] = { morton_key(_points[i].pos, lo, scale), uint32_t(i) };
+        });
+    }
 
-        // If the node is empty, skip it
-        if (node.mass == 0)
+    {
+        // Sorted runs on the workers, then merged pairwise, the merges of each round also
+        // spread across the workers. The index breaks ties so the order is deterministic.
+        NBODY_PROFILE_ZONE_NAMED("morton sort");
+        const auto less = [](const Keyed& a, const Keyed& b)
         {
-            node_index = node.next;
-            continue;
+            return a.key < b.key || (a.key == b.key && a.index < b.index);
+        };
+
+        const size_t runs = (count + sort_run - 1) / sort_run;
+        run(parallel, runs, [this, count, &less](const size_t begin, const size_t end)
+        {
+            for (size_t r = begin; r < end; ++r)
+                std::sort(_keys.begin() + r * sort_run, _keys.begin() + std::min(count, (r + 1) * sort_run), less);
+        });
+
+        _keys_merge.resize(count);
+        for (size_t width = sort_run; width < count; width *= 2)
+        {
+            const size_t pairs = (count + 2 * width - 1) / (2 * width);
+            run(parallel, pairs, [this, count, width, &less](const size_t begin, const size_t end)
+            {
+                for (size_t p = begin; p < end; ++p)
+                {
+                    const size_t lo = p * 2 * width;
+                    const size_t mid = std::min(count, lo + width);
+                    const size_t hi = std::min(count, lo + 2 * width);
+                    std::merge(
+                        _keys.begin() + lo, _keys.begin() + mid,
+                        _keys.begin() + mid, _keys.begin() + hi,
+                        _keys_merge.begin() + lo, less);
+                }
+            });
+            _keys.swap(_keys_merge);
         }
+    }
+
+    NBODY_PROFILE_ZONE_NAMED("emit nodes");
+    Emitter emitter(_keys.data(), _points.data(), _leaf_capacity);
+
+    // Root-level special cases, as insert() would have them: a leaf's worth of bodies, or all
+    // of them within epsilon of each other, is a leaf.
+    if (count <= _leaf_capacity || new_bounds.size < std::numeric_limits<float>::epsilon())
+    {
+        emitter.leaf(_nodes[0], 0, count);
+        return;
+    }
+
+    // The top of the tree, serially, down to cells small enough to be a worker's share. Few
+    // nodes, however many bodies: every cell up here holds more than min_subtree_bodies.
+    std::vector<Subtree> subtrees;
+    _nodes[0].children = emitter.split(_nodes, new_bounds, _nodes[0].next, 0, count, 0, &subtrees);
 
-        // If the node has no children, apply function directly, and increment
-        // node_index by one to indicate 
-        if (node.children == 0)
+    // Each subtree into a vector of its own, with indices local to it. Deep subtrees are
+    // nearly all of the nodes, and none of them depends on another.
+    if (_subtrees.size() < subtrees.size())
+        _subtrees.resize(subtrees.size());
+    run(parallel, subtrees.size(), [this, &emitter, &subtrees](const size_t begin, const size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
         {
-            func(node);
-            node_index = node.next;
-            continue;
+            const Subtree& subtree = subtrees[t];
+            std::vector<Node>& out = _subtrees[t];
+            out.clear();
+            emitter.split(out, _nodes[subtree.node].bounds, subtree_exit, subtree.begin, subtree.end, subtree.level);
         }
+    });
 
-        // If the node is far enough away apply the node function
-        const float node_size_sq = node.bounds.size * node.bounds.size;
-        const Vector delta = node.com - pos;
-        const float dist_sq = dot(delta, delta);
-        if (dist_sq > node_size_sq * theta_sq)
+    // Stitch them in after the top, each shifted to where it lands.
+    const size_t top = _nodes.size();
+    std::vector<uint32_t> offsets(subtrees.size());
+    size_t total = top;
+    for (size_t t = 0; t < subtrees.size(); ++t)
+    {
+        offsets[t] = uint32_t(total);
+        _nodes[subtrees[t].node].children = offsets[t];
+        total += _subtrees[t].size();
+    }
+    _nodes.resize(total);
+
+    run(parallel, subtrees.size(), [this, &subtrees, &offsets](const size_t begin, const size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
         {
-            func(node);
-            node_index = node.next;
-            continue;
+            const uint32_t offset = offsets[t];
+            const uint32_t exit = _nodes[subtrees[t].node].next;
+            Node* out = &_nodes[offset];
+            for (const Node& node : _subtrees[t])
+            {
+                *out = node;
+                if (out->children != 0)
+                    out->children += offset;
+                out->next = node.next == subtree_exit ? exit : node.next + offset;
+                ++out;
+            }
         }
+    });
+
+    // Total the top from the bottom up. Every node's children sit after it in the array, so a
+    // reverse sweep reaches them first.
+    for (size_t i = top; i-- > 0;)
+        if (_nodes[i].children != 0)
+            gather(_nodes[i], &_nodes[_nodes[i].children]);
 
-        // If we need to drill down, start looking at the node's children
-        node_index = node.children;
-    } while (0 < node_index && node_index < _nodes.size());
+    for (const Subtree& subtree : subtrees)
+        _anchors.push_back(subtree.node);
+    std::sort(_anchors.begin(), _anchors.end());
+}
+
+void Tree::locate(const Parallel& parallel)
+{
+    NBODY_PROFILE_ZONE();
+
+    const size_t count = _points.size();
+    _slots.resize(count);
+    _leaf_of.resize(count);
+    _slot_of.resize(count);
+    run(parallel, count, [this](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            _slots[i] = _keys[i].index;
+            _slot_of[_keys[i].index] = uint32_t(i);
+        }
+    });
+
+    // Over the nodes rather than the bodies: each leaf owns its own run of slots, so the
+    // blocks write disjoint bodies.
+    run(parallel, count == 0 ? 0 : _nodes.size(), [this](const size_t begin, const size_t end)
+    {
+        for (size_t n = begin; n < end; ++n)
+        {
+            const Node& node = _nodes[n];
+            if (node.children != 0)
+                continue;
+            for (uint32_t s = node.first; s < node.first + node.count; ++s)
+                _leaf_of[_slots[s]] = uint32_t(n);
+        }
+    });
+
+    arrange(parallel);
+}
+
+void Tree::arrange(const Parallel& parallel)
+{
+    NBODY_PROFILE_ZONE();
+
+    _leaf_points.resize(_slots.size());
+    run(parallel, _slots.size(), [this](const size_t begin, const size_t end)
+    {
+        for (size_t s = begin; s < end; ++s)
+            _leaf_points[s] = _points[_slots[s]];
+    });
+}
+
+bool Tree::refittable_to(const Bounds& new_bounds, const size_t count) const
+{
+    return
+        count > 0 &&
+        count == _leaf_of.size() &&
+        new_bounds.center == bounds().center &&
+        new_bounds.size == bounds().size &&
+        _refits < _refit_limits.max_refits;
+}
+
+uint32_t Tree::descend(const Vector& pos) const
+{
+    uint32_t node_index = 0;
+    while (_nodes[node_index].children != 0)
+        node_index = _nodes[node_index].children + _nodes[node_index].bounds.quadrant(pos);
+    return node_index;
+}
+
+bool Tree::refit(const Parallel& parallel)
+{
+    NBODY_PROFILE_ZONE();
+
+    const size_t count = _points.size();
+
+    // Where every body is now. Nearly all are still inside their leaf's bounds; the rest, and
+    // those outside the root that the edge leaves catch, go back to the quadrant tests.
+    _found.resize(count);
+    run(parallel, count, [this](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const uint32_t leaf = _leaf_of[i];
+            _found[i] = _nodes[leaf].bounds.contains(_points[i].pos) ? leaf : descend(_points[i].pos);
+        }
+    });
+
+    std::vector<uint32_t> migrants;
+    for (uint32_t i = 0; i < count; ++i)
+        if (_found[i] != _leaf_of[i])
+            migrants.push_back(i);
+
+    NBODY_PROFILE_PLOT("bh migrated", static_cast<int64_t>(migrants.size()));
+    if (float(migrants.size()) > _refit_limits.max_migrated * float(count))
+        return false;
+
+    if (!migrants.empty())
+    {
+        NBODY_PROFILE_ZONE_NAMED("move bodies");
+
+        // Out of the leaves they left, each by moving its leaf's last slot into its place.
+        for (const uint32_t i : migrants)
+        {
+            Node& leaf = _nodes[_leaf_of[i]];
+            const uint32_t last = _slots[leaf.first + --leaf.count];
+            _slots[_slot_of[i]] = last;
+            _slot_of[last] = _slot_of[i];
+            _leaf_of[i] = _found[i];
+        }
+
+        // Into the leaves they entered. Those have no room to grow where they are, so each
+        // is copied to the end of the slots with its arrivals after it, and its old run left
+        // unused until the next build().
+        std::stable_sort(migrants.begin(), migrants.end(), [this](const uint32_t a, const uint32_t b) { return _found[a] < _found[b]; });
+        for (size_t m = 0; m < migrants.size();)
+        {
+            const uint32_t index = _found[migrants[m]];
+            Node& leaf = _nodes[index];
+            const uint32_t first = uint32_t(_slots.size());
+            for (uint32_t s = leaf.first; s < leaf.first + leaf.count; ++s)
+            {
+                const uint32_t body = _slots[s];
+                _slots.push_back(body);
+            }
+            for (; m < migrants.size() && _found[migrants[m]] == index; ++m)
+                _slots.push_back(migrants[m]);
+            leaf.first = first;
+            leaf.count = uint32_t(_slots.size()) - first;
+            for (uint32_t s = leaf.first; s < leaf.first + leaf.count; ++s)
+                _slot_of[_slots[s]] = s;
+
+            // Then split as insert() would have, were it now holding more than one body.
+            split(index);
+        }
+    }
+
+    // Every body has moved, whether or not it changed leaf.
+    arrange(parallel);
+
+    // Moments from the bottom up: the subtrees build() handed out on the workers, then the top
+    // above them on this thread.
+    {
+        NBODY_PROFILE_ZONE_NAMED("total moments");
+        const std::vector<uint32_t> none;
+        run(parallel, _anchors.size(), [this, &none](const size_t begin, const size_t end)
+        {
+            for (size_t a = begin; a < end; ++a)
+                total(_anchors[a], none);
+        });
+        total(0, _anchors);
+    }
+    if (_quadrupole)
+        total_quadrupoles(parallel);
+
+    ++_refits;
+    return true;
+}
+
+void Tree::split(const uint32_t index)
+{
+    const Bounds bounds = _nodes[index].bounds;
+    const uint32_t first = _nodes[index].first;
+    const uint32_t count = _nodes[index].count;
+    if (_nodes[index].children != 0 || count <= _leaf_capacity || bounds.size < std::numeric_limits<float>::epsilon())
+        return;
+
+    // Order the leaf's slots by quadrant, so each child takes a run of them.
+    uint32_t* const slots = _slots.data() + first;
+    const auto quadrant = [this, &bounds](const uint32_t i) { return bounds.quadrant(_points[i].pos); };
+    std::sort(slots, slots + count, [&quadrant](const uint32_t a, const uint32_t b)
+    {
+        const uint8_t qa = quadrant(a);
+        const uint8_t qb = quadrant(b);
+        return qa < qb || (qa == qb && a < b);
+    });
+    for (uint32_t s = first; s < first + count; ++s)
+        _slot_of[_slots[s]] = s;
+
+    // Appended, as insert() would: the depth-first order is lost until the next build().
+    const uint32_t child = uint32_t(_nodes.size());
+    _nodes[index].children = child;
+    _nodes[index].first = 0;
+    _nodes[index].count = 0;
+    uint32_t at = first;
+    for (uint8_t q = 0; q < 8; ++q)
+    {
+        uint32_t end = at;
+        while (end < first + count && quadrant(_slots[end]) == q)
+            _leaf_of[_slots[end++]] = child + q;
+        _nodes.push_back({
+            .bounds = bounds.quadrant_bounds(q),
+            .next = q < 7 ? child + q + 1 : _nodes[index].next,
+            .first = at,
+            .count = end - at });
+        at = end;
+    }
+
+    for (uint8_t q = 0; q < 8; ++q)
+        split(child + q);
+}
+
+void Tree::total(const uint32_t index, const std::vector<uint32_t>& done)
+{
+    Node& node = _nodes[index];
+    if (node.children == 0)
+    {
+        node.com = { 0, 0, 0 };
+        node.mass = 0;
+        if (node.count > 0)
+            total_leaf(node, node.count, [this, &node](const size_t i) -> const Point& { return _leaf_points[node.first + i]; });
+        return;
+    }
+
+    for (uint32_t q = 0; q < 8; ++q)
+        if (!std::binary_search(done.begin(), done.end(), node.children + q))
+            total(node.children + q, done);
+    gather(node, &_nodes[node.children]);
+}
+
+void Tree::total_quadrupoles(const Parallel& parallel)
+{
+    NBODY_PROFILE_ZONE();
+
+    _quadrupoles.resize(_nodes.size());
+    const std::vector<uint32_t> none;
+    run(parallel, _anchors.size(), [this, &none](const size_t begin, const size_t end)
+    {
+        for (size_t a = begin; a < end; ++a)
+            total_quadrupoles(_anchors[a], none);
+    });
+    total_quadrupoles(0, _anchors);
+}
+
+void Tree::total_quadrupoles(const uint32_t index, const std::vector<uint32_t>& done)
+{
+    const Node& node = _nodes[index];
+    Quadrupole& quadrupole = _quadrupoles[index];
+    quadrupole = {};
+
+    // Each mass m at offset d from the center contributes m * (3 d d^T - |d|^2 I).
+    const auto add = [&quadrupole, &node](const Vector& pos, const float mass)
+    {
+        const Vector d = pos - node.com;
+        const float d_sq = dot(d, d);
+        quadrupole.xx += mass * (3 * d.x * d.x - d_sq);
+        quadrupole.yy += mass * (3 * d.y * d.y - d_sq);
+        quadrupole.zz += mass * (3 * d.z * d.z - d_sq);
+        quadrupole.xy += mass * 3 * d.x * d.y;
+        quadrupole.xz += mass * 3 * d.x * d.z;
+        quadrupole.yz += mass * 3 * d.y * d.z;
+    };
+
+    if (node.children == 0)
+    {
+        for (uint32_t i = node.first; i < node.first + node.count; ++i)
+            add(_leaf_points[i].pos, _leaf_points[i].mass);
+        return;
+    }
+
+    // A child's own moment about its center, then shifted to this one's: the parallel axis
+    // theorem, for which the child counts as a point mass at its center.
+    for (uint32_t q = 0; q < 8; ++q)
+    {
+        const uint32_t child = node.children + q;
+        if (!std::binary_search(done.begin(), done.end(), child))
+            total_quadrupoles(child, done);
+        const Quadrupole& c = _quadrupoles[child];
+        quadrupole.xx += c.xx;
+        quadrupole.yy += c.yy;
+        quadrupole.zz += c.zz;
+        quadrupole.xy += c.xy;
+        quadrupole.xz += c.xz;
+        quadrupole.yz += c.yz;
+        add(_nodes[child].com, _nodes[child].mass);
+    }
+}
+
+void Tree::accumulate(const uint32_t node_index, const Vector& position, const float mass)
+{
+    const Vector node_position = _nodes[node_index].com;
+    const float node_mass = _nodes[node_index].mass;
+    const float total_mass = mass + node_mass;
+    const Vector total_position = ((position * mass) + (node_position * node_mass)) / total_mass;
+    _nodes[node_index].mass = total_mass;
+    _nodes[node_index].com = total_position;
+}
+
+void Tree::apply(const Vector& pos, const std::function<void(const Node& node)>& func, const float theta) const
+{
+    NBODY_PROFILE_ZONE();
+    apply<const std::function<void(const Node&)>&>(pos, func, theta);
 }
 
 void Tree::clear(const Bounds& new_bounds)
@@ -143,6 +776,11 @@ void Tree::clear(const Bounds& new_bounds)
 
     _nodes.clear();
     _nodes.push_back({ new_bounds });
+    _points.clear();
+    _leaf_of.clear();
+    _slots.clear();
+    _leaf_points.clear();
+    _quadrupoles.clear();
 }
 
 void Tree::clear()
@@ -152,22 +790,8 @@ void Tree::clear()
 
 void Tree::query(const Ray& ray, const std::function<bool(const Node&)>& visitor) const
 {
-    // Once per picking ray. insert(), accumulate() and apply() run per body or per node
-    // visited, so they are left uninstrumented.
+    // Once per picking ray. insert(), accumulate() and the solvers' apply() run per body or
+    // per node visited, so they are left uninstrumented.
     NBODY_PROFILE_ZONE();
-    uint32_t node_index = 0;
-    do
-    {
-        const Node& node = _nodes[node_index];
-        if (node.bounds.ray_intersect(ray))
-        {
-            if (!visitor(node))
-                break;
-            node_index
-                = node.children
-                ? node.children
-                : node.next;
-        }
-    }
-    while (node_index != 0);
+    query<const std::function<bool(const Node&)>&>(ray, visitor);
 }
@@ -0,0 +1,540 @@
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include "detail/brute_force.h"
+#include "detail/parallel.h"
+#include "detail/physics.h"
+#include "nbody/profile.h"
+
+// The vector kernels are x86 only. Everywhere else -- arm64 -- the scalar loop is the kernel,
+// and the compiler is left to vectorize it for NEON.
+#if defined(__x86_64__) || defined(_M_X64)
+#define NBODY_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC emits any intrinsic it is asked for, whatever /arch says, so it needs no per-function
+// target. GCC and clang refuse an intrinsic outside a function built for its extension.
+#define NBODY_TARGET(isa)
+#else
+#define NBODY_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+using nbody::Body;
+using nbody::detail::Simd;
+using nbody::detail::SourceTiles;
+
+namespace
+{
+    constexpr size_t tile = SourceTiles::tile;
+
+    // Each kernel sums `count` tiles on one target and returns the acceleration over G. The
+    // schedule around it is the caller's.
+    using Kernel = nbody::Vector (*)(const SourceTiles::Tile* tiles, size_t count, const nbody::Vector& pos, float radius);
+
+    nbody::Vector sum_scalar(const SourceTiles::Tile* const tiles, const size_t count, const nbody::Vector& pos, const float radius)
+    {
+        nbody::Vector acc = { 0, 0, 0 };
+        for (size_t t = 0; t < count; ++t)
+            for (size_t j = 0; j < tile; ++j)
+                acc += nbody::detail::gravity(pos, radius, { tiles[t].x[j], tiles[t].y[j], tiles[t].z[j] }, tiles[t].mass[j], 1.f);
+        return acc;
+    }
+
+    using nbody::detail::PairSums;
+
+    // The symmetric kernels add body i's pairs with every body of tiles [t0, t1) to both
+    // sides' partial sums, over G: i's into its lane, each source's into its own.
+    using SymmetricKernel = void (*)(const SourceTiles::Tile* tiles, PairSums::Tile* sums, size_t i, size_t t0, size_t t1);
+
+    // One pair, body i against body j. Each side has its own cutoff, its own radius.
+    void pair_scalar(const SourceTiles::Tile* const tiles, PairSums::Tile* const sums, const size_t i, const size_t j)
+    {
+        const SourceTiles::Tile& a = tiles[i / tile];
+        const SourceTiles::Tile& b = tiles[j / tile];
+        const size_t la = i % tile;
+        const size_t lb = j % tile;
+        const nbody::Vector delta = { b.x[lb] - a.x[la], b.y[lb] - a.y[la], b.z[lb] - a.z[la] };
+        const float delta_sq = delta.size_sq();
+        const bool a_feels = delta_sq > a.radius[la] * a.radius[la];
+        const bool b_feels = delta_sq > b.radius[lb] * b.radius[lb];
+        if (!a_feels && !b_feels)
+            return;
+
+        const float inv_cube = 1.f / (std::sqrt(delta_sq) * delta_sq);
+        if (a_feels)
+        {
+            const float s = b.mass[lb] * inv_cube;
+            sums[i / tile].x[la] += s * delta.x;
+            sums[i / tile].y[la] += s * delta.y;
+            sums[i / tile].z[la] += s * delta.z;
+        }
+        if (b_feels)
+        {
+            const float s = a.mass[la] * inv_cube;
+            sums[j / tile].x[lb] -= s * delta.x;
+            sums[j / tile].y[lb] -= s * delta.y;
+            sums[j / tile].z[lb] -= s * delta.z;
+        }
+    }
+
+    void symmetric_scalar(const SourceTiles::Tile* const tiles, PairSums::Tile* const sums, const size_t i, const size_t t0, const size_t t1)
+    {
+        const SourceTiles::Tile& a = tiles[i / tile];
+        const size_t la = i % tile;
+        const float px = a.x[la], py = a.y[la], pz = a.z[la];
+        const float mass = a.mass[la];
+        const float radius_sq = a.radius[la] * a.radius[la];
+
+        // A sum per lane rather than one, so the lanes are independent and the compiler free
+        // to vectorize the inner loop without reassociating anything.
+        float ax[tile] = {}, ay[tile] = {}, az[tile] = {};
+        for (size_t t = t0; t < t1; ++t)
+        {
+            const SourceTiles::Tile& b = tiles[t];
+            PairSums::Tile& out = sums[t];
+            for (size_t j = 0; j < tile; ++j)
+            {
+                const float dx = b.x[j] - px;
+                const float dy = b.y[j] - py;
+                const float dz = b.z[j] - pz;
+                const float d_sq = dx * dx + dy * dy + dz * dz;
+
+                // Selects rather than branches. At zero distance inv_cube is infinite, but
+                // then both selects are of zero.
+                const float inv_cube = 1.f / (std::sqrt(d_sq) * d_sq);
+                const float si = d_sq > radius_sq ? b.mass[j] * inv_cube : 0.f;
+                const float sj = d_sq > b.radius[j] * b.radius[j] ? mass * inv_cube : 0.f;
+                ax[j] += si * dx;
+                ay[j] += si * dy;
+                az[j] += si * dz;
+                out.x[j] -= sj * dx;
+                out.y[j] -= sj * dy;
+                out.z[j] -= sj * dz;
+            }
+        }
+
+        for (size_t j = 0; j < tile; ++j)
+        {
+            sums[i / tile].x[la] += ax[j];
+            sums[i / tile].y[la] += ay[j];
+            sums[i / tile].z[la] += az[j];
+        }
+    }
+
+#ifdef NBODY_X86
+
+    // Both kernels take the reciprocal square root from the hardware's estimate, good to 12
+    // bits for AVX2 and 14 for AVX-512, and refine it with one Newton step,
+    //
+    //   y' = y (3/2 - d^2 y^2 / 2)
+    //
+    // which roughly doubles the bits, to about float precision. A source at or within the
+    // body's radius is masked out after the fact; at zero distance the estimate is infinite
+    // and the lane NaN, and the mask clears that too.
+
+    NBODY_TARGET("avx2,fma")
+    float sum_avx2(const __m256 v)
+    {
+        const __m128 quad = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        const __m128 pair = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+        return _mm_cvtss_f32(_mm_add_ss(pair, _mm_movehdup_ps(pair)));
+    }
+
+    NBODY_TARGET("avx2,fma")
+    nbody::Vector sum_avx2(const SourceTiles::Tile* const tiles, const size_t count, const nbody::Vector& pos, const float radius)
+    {
+        const __m256 half = _mm256_set1_ps(.5f);
+        const __m256 three_halves = _mm256_set1_ps(1.5f);
+        const __m256 px = _mm256_set1_ps(pos.x);
+        const __m256 py = _mm256_set1_ps(pos.y);
+        const __m256 pz = _mm256_set1_ps(pos.z);
+        const __m256 radius_sq = _mm256_set1_ps(radius * radius);
+
+        // Each half of a tile into its own accumulators: two independent chains of fused
+        // multiply-adds keep the pipeline fuller than one.
+        __m256 ax[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+        __m256 ay[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+        __m256 az[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+        for (size_t t = 0; t < count; ++t)
+            for (size_t h = 0; h < 2; ++h)
+            {
+                const __m256 dx = _mm256_sub_ps(_mm256_load_ps(tiles[t].x + 8 * h), px);
+                const __m256 dy = _mm256_sub_ps(_mm256_load_ps(tiles[t].y + 8 * h), py);
+                const __m256 dz = _mm256_sub_ps(_mm256_load_ps(tiles[t].z + 8 * h), pz);
+                const __m256 d_sq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+
+                __m256 inv = _mm256_rsqrt_ps(d_sq);
+                inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, d_sq), _mm256_mul_ps(inv, inv), three_halves));
+
+                const __m256 outside = _mm256_cmp_ps(d_sq, radius_sq, _CMP_GT_OQ);
+                const __m256 mass = _mm256_load_ps(tiles[t].mass + 8 * h);
+                const __m256 s = _mm256_and_ps(outside, _mm256_mul_ps(mass, _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv))));
+                ax[h] = _mm256_fmadd_ps(s, dx, ax[h]);
+                ay[h] = _mm256_fmadd_ps(s, dy, ay[h]);
+                az[h] = _mm256_fmadd_ps(s, dz, az[h]);
+            }
+
+        return {
+            sum_avx2(_mm256_add_ps(ax[0], ax[1])),
+            sum_avx2(_mm256_add_ps(ay[0], ay[1])),
+            sum_avx2(_mm256_add_ps(az[0], az[1])),
+        };
+    }
+
+    NBODY_TARGET("avx512f")
+    nbody::Vector sum_avx512(const SourceTiles::Tile* const tiles, const size_t count, const nbody::Vector& pos, const float radius)
+    {
+        const __m512 half = _mm512_set1_ps(.5f);
+        const __m512 three_halves = _mm512_set1_ps(1.5f);
+        const __m512 px = _mm512_set1_ps(pos.x);
+        const __m512 py = _mm512_set1_ps(pos.y);
+        const __m512 pz = _mm512_set1_ps(pos.z);
+        const __m512 radius_sq = _mm512_set1_ps(radius * radius);
+
+        __m512 ax = _mm512_setzero_ps();
+        __m512 ay = _mm512_setzero_ps();
+        __m512 az = _mm512_setzero_ps();
+        for (size_t t = 0; t < count; ++t)
+        {
+            const __m512 dx = _mm512_sub_ps(_mm512_load_ps(tiles[t].x), px);
+            const __m512 dy = _mm512_sub_ps(_mm512_load_ps(tiles[t].y), py);
+            const __m512 dz = _mm512_sub_ps(_mm512_load_ps(tiles[t].z), pz);
+            const __m512 d_sq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+
+            __m512 inv = _mm512_rsqrt14_ps(d_sq);
+            inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, d_sq), _mm512_mul_ps(inv, inv), three_halves));
+
+            const __mmask16 outside = _mm512_cmp_ps_mask(d_sq, radius_sq, _CMP_GT_OQ);
+            const __m512 mass = _mm512_load_ps(tiles[t].mass);
+            const __m512 s = _mm512_maskz_mul_ps(outside, mass, _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+            ax = _mm512_fmadd_ps(s, dx, ax);
+            ay = _mm512_fmadd_ps(s, dy, ay);
+            az = _mm512_fmadd_ps(s, dz, az);
+        }
+
+        return { _mm512_reduce_add_ps(ax), _mm512_reduce_add_ps(ay), _mm512_reduce_add_ps(az) };
+    }
+
+    // The symmetric kernels run the same arithmetic once per pair, with a second mask for
+    // the source's side, against the source's radius. Body i's sum stays in registers across
+    // the tiles; each tile's sources' sums are loaded, added to and stored back.
+
+    NBODY_TARGET("avx2,fma")
+    void symmetric_avx2(const SourceTiles::Tile* const tiles, PairSums::Tile* const sums, const size_t i, const size_t t0, const size_t t1)
+    {
+        const SourceTiles::Tile& a = tiles[i / tile];
+        const size_t la = i % tile;
+        const __m256 half = _mm256_set1_ps(.5f);
+        const __m256 three_halves = _mm256_set1_ps(1.5f);
+        const __m256 px = _mm256_set1_ps(a.x[la]);
+        const __m256 py = _mm256_set1_ps(a.y[la]);
+        const __m256 pz = _mm256_set1_ps(a.z[la]);
+        const __m256 mass_i = _mm256_set1_ps(a.mass[la]);
+        const __m256 radius_sq = _mm256_set1_ps(a.radius[la] * a.radius[la]);
+
+        __m256 ax = _mm256_setzero_ps();
+        __m256 ay = _mm256_setzero_ps();
+        __m256 az = _mm256_setzero_ps();
+        for (size_t t = t0; t < t1; ++t)
+            for (size_t h = 0; h < 2; ++h)
+            {
+                const size_t o = 8 * h;
+                const __m256 dx = _mm256_sub_ps(_mm256_load_ps(tiles[t].x + o), px);
+                const __m256 dy = _mm256_sub_ps(_mm256_load_ps(tiles[t].y + o), py);
+                const __m256 dz = _mm256_sub_ps(_mm256_load_ps(tiles[t].z + o), pz);
+                const __m256 d_sq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+
+                __m256 inv = _mm256_rsqrt_ps(d_sq);
+                inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, d_sq), _mm256_mul_ps(inv, inv), three_halves));
+                const __m256 inv_cube = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+
+                const __m256 radius_j = _mm256_load_ps(tiles[t].radius + o);
+                const __m256 i_feels = _mm256_cmp_ps(d_sq, radius_sq, _CMP_GT_OQ);
+                const __m256 j_feels = _mm256_cmp_ps(d_sq, _mm256_mul_ps(radius_j, radius_j), _CMP_GT_OQ);
+
+                const __m256 si = _mm256_and_ps(i_feels, _mm256_mul_ps(_mm256_load_ps(tiles[t].mass + o), inv_cube));
+                ax = _mm256_fmadd_ps(si, dx, ax);
+                ay = _mm256_fmadd_ps(si, dy, ay);
+                az = _mm256_fmadd_ps(si, dz, az);
+
+                const __m256 sj = _mm256_and_ps(j_feels, _mm256_mul_ps(mass_i, inv_cube));
+                _mm256_store_ps(sums[t].x + o, _mm256_fnmadd_ps(sj, dx, _mm256_load_ps(sums[t].x + o)));
+                _mm256_store_ps(sums[t].y + o, _mm256_fnmadd_ps(sj, dy, _mm256_load_ps(sums[t].y + o)));
+                _mm256_store_ps(sums[t].z + o, _mm256_fnmadd_ps(sj, dz, _mm256_load_ps(sums[t].z + o)));
+            }
+
+        sums[i / tile].x[la] += sum_avx2(ax);
+        sums[i / tile].y[la] += sum_avx2(ay);
+        sums[i / tile].z[la] += sum_avx2(az);
+    }
+
+    NBODY_TARGET("avx512f")
+    void symmetric_avx512(const SourceTiles::Tile* const tiles, PairSums::Tile* const sums, const size_t i, const size_t t0, const size_t t1)
+    {
+        const SourceTiles::Tile& a = tiles[i / tile];
+        const size_t la = i % tile;
+        const __m512 half = _mm512_set1_ps(.5f);
+        const __m512 three_halves = _mm512_set1_ps(1.5f);
+        const __m512 px = _mm512_set1_ps(a.x[la]);
+        const __m512 py = _mm512_set1_ps(a.y[la]);
+        const __m512 pz = _mm512_set1_ps(a.z[la]);
+        const __m512 mass_i = _mm512_set1_ps(a.mass[la]);
+        const __m512 radius_sq = _mm512_set1_ps(a.radius[la] * a.radius[la]);
+
+        __m512 ax = _mm512_setzero_ps();
+        __m512 ay = _mm512_setzero_ps();
+        __m512 az = _mm512_setzero_ps();
+        for (size_t t = t0; t < t1; ++t)
+        {
+            const __m512 dx = _mm512_sub_ps(_mm512_load_ps(tiles[t].x), px);
+            const __m512 dy = _mm512_sub_ps(_mm512_load_ps(tiles[t].y), py);
+            const __m512 dz = _mm512_sub_ps(_mm512_load_ps(tiles[t].z), pz);
+            const __m512 d_sq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+
+            __m512 inv = _mm512_rsqrt14_ps(d_sq);
+            inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, d_sq), _mm512_mul_ps(inv, inv), three_halves));
+            const __m512 inv_cube = _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv));
+
+            const __m512 radius_j = _mm512_load_ps(tiles[t].radius);
+            const __mmask16 i_feels = _mm512_cmp_ps_mask(d_sq, radius_sq, _CMP_GT_OQ);
+            const __mmask16 j_feels = _mm512_cmp_ps_mask(d_sq, _mm512_mul_ps(radius_j, radius_j), _CMP_GT_OQ);
+
+            const __m512 si = _mm512_maskz_mul_ps(i_feels, _mm512_load_ps(tiles[t].mass), inv_cube);
+            ax = _mm512_fmadd_ps(si, dx, ax);
+            ay = _mm512_fmadd_ps(si, dy, ay);
+            az = _mm512_fmadd_ps(si, dz, az);
+
+            const __m512 sj = _mm512_maskz_mul_ps(j_feels, mass_i, inv_cube);
+            _mm512_store_ps(sums[t].x, _mm512_fnmadd_ps(sj, dx, _mm512_load_ps(sums[t].x)));
+            _mm512_store_ps(sums[t].y, _mm512_fnmadd_ps(sj, dy, _mm512_load_ps(sums[t].y)));
+            _mm512_store_ps(sums[t].z, _mm512_fnmadd_ps(sj, dz, _mm512_load_ps(sums[t].z)));
+        }
+
+        sums[i / tile].x[la] += _mm512_reduce_add_ps(ax);
+        sums[i / tile].y[la] += _mm512_reduce_add_ps(ay);
+        sums[i / tile].z[la] += _mm512_reduce_add_ps(az);
+    }
+
+    Simd detect()
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        // The extensions need the OS to save their registers as well as the CPU to have them:
+        // XCR0 bits 1-2 for the ymm state, and 5-7 on top for AVX-512's.
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return Simd::Scalar;
+        __cpuid(info, 1);
+        const bool fma = info[2] & (1 << 12);
+        const bool osxsave = info[2] & (1 << 27);
+        if (!osxsave)
+            return Simd::Scalar;
+        const unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+            return Simd::Avx512;
+        if ((info[1] & (1 << 5)) && fma && (xcr0 & 0x6) == 0x6)
+            return Simd::Avx2;
+        return Simd::Scalar;
+#else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return Simd::Avx512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return Simd::Avx2;
+        return Simd::Scalar;
+#endif
+    }
+
+#else
+
+    Simd detect() { return Simd::Scalar; }
+
+#endif
+}
+
+Simd nbody::detail::simd_supported()
+{
+    static const Simd supported = detect();
+    return supported;
+}
+
+const char* nbody::detail::simd_name(const Simd simd)
+{
+    switch (simd)
+    {
+    case Simd::Scalar: return "scalar";
+    case Simd::Avx2: return "avx2";
+    case Simd::Avx512: return "avx-512";
+    }
+    return "unknown";
+}
+
+void SourceTiles::pack(BS::thread_pool& pool, const std::vector<Body>& bodies)
+{
+    NBODY_PROFILE_ZONE();
+    const size_t count = bodies.size();
+    _tiles.resize((count + tile - 1) / tile);
+    parallel_blocks(pool, _tiles.size(), [this, &bodies, count](const size_t begin, const size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
+        {
+            Tile& out = _tiles[t];
+            for (size_t j = 0; j < tile; ++j)
+            {
+                const size_t i = t * tile + j;
+                const bool real = i < count;
+                out.x[j] = real ? bodies[i].pos.x : 0.f;
+                out.y[j] = real ? bodies[i].pos.y : 0.f;
+                out.z[j] = real ? bodies[i].pos.z : 0.f;
+                out.mass[j] = real ? bodies[i].mass : 0.f;
+                out.radius[j] = real ? bodies[i].radius : 0.f;
+            }
+        }
+    });
+}
+
+void nbody::detail::brute_force(
+    const Simd simd,
+    const Blocking& blocking,
+    const SourceTiles& sources,
+    Body* const bodies,
+    const size_t begin,
+    const size_t end,
+    const float G)
+{
+    Kernel kernel = sum_scalar;
+    switch (std::min(simd, simd_supported()))
+    {
+#ifdef NBODY_X86
+    case Simd::Avx512: kernel = sum_avx512; break;
+    case Simd::Avx2: kernel = sum_avx2; break;
+#endif
+    default: break;
+    }
+
+    // Two levels. The targets are taken a block at a time, and each block is swept over the
+    // sources a block of tiles at a time: that block of tiles stays in cache while every
+    // target in the block reads it, rather than each target streaming all of the sources
+    // through on its own. Between source blocks a target's running sum waits in its acc,
+    // which the target block keeps in L1 too.
+    const SourceTiles::Tile* const tiles = sources.tiles();
+    const size_t tile_count = sources.tile_count();
+    const size_t targets = std::max<size_t>(blocking.targets, 1);
+    const size_t source_tiles = std::max<size_t>((blocking.sources + tile - 1) / tile, 1);
+    for (size_t i0 = begin; i0 < end; i0 += targets)
+    {
+        const size_t i1 = std::min(end, i0 + targets);
+        for (size_t i = i0; i < i1; ++i)
+            bodies[i].acc = { 0, 0, 0 };
+
+        for (size_t t0 = 0; t0 < tile_count; t0 += source_tiles)
+        {
+            const size_t count = std::min(source_tiles, tile_count - t0);
+            for (size_t i = i0; i < i1; ++i)
+                bodies[i].acc += kernel(tiles + t0, count, bodies[i].pos, bodies[i].radius);
+        }
+
+        for (size_t i = i0; i < i1; ++i)
+            bodies[i].acc = G * bodies[i].acc;
+    }
+}
+
+void nbody::detail::PairSums::resize(const size_t workers, const size_t tiles)
+{
+    _workers.resize(workers);
+    for (std::vector<Tile>& sums : _workers)
+        sums.resize(tiles);
+}
+
+void nbody::detail::brute_force_symmetric(
+    BS::thread_pool& pool,
+    const Simd simd,
+    const Blocking& blocking,
+    const SourceTiles& sources,
+    PairSums& sums,
+    Body* const bodies,
+    const size_t count,
+    const float G)
+{
+    NBODY_PROFILE_ZONE();
+    SymmetricKernel kernel = symmetric_scalar;
+    switch (std::min(simd, simd_supported()))
+    {
+#ifdef NBODY_X86
+    case Simd::Avx512: kernel = symmetric_avx512; break;
+    case Simd::Avx2: kernel = symmetric_avx2; break;
+#endif
+    default: break;
+    }
+
+    const SourceTiles::Tile* const tiles = sources.tiles();
+    const size_t tile_count = sources.tile_count();
+    if (tile_count == 0)
+        return;
+
+    // The tiles split into blocks of Blocking::sources bodies, and the work into the block
+    // pairs (a, b) with a <= b: every body of a against every body of b, which stays in cache
+    // while a's stream past it. Blocks small enough for a few pairs per worker, even when
+    // the bodies would fit in one.
+    const size_t workers = pool.get_thread_count();
+    const size_t per_block = std::max<size_t>(blocking.sources, 1);
+    size_t blocks = (tile_count * tile + per_block - 1) / per_block;
+    while (blocks < tile_count && blocks * (blocks + 1) / 2 < 4 * workers)
+        ++blocks;
+    const size_t block = (tile_count + blocks - 1) / blocks;
+    blocks = (tile_count + block - 1) / block;
+
+    std::vector<std::pair<size_t, size_t>> pairs;
+    for (size_t a = 0; a < blocks; ++a)
+        for (size_t b = a; b < blocks; ++b)
+            pairs.emplace_back(a, b);
+
+    sums.resize(workers, tile_count);
+    parallel_for(pool, workers, [&](const size_t w)
+    {
+        NBODY_PROFILE_ZONE_NAMED("symmetric worker");
+        PairSums::Tile* const own = sums.worker(w);
+        std::fill(own, own + tile_count, PairSums::Tile{});
+
+        // Round robin, so that each worker gets its share of the cheaper diagonal pairs.
+        for (size_t p = w; p < pairs.size(); p += workers)
+        {
+            const auto [a, b] = pairs[p];
+            const size_t b0 = b * block;
+            const size_t b1 = std::min(tile_count, b0 + block);
+            const size_t i1 = std::min(count, std::min(tile_count, (a + 1) * block) * tile);
+            for (size_t i = a * block * tile; i < i1; ++i)
+            {
+                if (a != b)
+                {
+                    kernel(tiles, own, i, b0, b1);
+                    continue;
+                }
+
+                // On the diagonal only the pairs with j > i: the rest of i's own tile one by
+                // one, and the tiles after it whole.
+                const size_t t = i / tile;
+                for (size_t j = i + 1; j < std::min(count, (t + 1) * tile); ++j)
+                    pair_scalar(tiles, own, i, j);
+                kernel(tiles, own, i, t + 1, b1);
+            }
+        }
+    });
+
+    parallel_blocks(pool, count, [&sums, bodies, workers, G](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            Vector acc = { 0, 0, 0 };
+            for (size_t w = 0; w < workers; ++w)
+            {
+                const PairSums::Tile& partial = sums.worker(w)[i / tile];
+                acc += Vector{ partial.x[i % tile], partial.y[i % tile], partial.z[i % tile] };
+            }
+            bodies[i].acc = G * acc;
+        }
+    });
+}
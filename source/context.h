@@ -1,6 +1,10 @@
 #pragma once
+#include <cstddef>
 #include <memory>
+#include <utility>
+#include <vector>
 #include "BS_thread_pool.hpp"
+#include "nbody/placement.h"
 
 namespace nbody
 {
@@ -13,7 +17,16 @@ namespace nbody
     // threads on every variant switch).
     struct Context
     {
-        std::shared_ptr<BS::thread_pool> pool = std::make_shared<BS::thread_pool>();
+        // A pool of one worker per cpu this process may use, each pinned to its cpu as
+        // `placement` says.
+        explicit Context(Placement placement = Placement::Unpinned);
+
+        Placement placement;
+
+        // The NUMA nodes, as detail::numa_cpus() found them when the pool was made.
+        std::vector<std::vector<int>> nodes;
+
+        std::shared_ptr<BS::thread_pool> pool;
 
         // Created on the first successful switch to a GPU variant and cached: both GPU
         // variants share one set of shaders and select between them with a push constant,
@@ -23,5 +36,19 @@ namespace nbody
         // Returns `gpu`, creating it if needed. Throws if the device cannot be brought
         // up; the caller turns that into an unavailable variant with a reason.
         std::shared_ptr<GpuDevice> require_gpu();
+
+        // Under Placement::Spread, interleave an array the pool works on across the nodes. A
+        // no-op otherwise, and for an array this has already placed where it is now, so
+        // cheap enough to call each time one might have moved.
+        void place(const void* data, size_t bytes);
+
+        template <typename T>
+        void place(const std::vector<T>& array) { place(array.data(), array.size() * sizeof(T)); }
+
+    private:
+
+        // The arrays placed lately, newest last, so that one which has not moved is not
+        // placed again.
+        std::vector<std::pair<const void*, size_t>> _placed;
     };
 }
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "BS_thread_pool.hpp"
+#include "nbody/body.h"
+
+// The O(n^2) force sum, vectorized by hand. Brute force is the reference every approximate
+// variant is checked against and the bulk of any regression run, and the scalar loop over
+// Body leaves most of each vector register idle: a body is 48 bytes of which a pair needs 16.
+//
+// The sources are repacked once per step into tiles of `tile` bodies, each tile holding its x,
+// y and z coordinates, masses and radii as aligned arrays, so a kernel loads a whole register
+// of one field at once. Which kernel runs is decided at run time from what the CPU supports: the
+// library is built for baseline x86-64 (or arm64), and only the kernels themselves are
+// compiled for AVX2 or AVX-512.
+namespace nbody::detail
+{
+    // Instruction sets there is a kernel for, narrowest first.
+    enum class Simd : int
+    {
+        Scalar = 0,
+        Avx2,
+        Avx512,
+    };
+
+    // The widest kernel this CPU can run. Detected once.
+    [[nodiscard]] Simd simd_supported();
+
+    [[nodiscard]] const char* simd_name(Simd simd);
+
+    // Source positions, masses and radii in tiles of sixteen, the widest kernel's width. The
+    // last tile is padded with massless bodies, which every kernel sums to exactly zero.
+    class SourceTiles
+    {
+    public:
+
+        static constexpr size_t tile = 16;
+
+        struct alignas(64) Tile
+        {
+            float x[tile];
+            float y[tile];
+            float z[tile];
+            float mass[tile];
+            float radius[tile];   // read only by the symmetric sum
+        };
+
+        // Repack from `bodies`, on the pool.
+        void pack(BS::thread_pool& pool, const std::vector<Body>& bodies);
+
+        [[nodiscard]] const Tile* tiles() const { return _tiles.data(); }
+        [[nodiscard]] size_t tile_count() const { return _tiles.size(); }
+
+    private:
+
+        // std::allocator honours the alignas through aligned operator new.
+        std::vector<Tile> _tiles;
+    };
+
+    // How brute_force() blocks the sum for the cache: `targets` bodies at a time against
+    // `sources` source bodies at a time, the latter rounded up to whole tiles. Zeros are
+    // taken as one. The defaults are State's.
+    struct Blocking
+    {
+        size_t targets;
+        size_t sources;
+    };
+
+    // Set the acceleration of bodies [begin, end) to the sum over every source, with the
+    // kernel for `simd`, or simd_supported()'s if that is narrower. The same law as
+    // gravity(): no force from a source within a body's radius, itself included, so there
+    // is no self test in the loop.
+    void brute_force(
+        Simd simd, const Blocking& blocking, const SourceTiles& sources, Body* bodies, size_t begin, size_t end, float G);
+
+    // Scratch for brute_force_symmetric(): a partial acceleration per body for each worker,
+    // in the sources' tile layout. Kept between steps so it is allocated once.
+    class PairSums
+    {
+    public:
+
+        struct alignas(64) Tile
+        {
+            float x[SourceTiles::tile];
+            float y[SourceTiles::tile];
+            float z[SourceTiles::tile];
+        };
+
+        void resize(size_t workers, size_t tiles);
+
+        [[nodiscard]] size_t workers() const { return _workers.size(); }
+        [[nodiscard]] Tile* worker(const size_t w) { return _workers[w].data(); }
+
+    private:
+
+        std::vector<std::vector<Tile>> _workers;
+    };
+
+    // The same sum as brute_force() over all of `bodies`, the sources, on the pool, with each
+    // unordered pair evaluated once and applied to both bodies, equal and opposite: half the
+    // arithmetic. The pairs are shared out among the workers a block pair at a time, and each
+    // worker accumulates into its own partial sums, added up at the end, so no two write to
+    // the same place. The result differs from brute_force()'s only in the order of the sums.
+    void brute_force_symmetric(
+        BS::thread_pool& pool,
+        Simd simd,
+        const Blocking& blocking,
+        const SourceTiles& sources,
+        PairSums& sums,
+        Body* bodies,
+        size_t count,
+        float G);
+}
@@ -0,0 +1,263 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "nbody/bhtree.h"
+#include "nbody/vector.h"
+
+// Cartesian expansions of the potential phi(x) = sum_j m_j / |x - x_j| for the fast multipole
+// method, to a fixed order p. All four are truncated at a combined degree of p, so a cell's
+// far field is as accurate as a multipole of order p and its local field one order less.
+//
+// With a source cell centered at z_A, a target cell at z_B and R = z_B - z_A, each term of
+// 1/|R + r - d| expands as
+//
+//   sum over multi-indices a, b of  C(a + b, a) T_{a+b}(R) (-d)^a r^b
+//
+// where T_g = D^g (1/|R|) / g! are the Taylor coefficients of 1/|R|. The multipole of the
+// source is then M_a = sum_j m_j (-d_j)^a, the local expansion about the target
+// L_b = sum_a C(a + b, a) T_{a+b}(R) M_a, and the field phi(z_B + r) = sum_b L_b r^b. The
+// acceleration is G times its gradient.
+namespace nbody::detail::fmm
+{
+    // Past this the float moments of a world-sized cell overflow.
+    constexpr int max_order = 6;
+
+    class Expansion
+    {
+    public:
+
+        explicit Expansion(const int order) : _order(std::clamp(order, 1, max_order))
+        {
+            const int p = _order;
+            const int stride = p + 1;
+            _lookup.assign(size_t(stride * stride * stride), -1);
+
+            // Every multi-index of degree <= p, lowest degree first so that each one's
+            // recurrence only reads ones already computed.
+            for (int n = 0; n <= p; ++n)
+                for (int i = n; i >= 0; --i)
+                    for (int j = n - i; j >= 0; --j)
+                    {
+                        const int k = n - i - j;
+                        _lookup[size_t((i * stride + j) * stride + k)] = int(_indices.size());
+                        _indices.push_back({ uint8_t(i), uint8_t(j), uint8_t(k) });
+                    }
+
+            const auto index = [this, stride](const int i, const int j, const int k)
+            {
+                return (i < 0 || j < 0 || k < 0) ? -1 : _lookup[size_t((i * stride + j) * stride + k)];
+            };
+            const auto choose = [](const int n, const int k)
+            {
+                float c = 1;
+                for (int i = 1; i <= k; ++i)
+                    c = c * float(n - k + i) / float(i);
+                return c;
+            };
+            const auto choose3 = [&choose](const Index& a, const Index& b)
+            {
+                return choose(a.i, b.i) * choose(a.j, b.j) * choose(a.k, b.k);
+            };
+
+            for (const Index& g : _indices)
+            {
+                _recurrence.push_back({
+                    { index(g.i - 1, g.j, g.k), index(g.i, g.j - 1, g.k), index(g.i, g.j, g.k - 1) },
+                    { index(g.i - 2, g.j, g.k), index(g.i, g.j - 2, g.k), index(g.i, g.j, g.k - 2) } });
+            }
+
+            // Each translation's terms grouped by the coefficient they add to, so that one is
+            // summed in a register and stored once.
+            for (size_t out = 0; out < _indices.size(); ++out)
+            {
+                const Index& io = _indices[out];
+                for (size_t in = 0; in < _indices.size(); ++in)
+                {
+                    const Index& ii = _indices[in];
+
+                    // m2l: L_b += C(a + b, a) T_{a+b} M_a, over a + b of degree <= p
+                    const Index sum = { uint8_t(ii.i + io.i), uint8_t(ii.j + io.j), uint8_t(ii.k + io.k) };
+                    if (sum.degree() <= p)
+                        _m2l.terms.push_back({ uint16_t(in), uint16_t(index(sum.i, sum.j, sum.k)), choose3(sum, ii) });
+
+                    // m2m: M_a += C(a, b) M_b (-s)^(a-b), over b <= a
+                    if (ii.i <= io.i && ii.j <= io.j && ii.k <= io.k)
+                        _m2m.terms.push_back({ uint16_t(in), uint16_t(index(io.i - ii.i, io.j - ii.j, io.k - ii.k)), choose3(io, ii) });
+
+                    // l2l: L_b += C(a, b) t^(a-b) L_a, over a >= b
+                    if (io.i <= ii.i && io.j <= ii.j && io.k <= ii.k)
+                        _l2l.terms.push_back({ uint16_t(in), uint16_t(index(ii.i - io.i, ii.j - io.j, ii.k - io.k)), choose3(ii, io) });
+                }
+                _m2l.ends.push_back(uint32_t(_m2l.terms.size()));
+                _m2m.ends.push_back(uint32_t(_m2m.terms.size()));
+                _l2l.ends.push_back(uint32_t(_l2l.terms.size()));
+            }
+
+            // the gradient: d/dr_k of L_b r^b is b_k L_b r^(b - e_k)
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (size_t b = 0; b < _indices.size(); ++b)
+                {
+                    const Index& ib = _indices[b];
+                    const int powers[3] = { ib.i, ib.j, ib.k };
+                    if (powers[axis] == 0)
+                        continue;
+                    const int lower = index(ib.i - (axis == 0), ib.j - (axis == 1), ib.k - (axis == 2));
+                    _l2p.terms.push_back({ uint16_t(b), uint16_t(lower), float(powers[axis]) });
+                }
+                _l2p.ends.push_back(uint32_t(_l2p.terms.size()));
+            }
+        }
+
+        [[nodiscard]] int order() const { return _order; }
+
+        // Coefficients in one multipole or local expansion.
+        [[nodiscard]] size_t size() const { return _indices.size(); }
+
+        // A leaf's multipole about `center`, from its bodies.
+        void p2m(float* multipole, const Vector& center, const bh::Point* points, const uint32_t count) const
+        {
+            std::fill(multipole, multipole + size(), 0.f);
+            float powers[max_terms];
+            for (uint32_t p = 0; p < count; ++p)
+            {
+                monomials(center - points[p].pos, powers);
+                for (size_t a = 0; a < size(); ++a)
+                    multipole[a] += points[p].mass * powers[a];
+            }
+        }
+
+        // Add a child's multipole, about a center `shift` from the parent's, to the parent's.
+        void m2m(float* parent, const float* child, const Vector& shift) const
+        {
+            float powers[max_terms];
+            monomials(-1.f * shift, powers);
+            _m2m.apply(parent, child, powers);
+        }
+
+        // Add the field of a source multipole to a target's local expansion, with `R` the
+        // target's center less the source's.
+        void m2l(float* local, const float* multipole, const Vector& R) const
+        {
+            float derivatives[max_terms];
+            taylor(R, derivatives);
+            _m2l.apply(local, multipole, derivatives);
+        }
+
+        // Add a parent's local expansion, re-centered on a child `shift` from it, to the child's.
+        void l2l(float* child, const float* parent, const Vector& shift) const
+        {
+            float powers[max_terms];
+            monomials(shift, powers);
+            _l2l.apply(child, parent, powers);
+        }
+
+        // The gradient of a local expansion at `r` from its center: the acceleration over G.
+        [[nodiscard]] Vector l2p(const float* local, const Vector& r) const
+        {
+            float powers[max_terms];
+            monomials(r, powers);
+            Vector gradient{ 0, 0, 0 };
+            _l2p.apply(&gradient.x, local, powers);
+            return gradient;
+        }
+
+    private:
+
+        // Multi-indices of degree <= max_order: C(max_order + 3, 3).
+        static constexpr size_t max_terms = size_t(max_order + 1) * (max_order + 2) * (max_order + 3) / 6;
+
+        struct Index
+        {
+            uint8_t i, j, k;
+            [[nodiscard]] int degree() const { return i + j + k; }
+        };
+
+        // out += c * in * power, the shape all four translations take.
+        struct Term
+        {
+            uint16_t in;
+            uint16_t power;
+            float c;
+        };
+
+        // A translation's terms, grouped by output: output o's are terms[ends[o - 1], ends[o]).
+        struct Translation
+        {
+            std::vector<Term> terms;
+            std::vector<uint32_t> ends;
+
+            void apply(float* out, const float* in, const float* powers) const
+            {
+                uint32_t t = 0;
+                for (size_t o = 0; o < ends.size(); ++o)
+                {
+                    float sum = 0;
+                    for (const uint32_t end = ends[o]; t < end; ++t)
+                        sum += terms[t].c * in[terms[t].in] * powers[terms[t].power];
+                    out[o] += sum;
+                }
+            }
+        };
+
+        // Per multi-index g, the indices of g - e_axis and g - 2 e_axis, or -1.
+        struct Recurrence
+        {
+            int once[3];
+            int twice[3];
+        };
+
+        // d^g for every multi-index g.
+        void monomials(const Vector& d, float* out) const
+        {
+            float px[max_order + 1], py[max_order + 1], pz[max_order + 1];
+            px[0] = py[0] = pz[0] = 1;
+            for (int n = 1; n <= _order; ++n)
+            {
+                px[n] = px[n - 1] * d.x;
+                py[n] = py[n - 1] * d.y;
+                pz[n] = pz[n - 1] * d.z;
+            }
+            for (size_t g = 0; g < size(); ++g)
+                out[g] = px[_indices[g].i] * py[_indices[g].j] * pz[_indices[g].k];
+        }
+
+        // T_g(R) = D^g (1/|R|) / g! for every multi-index g, by the recurrence
+        //
+        //   n |R|^2 T_g = -(2n - 1) sum_k R_k T_{g - e_k} - (n - 1) sum_k T_{g - 2 e_k}
+        //
+        // for g of degree n.
+        void taylor(const Vector& R, float* out) const
+        {
+            const float r_sq = R.size_sq();
+            const float inv_r_sq = 1.f / r_sq;
+            out[0] = 1.f / std::sqrt(r_sq);
+            for (size_t g = 1; g < size(); ++g)
+            {
+                const int n = _indices[g].degree();
+                const Recurrence& rec = _recurrence[g];
+                float sum = 0;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    if (rec.once[axis] >= 0)
+                        sum -= float(2 * n - 1) * R[axis] * out[rec.once[axis]];
+                    if (rec.twice[axis] >= 0)
+                        sum -= float(n - 1) * out[rec.twice[axis]];
+                }
+                out[g] = sum * inv_r_sq / float(n);
+            }
+        }
+
+        int _order;
+        std::vector<Index> _indices;
+        std::vector<int> _lookup;
+        std::vector<Recurrence> _recurrence;
+        Translation _m2m;
+        Translation _m2l;
+        Translation _l2l;
+        Translation _l2p;
+    };
+}
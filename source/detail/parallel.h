@@ -1,6 +1,10 @@
 #pragma once
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <span>
 #include <utility>
+#include <vector>
 #include "BS_thread_pool.hpp"
 
 namespace nbody::detail
@@ -21,6 +25,62 @@ namespace nbody::detail
         pool.submit_blocks(size_t{0}, n, std::forward<Block>(block)).wait();
     }
 
+    // As parallel_blocks, for a block that returns a value: the blocks' values folded into
+    // `init` with `combine`, in block order, once all of them are done.
+    template <typename T, typename Block, typename Combine>
+    T parallel_reduce(BS::thread_pool& pool, const size_t n, T init, Block&& block, Combine&& combine)
+    {
+        if (n == 0)
+            return init;
+        for (T& value : pool.submit_blocks(size_t{0}, n, std::forward<Block>(block)).get())
+            init = combine(std::move(init), std::move(value));
+        return init;
+    }
+
+    // Where to cut [0, n) into up to `blocks` ranges of about equal cost, from `offsets`: the
+    // running total of the costs before each index, with the whole at the end, n + 1 in all.
+    // Range b is [cuts[b], cuts[b + 1]). An index costing more than a share gets a range
+    // to itself and swallows the cuts that would have fallen inside it, so fewer ranges than
+    // asked for can come back, and none are empty.
+    inline std::vector<size_t> balanced_cuts(const std::span<const uint64_t> offsets, const size_t blocks)
+    {
+        const size_t n = offsets.size() - 1;
+        std::vector<size_t> cuts = { 0 };
+        if (n == 0)
+            return cuts;
+        for (size_t b = 1; b < blocks; ++b)
+        {
+            const uint64_t share = offsets.back() * b / blocks;
+            const size_t cut = size_t(std::lower_bound(offsets.begin(), offsets.end(), share) - offsets.begin());
+            if (cut > cuts.back() && cut < n)
+                cuts.push_back(cut);
+        }
+        cuts.push_back(n);
+        return cuts;
+    }
+
+    // As parallel_reduce, over the ranges `cuts` marks (see balanced_cuts) rather than equal
+    // counts. Every range is a task in the pool's one queue, and a thread that finishes one
+    // takes the next one waiting. Each thread takes several ranges, so a range that overruns
+    // its estimate is absorbed by the others.
+    template <typename T, typename Block, typename Combine>
+    T parallel_reduce_cuts(BS::thread_pool& pool, const std::span<const size_t> cuts, T init, Block&& block, Combine&& combine)
+    {
+        BS::multi_future<T> futures;
+        for (size_t b = 0; b + 1 < cuts.size(); ++b)
+            futures.push_back(pool.submit_task([&block, begin = cuts[b], end = cuts[b + 1]]
+            {
+                return block(begin, end);
+            }));
+
+        // Every task holds `block` by reference, so all of them finish before any is asked
+        // for its value, which may throw.
+        futures.wait();
+        for (T& value : futures.get())
+            init = combine(std::move(init), std::move(value));
+        return init;
+    }
+
     // Per-index convenience wrapper. Prefer parallel_blocks when the body can hoist
     // work out of the inner loop.
     template <typename Fn>
@@ -1,6 +1,8 @@
 #pragma once
 #include <cmath>
 #include <cstddef>
+#include <limits>
+#include "nbody/bhtree.h"
 #include "nbody/body.h"
 #include "nbody/vector.h"
 
@@ -41,31 +43,123 @@ namespace nbody::detail
         return G * src_mass * delta / (std::sqrt(delta_sq) * delta_sq);
     }
 
+    // The same, with the second term of the multipole expansion: `quadrupole` is the source's
+    // traceless moment about `src_pos` (see bh::Quadrupole). With r from the source to the
+    // body, the potential -G (M/r + r.Q.r / 2r^5) gives
+    //
+    //   a = G (-M r/r^3 + Q r/r^5 - 5/2 (r.Q.r) r/r^7)
+    //
+    // Same cutoff as the monopole, so a body never feels its own leaf's moment.
+    inline Vector gravity(
+        const Vector& pos,
+        const float radius,
+        const Vector& src_pos,
+        const float src_mass,
+        const bh::Quadrupole& quadrupole,
+        const float G)
+    {
+        const Vector r = pos - src_pos;
+        const float r_sq = r.size_sq();
+        if (r_sq <= radius * radius)
+            return { 0, 0, 0 };
+
+        const Vector qr = {
+            quadrupole.xx * r.x + quadrupole.xy * r.y + quadrupole.xz * r.z,
+            quadrupole.xy * r.x + quadrupole.yy * r.y + quadrupole.yz * r.z,
+            quadrupole.xz * r.x + quadrupole.yz * r.y + quadrupole.zz * r.z,
+        };
+        const float inv_r = 1.f / std::sqrt(r_sq);
+        const float inv_r2 = inv_r * inv_r;
+        const float inv_r3 = inv_r2 * inv_r;
+        const float inv_r5 = inv_r3 * inv_r2;
+        const float rqr = dot(r, qr);
+
+        return G * (qr * inv_r5 - r * (src_mass * inv_r3 + 2.5f * rqr * inv_r5 * inv_r2));
+    }
+
     // Wrap a coordinate into [-size/2, +size/2], making space a 3-torus.
     //
     // The double fmod is needed because std::fmod keeps the sign of the dividend, so a
     // single call can still return a negative value. GLSL's mod() is already
     // non-negative for a positive divisor, making the second application redundant
     // there, but the shader keeps the same form so the two read identically.
-    inline float wrap(const float x, const float size)
+    template <typename Real>
+    Real wrap(const Real x, const Real size)
     {
-        if (size <= 0.f)
+        if (size <= 0)
             return x;   // a zero/negative world size would otherwise produce NaN
 
-        const float half = size * .5f;
+        const Real half = size * Real(.5);
         return std::fmod(std::fmod(x + half, size) + size, size) - half;
     }
 
-    // Semi-implicit euler, which is well behaved for gravitational forces.
-    inline void integrate_euler(Body& body, const float dt, const float size, const bool do_wrap)
+    // The block timestep level of a body for a step of `dt`: the least level, up to
+    // `deepest`, whose step dt / 2^level spans no more than `accuracy` of |v| / |a|, the time
+    // its velocity takes to change by as much again. An unaccelerated body takes the whole
+    // step, and one at rest the deepest level.
+    inline int timestep_level(const Body& body, const float dt, const float accuracy, const int deepest)
     {
-        body.vel += body.acc * dt;
-        body.pos += body.vel * dt;
+        const float acc_sq = body.acc.size_sq();
+        if (acc_sq == 0)
+            return 0;
 
-        if (!do_wrap)
+        const float tau = accuracy * std::sqrt(body.vel.size_sq() / acc_sq);
+        int level = 0;
+        for (float step = dt; level < deepest && step > tau; step *= .5f)
+            ++level;
+        return level;
+    }
+
+    // A body's bound on an adaptive step, squared: radius / |a|, the square of the time it
+    // takes, up to a constant, to fall through its own radius from rest. Sim::step() cuts its
+    // step to State::timestep_eta times the root of the least of these. No bound at all for
+    // an unaccelerated body, or for one without a radius, which a step could never satisfy.
+    inline float step_limit_sq(const Body& body)
+    {
+        const float acc_sq = body.acc.size_sq();
+        if (acc_sq == 0 || body.radius <= 0)
+            return std::numeric_limits<float>::infinity();
+        return body.radius / std::sqrt(acc_sq);
+    }
+
+    // Kick, then drift: semi-implicit euler with both `dt`, and either half of a leapfrog
+    // step. A kick alone moves nothing, so has nothing to wrap.
+    inline void integrate(Body& body, const float kick, const float drift, const float size, const bool do_wrap)
+    {
+        body.vel += body.acc * kick;
+        body.pos += body.vel * drift;
+
+        if (!do_wrap || drift == 0)
             return;
 
         for (size_t i = 0; i < 3; ++i)
             body.pos[i] = wrap(body.pos[i], size);
     }
+
+    // A body's position and velocity in double precision, for State::precision. Body keeps
+    // the floats they round to, which is what the forces are summed from.
+    struct Precise
+    {
+        double pos[3];
+        double vel[3];
+
+        static Precise of(const Body& body)
+        {
+            return { { body.pos.x, body.pos.y, body.pos.z }, { body.vel.x, body.vel.y, body.vel.z } };
+        }
+    };
+
+    // The same step, carried in `precise` and rounded into `body`.
+    inline void integrate(Body& body, Precise& precise, const double kick, const double drift, const double size, const bool do_wrap)
+    {
+        for (size_t i = 0; i < 3; ++i)
+        {
+            precise.vel[i] += double(body.acc[i]) * kick;
+            precise.pos[i] += precise.vel[i] * drift;
+            if (do_wrap && drift != 0)
+                precise.pos[i] = wrap(precise.pos[i], size);
+            body.vel[i] = float(precise.vel[i]);
+            body.pos[i] = float(precise.pos[i]);
+        }
+    }
 }
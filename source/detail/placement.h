@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "nbody/placement.h"
+
+// What Placement needs of the OS: the NUMA layout, pinning a thread, and moving pages. Only
+// linux and windows say anything; elsewhere the host is one node and nothing is pinned.
+namespace nbody::detail
+{
+    // The logical cpus this process may run on, by NUMA node in node order. A host that
+    // says nothing of its nodes is one node holding every cpu.
+    std::vector<std::vector<int>> numa_cpus();
+
+    // The cpu for each worker under `placement`, given `nodes` from numa_cpus(), one
+    // worker per cpu. Empty for Placement::Unpinned.
+    std::vector<int> placement_cpus(Placement placement, const std::vector<std::vector<int>>& nodes);
+
+    // Pin the calling thread to `cpu`. False where the OS would not, or cannot be asked.
+    bool pin_thread(int cpu);
+
+    // Move the pages of [data, data + bytes) to be spread round robin across every NUMA node
+    // with memory. Best effort: false, and the pages left where they were, on one node or
+    // where that is not supported.
+    bool interleave(const void* data, size_t bytes);
+}
@@ -1,35 +1,76 @@
 #pragma once
 #include <vector>
+#include "BS_thread_pool.hpp"
 #include "nbody/body.h"
 #include "nbody/bhtree.h"
 #include "nbody/profile.h"
+#include "detail/parallel.h"
 
 namespace nbody::detail
 {
+    // Bodies per leaf the solvers build with. Cuts the node count about sixteenfold against
+    // leaves of one, and the build with it, for a few more direct interactions per body.
+    constexpr uint32_t leaf_capacity = 16;
+
+    // The pool, in the shape bh::Tree takes its parallelism: the tree is a public type and
+    // stays free of any threading library, so it is handed this rather than the pool.
+    inline bh::Parallel executor(BS::thread_pool& pool)
+    {
+        return [&pool](const size_t n, const std::function<void(size_t, size_t)>& block)
+        {
+            parallel_blocks(pool, n, [&block](const size_t begin, const size_t end) { block(begin, end); });
+        };
+    }
+
     // Rebuild the barnes-hut acceleration tree from scratch. Shared by the CPU and GPU
     // barnes-hut solvers so the two cannot drift apart in how the tree is constructed.
     //
     // Templated on the element so the GPU solver can build straight out of its staging
     // positions: Body and BodyPosMass both expose .pos and .mass.
     template <typename Item>
-    void build_tree(bh::Tree& tree, const Item* items, const size_t count, const float size)
+    void build_tree(BS::thread_pool& pool, bh::Tree& tree, const Item* items, const size_t count, const float size)
     {
-        // Serial, and shared by both barnes-hut solvers: the part of a GPU frame the
-        // device cannot help with.
+        // Morton keys, sort and subtrees all run on the pool. Still the part of a GPU frame
+        // the device cannot help with, but no longer a serial one.
         NBODY_PROFILE_ZONE();
-        tree.clear({ .size = size });
-        tree.reserve(count << 2);
-        {
-            NBODY_PROFILE_ZONE_NAMED("Insert bodies");
-            for (size_t i = 0; i < count; ++i)
-                tree.insert(items[i].pos, items[i].mass);
-        }
+        tree.set_leaf_capacity(leaf_capacity);
+        tree.build({ .size = size }, items, count, executor(pool));
+
+        NBODY_PROFILE_PLOT("bh nodes", static_cast<int64_t>(tree.nodes().size()));
+    }
+
+    inline void build_tree(BS::thread_pool& pool, bh::Tree& tree, const std::vector<Body>& bodies, const float size)
+    {
+        build_tree(pool, tree, bodies.data(), bodies.size(), size);
+    }
+
+    // Bring the tree up to date with bodies that have moved since the last step: a refit
+    // when few enough left their leaves, a build otherwise. See bh::Tree::refit().
+    // `quadrupoles` follows State::quadrupole; switching it costs one full build.
+    template <typename Item>
+    void refit_tree(
+        BS::thread_pool& pool,
+        bh::Tree& tree,
+        const Item* items,
+        const size_t count,
+        const float size,
+        const bool quadrupoles)
+    {
+        NBODY_PROFILE_ZONE();
+        tree.set_leaf_capacity(leaf_capacity);
+        tree.set_quadrupoles(quadrupoles);
+        tree.refit({ .size = size }, items, count, executor(pool));
 
         NBODY_PROFILE_PLOT("bh nodes", static_cast<int64_t>(tree.nodes().size()));
     }
 
-    inline void build_tree(bh::Tree& tree, const std::vector<Body>& bodies, const float size)
+    inline void refit_tree(
+        BS::thread_pool& pool,
+        bh::Tree& tree,
+        const std::vector<Body>& bodies,
+        const float size,
+        const bool quadrupoles)
     {
-        build_tree(tree, bodies.data(), bodies.size(), size);
+        refit_tree(pool, tree, bodies.data(), bodies.size(), size, quadrupoles);
     }
 }
@@ -1,10 +1,17 @@
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <random>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 #include <array>
 #include "gpu.h"
@@ -13,6 +20,15 @@
 #include "shaders/integrate.h"
 #include "shaders/accelerate_split.h"
 #include "shaders/integrate_split.h"
+#include "shaders/tree_keys.h"
+#include "shaders/tree_keys_split.h"
+#include "shaders/tree_histogram.h"
+#include "shaders/tree_scan.h"
+#include "shaders/tree_scatter.h"
+#include "shaders/tree_gather.h"
+#include "shaders/tree_subdivide.h"
+#include "shaders/tree_level.h"
+#include "shaders/tree_moments.h"
 
 using nbody::GpuDevice;
 
@@ -26,6 +42,32 @@ namespace
         return verbose;
     }
 
+    // Opt-in validation, off unless NBODY_VK_VALIDATE is set: runs every device under the
+    // Khronos validation layer, which must then be installed. Any value will do.
+    bool vulkan_validate()
+    {
+        static const bool validate = std::getenv("NBODY_VK_VALIDATE") != nullptr;
+        return validate;
+    }
+
+    constexpr const char* validation_layer = "VK_LAYER_KHRONOS_validation";
+
+    // A warning is printed and the run goes on. An error ends the process: it is a bug in how
+    // the device is driven, and one a test could otherwise sail past -- a missing barrier
+    // reads the right numbers on most drivers most of the time.
+    VKAPI_ATTR vk::Bool32 VKAPI_CALL report_validation(
+        const vk::DebugUtilsMessageSeverityFlagBitsEXT severity,
+        const vk::DebugUtilsMessageTypeFlagsEXT,
+        const vk::DebugUtilsMessengerCallbackDataEXT* const data,
+        void*)
+    {
+        const bool error = severity == vk::DebugUtilsMessageSeverityFlagBitsEXT::eError;
+        std::cerr << "nbody: vulkan validation " << (error ? "error" : "warning") << ": " << data->pMessage << std::endl;
+        if (error)
+            std::abort();
+        return VK_FALSE;
+    }
+
     // Report which tools have inserted themselves into this device, and whether the one
     // extension we want from them came with it.
     //
@@ -70,23 +112,84 @@ namespace
             << (frame_boundary ? "present" : "absent -- only the capture layer provides it")
             << std::endl;
     }
+
+    // FNV-1a: enough to tell one set of bytes from another without keeping the first.
+    uint64_t fingerprint(const void* const data, const size_t bytes, uint64_t hash = 14695981039346656037ull)
+    {
+        const unsigned char* const begin = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; ++i)
+            hash = (hash ^ begin[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    // Every shader the device makes a pipeline of. A cache made for other shaders would load
+    // as well as one made for these, and hold nothing the pipelines want.
+    uint64_t shader_fingerprint()
+    {
+        const std::pair<const unsigned char*, size_t> shaders[] = {
+            { spv_integrate, sizeof(spv_integrate) },
+            { spv_accelerate, sizeof(spv_accelerate) },
+            { spv_integrate_split, sizeof(spv_integrate_split) },
+            { spv_accelerate_split, sizeof(spv_accelerate_split) },
+            { spv_tree_keys, sizeof(spv_tree_keys) },
+            { spv_tree_keys_split, sizeof(spv_tree_keys_split) },
+            { spv_tree_histogram, sizeof(spv_tree_histogram) },
+            { spv_tree_scan, sizeof(spv_tree_scan) },
+            { spv_tree_scatter, sizeof(spv_tree_scatter) },
+            { spv_tree_gather, sizeof(spv_tree_gather) },
+            { spv_tree_subdivide, sizeof(spv_tree_subdivide) },
+            { spv_tree_level, sizeof(spv_tree_level) },
+            { spv_tree_moments, sizeof(spv_tree_moments) },
+        };
+        uint64_t hash = fingerprint(nullptr, 0);
+        for (const auto& [spv, size] : shaders)
+            hash = fingerprint(spv, size, hash);
+        return hash;
+    }
+
+    // Whether `blob` opens with the header vkGetPipelineCacheData writes for this device. A
+    // driver is meant to refuse a cache that is not its own, but not every one does, and
+    // some crash on a truncated file rather than refuse it.
+    bool valid_pipeline_cache(const std::vector<char>& blob, const vk::PhysicalDeviceProperties& properties)
+    {
+        VkPipelineCacheHeaderVersionOne header;
+        if (blob.size() < sizeof(header))
+            return false;
+        std::memcpy(&header, blob.data(), sizeof(header));
+
+        return header.headerSize >= sizeof(header)
+            && header.headerSize <= blob.size()
+            && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            && header.vendorID == properties.vendorID
+            && header.deviceID == properties.deviceID
+            && std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+    }
 }
 
 
-GpuDevice::GpuDevice()
+GpuDevice::GpuDevice(const std::string& pipeline_cache_dir)
     : instance(make_instance())
+    , messenger(make_messenger())
     , physical_device(make_physical_device())
     , device(make_device())
     , queue(device.getQueue(queue_family_index, 0))
-    , fence(device, vk::FenceCreateInfo{ })
+    , timeline(make_timeline())
     , command_pool(make_command_pool())
-    , command_buffer(make_command_buffer())
+    , command_buffers(make_command_buffers())
+    , query_pool(make_query_pool())
     , descriptor_pool(make_descriptor_pool())
+    , pipeline_cache_path(make_pipeline_cache_path(pipeline_cache_dir))
+    , pipeline_cache(make_pipeline_cache())
     , buffer_nodes(make_device_buffer<bh::Node>(0))
     , staging_nodes(make_staging_buffer<bh::Node>(0))
-
-    // interleaved: bodies at binding 0, nodes at binding 1
-    , descriptor_set_layout_interleaved(make_descriptor_set_layout(2))
+    , buffer_points(make_device_buffer<bh::Point>(0))
+    , staging_points(make_staging_buffer<bh::Point>(0))
+    , buffer_quadrupoles(make_device_buffer<bh::Quadrupole>(0))
+    , staging_quadrupoles(make_staging_buffer<bh::Quadrupole>(0))
+
+    // interleaved: bodies at binding 0, nodes at binding 1, leaf points at binding 2,
+    // quadrupoles at binding 3
+    , descriptor_set_layout_interleaved(make_descriptor_set_layout(4))
     , descriptor_set_interleaved(make_descriptor_set(descriptor_set_layout_interleaved))
     , pipeline_layout_interleaved(make_pipeline_layout(descriptor_set_layout_interleaved))
     , shader_integrate_interleaved(make_shader(spv_integrate))
@@ -96,8 +199,9 @@ GpuDevice::GpuDevice()
     , buffer_bodies(make_device_buffer<Body>(0))
     , staging_bodies(make_staging_buffer<Body>(0))
 
-    // split: three body arrays at bindings 0-2, nodes at binding 3
-    , descriptor_set_layout_split(make_descriptor_set_layout(4))
+    // split: three body arrays at bindings 0-2, nodes at binding 3, leaf points at binding 4,
+    // quadrupoles at binding 5
+    , descriptor_set_layout_split(make_descriptor_set_layout(6))
     , descriptor_set_split(make_descriptor_set(descriptor_set_layout_split))
     , pipeline_layout_split(make_pipeline_layout(descriptor_set_layout_split))
     , shader_integrate_split(make_shader(spv_integrate_split))
@@ -110,7 +214,56 @@ GpuDevice::GpuDevice()
     , staging_pos_mass(make_staging_buffer<BodyPosMass>(0))
     , staging_vel_radius(make_staging_buffer<BodyVelRadius>(0))
     , staging_acc(make_staging_buffer<BodyAcc>(0))
-{ }
+
+    // tree build: bodies at bindings 0-2, the tree at 3-5 as in the split layout, then keys,
+    // their sort copy, order, its sort copy, histogram, sources and the build state at 6-12
+    , descriptor_set_layout_tree(make_descriptor_set_layout(13))
+    , descriptor_set_tree_interleaved(make_descriptor_set(descriptor_set_layout_tree))
+    , descriptor_set_tree_split(make_descriptor_set(descriptor_set_layout_tree))
+    , pipeline_layout_tree(make_pipeline_layout(descriptor_set_layout_tree))
+    , shader_tree_keys(make_shader(spv_tree_keys))
+    , shader_tree_keys_split(make_shader(spv_tree_keys_split))
+    , shader_tree_histogram(make_shader(spv_tree_histogram))
+    , shader_tree_scan(make_shader(spv_tree_scan))
+    , shader_tree_scatter(make_shader(spv_tree_scatter))
+    , shader_tree_gather(make_shader(spv_tree_gather))
+    , shader_tree_subdivide(make_shader(spv_tree_subdivide))
+    , shader_tree_level(make_shader(spv_tree_level))
+    , shader_tree_moments(make_shader(spv_tree_moments))
+    , pipeline_tree_keys(make_pipeline(shader_tree_keys, pipeline_layout_tree))
+    , pipeline_tree_keys_split(make_pipeline(shader_tree_keys_split, pipeline_layout_tree))
+    , pipeline_tree_histogram(make_pipeline(shader_tree_histogram, pipeline_layout_tree))
+    , pipeline_tree_scan(make_pipeline(shader_tree_scan, pipeline_layout_tree))
+    , pipeline_tree_scatter(make_pipeline(shader_tree_scatter, pipeline_layout_tree))
+    , pipeline_tree_gather(make_pipeline(shader_tree_gather, pipeline_layout_tree))
+    , pipeline_tree_subdivide(make_pipeline(shader_tree_subdivide, pipeline_layout_tree))
+    , pipeline_tree_level(make_pipeline(shader_tree_level, pipeline_layout_tree))
+    , pipeline_tree_moments(make_pipeline(shader_tree_moments, pipeline_layout_tree))
+    , buffer_keys(make_device_buffer<uint64_t>(0))
+    , buffer_keys_alt(make_device_buffer<uint64_t>(0))
+    , buffer_order(make_device_buffer<uint32_t>(0))
+    , buffer_order_alt(make_device_buffer<uint32_t>(0))
+    , buffer_histogram(make_device_buffer<uint32_t>(0))
+    , buffer_sources(make_device_buffer<bh::Point>(0))
+
+    // Read by vkCmdDispatchIndirect as well as the shaders, and reset by vkCmdUpdateBuffer.
+    , buffer_tree_state(
+        physical_device, device, sizeof(TreeBuildState),
+        vk::BufferUsageFlagBits::eStorageBuffer |
+        vk::BufferUsageFlagBits::eIndirectBuffer |
+        vk::BufferUsageFlagBits::eTransferDst,
+        vk::MemoryPropertyFlagBits::eDeviceLocal)
+{
+    // Every pipeline is made by now, so the cache holds all there will be.
+    save_pipeline_cache();
+}
+
+GpuDevice::~GpuDevice()
+{
+    // A lost device has nothing left running to wait for.
+    try { finish(); }
+    catch (const vk::SystemError&) { }
+}
 
 std::string GpuDevice::probe() noexcept
 {
@@ -156,16 +309,44 @@ vk::raii::Instance GpuDevice::make_instance()
     // Specify required instance extensions, including the portability enumeration extension.
     std::vector<const char *> extensions = { "VK_KHR_portability_enumeration" };
 
+    // The layer and the extension its messages come through, if asked for. Checked here
+    // rather than left to instance creation, whose error would not say which layer.
+    std::vector<const char *> layers;
+    if (vulkan_validate())
+    {
+        const std::vector<vk::LayerProperties> available = context.enumerateInstanceLayerProperties();
+        const bool found = std::any_of(available.begin(), available.end(), [](const vk::LayerProperties& layer)
+            { return std::strcmp(layer.layerName.data(), validation_layer) == 0; });
+        if (!found)
+            throw std::runtime_error(std::string("NBODY_VK_VALIDATE is set but ") + validation_layer + " is not installed");
+        layers.push_back(validation_layer);
+        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
+
     // initialize the instance create info
     vk::InstanceCreateInfo instance_create_info(
         vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR,
         &app_info,
-        {}, // enabled layers
+        layers,
         extensions);
 
     return { context, instance_create_info };
 }
 
+vk::raii::DebugUtilsMessengerEXT GpuDevice::make_messenger()
+{
+    if (!vulkan_validate())
+        return nullptr;
+
+    using Severity = vk::DebugUtilsMessageSeverityFlagBitsEXT;
+    using Type = vk::DebugUtilsMessageTypeFlagBitsEXT;
+    return { instance, vk::DebugUtilsMessengerCreateInfoEXT(
+        {},
+        Severity::eWarning | Severity::eError,
+        Type::eGeneral | Type::eValidation | Type::ePerformance,
+        &report_validation) };
+}
+
 vk::raii::PhysicalDevice GpuDevice::make_physical_device()
 {
     vk::raii::PhysicalDevices devices(instance);
@@ -202,6 +383,12 @@ vk::raii::Device GpuDevice::make_device()
         queue_family_properties.begin(),
         compute_queue_family_properties));
 
+    // Whether the queue can time its own work, for StepStats. Not every compute queue can,
+    // and one that cannot says so with no valid bits.
+    const uint32_t timestamp_bits = compute_queue_family_properties->timestampValidBits;
+    timestamp_mask = timestamp_bits == 0 ? 0 : timestamp_bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << timestamp_bits) - 1;
+    timestamp_period = physical_device.getProperties().limits.timestampPeriod;
+
     // Capture tools delimit their work by frame boundary, which normally means
     // vkQueuePresentKHR. This instance is compute-only -- make_instance() requests no
     // surface extension and there is no swapchain anywhere -- so to a tool it appears to
@@ -243,12 +430,17 @@ vk::raii::Device GpuDevice::make_device()
     // VkFrameBoundaryEXT chained at submit time is ignored.
     vk::PhysicalDeviceFrameBoundaryFeaturesEXT frame_boundary_features(VK_TRUE);
 
+    // Timeline semaphores are core since 1.2 and required of every device that claims it,
+    // but still off unless asked for.
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timeline_features(VK_TRUE);
+    if (frame_boundary_enabled)
+        timeline_features.pNext = &frame_boundary_features;
+
     // create a Device
     float queue_priority = 0.0f;
     vk::DeviceQueueCreateInfo device_queue_create_info({}, queue_family_index, 1, &queue_priority);
     vk::DeviceCreateInfo device_create_info({}, device_queue_create_info, {}, extensions);
-    if (frame_boundary_enabled)
-        device_create_info.pNext = &frame_boundary_features;
+    device_create_info.pNext = &timeline_features;
 
     return { physical_device, device_create_info };
 }
@@ -258,25 +450,40 @@ vk::raii::CommandPool GpuDevice::make_command_pool()
     return { device, { vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queue_family_index } };
 }
 
-vk::raii::CommandBuffer GpuDevice::make_command_buffer()
+vk::raii::Semaphore GpuDevice::make_timeline()
 {
-    vk::CommandBufferAllocateInfo command_buffer_allocator_info( command_pool, vk::CommandBufferLevel::ePrimary, 1 );
-    return std::move(vk::raii::CommandBuffers(device, command_buffer_allocator_info).front());
+    const vk::SemaphoreTypeCreateInfo type_create_info(vk::SemaphoreType::eTimeline, 0);
+    return { device, vk::SemaphoreCreateInfo({ }, &type_create_info) };
+}
+
+// All of them up front: three command buffers cost next to nothing, and a change of
+// frames_in_flight then allocates nothing.
+vk::raii::CommandBuffers GpuDevice::make_command_buffers()
+{
+    vk::CommandBufferAllocateInfo command_buffer_allocator_info( command_pool, vk::CommandBufferLevel::ePrimary, max_frames_in_flight );
+    return vk::raii::CommandBuffers(device, command_buffer_allocator_info);
+}
+
+vk::raii::QueryPool GpuDevice::make_query_pool()
+{
+    return { device, vk::QueryPoolCreateInfo({ }, vk::QueryType::eTimestamp, max_frames_in_flight * timestamps_per_frame) };
 }
 
 vk::raii::DescriptorPool GpuDevice::make_descriptor_pool()
 {
     // The pool must cover every descriptor in every set allocated from it: the interleaved
-    // layout's two bindings and the split layout's four. Under-sizing this fails with
-    // ErrorOutOfPoolMemory on drivers that enforce it (e.g. MoltenVK).
+    // layout's four bindings, the split layout's six, and the tree build's thirteen once for
+    // each. Under-sizing this fails with ErrorOutOfPoolMemory on drivers that enforce it
+    // (e.g. MoltenVK).
     std::vector<vk::DescriptorPoolSize> pool_sizes = {
-        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 2 + 4)
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, 4 + 6 + 2 * 13)
     };
-    return { device, { { vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet }, 2, pool_sizes } };
+    return { device, { { vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet }, 4, pool_sizes } };
 }
 
-// Consecutive storage buffers from binding 0: bodies then nodes, or three body arrays then
-// nodes. The nodes sit last because neither integrate stage declares them.
+// Consecutive storage buffers from binding 0: bodies then the tree, or three body arrays then
+// the tree, the tree being its nodes, its leaf points and its quadrupoles. The tree sits last because
+// neither integrate stage declares it.
 vk::raii::DescriptorSetLayout GpuDevice::make_descriptor_set_layout(const uint32_t num_bindings)
 {
     std::vector<vk::DescriptorSetLayoutBinding> bindings;
@@ -304,12 +511,106 @@ vk::raii::ShaderModule GpuDevice::make_shader(const unsigned char* spv, size_t s
     return { device, { { }, size, reinterpret_cast<const uint32_t*>(spv) } };
 }
 
+// One file per device, driver and set of shaders: the cache's own header says which device
+// it was made for, but a driver update keeps the device's ids, two devices of a kind in one
+// machine share them, and the header says nothing of the shaders at all.
+std::string GpuDevice::make_pipeline_cache_path(const std::string& directory) const
+{
+    if (directory.empty())
+        return {};
+
+    const vk::PhysicalDeviceProperties properties = physical_device.getProperties();
+    std::ostringstream name;
+    name << std::hex << std::setfill('0')
+         << "pipelines-" << std::setw(4) << properties.vendorID
+         << "-" << std::setw(4) << properties.deviceID
+         << "-" << std::setw(8) << properties.driverVersion << "-";
+    for (const uint8_t byte : properties.pipelineCacheUUID)
+        name << std::setw(2) << unsigned(byte);
+    name << "-" << std::setw(16) << shader_fingerprint() << ".bin";
+    return (std::filesystem::path(directory) / name.str()).string();
+}
+
+// Primed from the file, if there is one and its header is this device's; empty otherwise,
+// which still spares the pipelines below compiling a shader they share twice.
+vk::raii::PipelineCache GpuDevice::make_pipeline_cache()
+{
+    std::vector<char> blob;
+    if (!pipeline_cache_path.empty())
+    {
+        std::ifstream file(pipeline_cache_path, std::ios::binary);
+        blob.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (!valid_pipeline_cache(blob, physical_device.getProperties()))
+            blob.clear();
+    }
+
+    if (!blob.empty())
+    {
+        try
+        {
+            vk::raii::PipelineCache cache(device, vk::PipelineCacheCreateInfo({ }, blob.size(), blob.data()));
+            pipeline_cache_loaded = fingerprint(blob.data(), blob.size());
+            return cache;
+        }
+        catch (const vk::SystemError& e)
+        {
+            if (vulkan_verbose())
+                std::cerr << "nbody: ignoring pipeline cache " << pipeline_cache_path << ": " << e.what() << std::endl;
+        }
+    }
+    return { device, vk::PipelineCacheCreateInfo() };
+}
+
 vk::raii::Pipeline GpuDevice::make_pipeline(vk::raii::ShaderModule& shader, vk::raii::PipelineLayout& layout)
 {
     // create the pipeline
     vk::PipelineShaderStageCreateInfo shader_stage_create_info({ }, vk::ShaderStageFlagBits::eCompute, *shader, "main");
     vk::ComputePipelineCreateInfo compute_pipeline_create_info({ }, shader_stage_create_info, *layout, { }, -1);
-    return { device, nullptr, compute_pipeline_create_info };
+    return { device, pipeline_cache, compute_pipeline_create_info };
+}
+
+// Unless the cache is just what was read in: a pipeline it did not hold, because the driver
+// would not take every entry or the file was written before one was added, is in it now and
+// should be for the next process too.
+//
+// Best effort: a directory that cannot be written to costs the next process its compile
+// and nothing else. The file is written under a name of its own and renamed over the old
+// one, so that a process starting alongside never reads it half written.
+void GpuDevice::save_pipeline_cache() const
+{
+    if (pipeline_cache_path.empty())
+        return;
+
+    try
+    {
+        const std::vector<uint8_t> blob = pipeline_cache.getData();
+        if (blob.empty() || fingerprint(blob.data(), blob.size()) == pipeline_cache_loaded)
+            return;
+
+        std::error_code error;
+        const std::filesystem::path path(pipeline_cache_path);
+        std::filesystem::create_directories(path.parent_path(), error);
+
+        const std::filesystem::path temporary = path.string() + "." + std::to_string(std::random_device()()) + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(blob.data()), std::streamsize(blob.size()));
+            if (!file)
+            {
+                file.close();
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+            std::filesystem::remove(temporary, error);
+    }
+    catch (const std::exception& e)
+    {
+        if (vulkan_verbose())
+            std::cerr << "nbody: could not save pipeline cache " << pipeline_cache_path << ": " << e.what() << std::endl;
+    }
 }
 
 // ---- interleaved layout -----------------------------------------------------------------
@@ -317,32 +618,52 @@ vk::raii::Pipeline GpuDevice::make_pipeline(vk::raii::ShaderModule& shader, vk::
 // The baseline as it stood before the split, kept separate rather than sharing machinery so
 // that a measurement of one says nothing about the other.
 
-void GpuDevice::write_interleaved(const std::vector<Body>& bodies, const std::vector<bh::Node>& nodes)
+void GpuDevice::write_interleaved(
+    const std::vector<Body>& bodies,
+    const std::vector<bh::Node>& nodes,
+    const std::vector<bh::Point>& points,
+    const std::vector<bh::Quadrupole>& quadrupoles)
 {
     NBODY_PROFILE_ZONE();
+    finish();
+
     // Land the data in host memory and size the device buffers to match. The copy across
     // is recorded into the next command buffer rather than done here, so it runs on the
     // transfer hardware alongside everything else instead of on this thread.
     const size_t bodies_bytes = sizeof(Body) * bodies.size();
     const size_t nodes_bytes = sizeof(bh::Node) * nodes.size();
+    const size_t points_bytes = sizeof(bh::Point) * points.size();
+    const size_t quadrupoles_bytes = sizeof(bh::Quadrupole) * quadrupoles.size();
 
     staging_bodies.reserve(bodies_bytes);
     staging_bodies.write(bodies.data(), 0, bodies_bytes);
     staging_nodes.reserve(nodes_bytes);
     staging_nodes.write(nodes.data(), 0, nodes_bytes);
-    if (buffer_bodies.reserve(bodies_bytes))
-        descriptors_stale_interleaved = true;
+    staging_points.reserve(points_bytes);
+    staging_points.write(points.data(), 0, points_bytes);
+    staging_quadrupoles.reserve(quadrupoles_bytes);
+    staging_quadrupoles.write(quadrupoles.data(), 0, quadrupoles_bytes);
+    if (reserve_bound(buffer_bodies, bodies_bytes))
+        descriptors_stale_interleaved = descriptors_stale_tree = true;
 
     // The node buffer belongs to both layouts, so a move here invalidates the split
     // bindings too -- and prepare_split() will not notice, since the capacity now suffices.
-    if (buffer_nodes.reserve(nodes_bytes))
-        descriptors_stale_interleaved = descriptors_stale_split = true;
+    if (reserve_bound(buffer_nodes, nodes_bytes))
+        descriptors_stale_interleaved = descriptors_stale_split = descriptors_stale_tree = true;
+
+    // Likewise the points, floored at one because a root-only tree has none to bind, and the
+    // quadrupoles, which a tree built without them has none of either.
+    if (reserve_bound(buffer_points, std::max<size_t>(points_bytes, sizeof(bh::Point))))
+        descriptors_stale_interleaved = descriptors_stale_split = descriptors_stale_tree = true;
+    if (reserve_bound(buffer_quadrupoles, std::max<size_t>(quadrupoles_bytes, sizeof(bh::Quadrupole))))
+        descriptors_stale_interleaved = descriptors_stale_split = descriptors_stale_tree = true;
 
     upload_pending_interleaved = true;
 
     // update push constant values
     push_constants.num_bodies = (int)bodies.size();
     push_constants.num_nodes = (int)nodes.size();
+    push_constants.quadrupole = quadrupoles.empty() ? 0 : 1;
 }
 
 // Rebind if a bound buffer has moved. Before recording, for the same reason prepare_split()
@@ -352,14 +673,19 @@ void GpuDevice::prepare_interleaved()
     if (!descriptors_stale_interleaved) { return; }
     descriptors_stale_interleaved = false;
 
+    // Not under a submission still reading the set.
+    finish();
+
     // the shaders bind the device buffers, never the staging pair
-    const std::array<vk::DescriptorBufferInfo, 2> buffer_infos
+    const std::array<vk::DescriptorBufferInfo, 4> buffer_infos
     {
         vk::DescriptorBufferInfo{ buffer_bodies.buffer, 0, buffer_bodies.size },
         vk::DescriptorBufferInfo{ buffer_nodes.buffer, 0, buffer_nodes.size },
+        vk::DescriptorBufferInfo{ buffer_points.buffer, 0, buffer_points.size },
+        vk::DescriptorBufferInfo{ buffer_quadrupoles.buffer, 0, buffer_quadrupoles.size },
     };
 
-    std::array<vk::WriteDescriptorSet, 2> descriptor_set_writes;
+    std::array<vk::WriteDescriptorSet, 4> descriptor_set_writes;
     for (uint32_t binding = 0; binding < descriptor_set_writes.size(); ++binding)
         descriptor_set_writes[binding] = vk::WriteDescriptorSet{
             *descriptor_set_interleaved,
@@ -377,6 +703,8 @@ void GpuDevice::prepare_interleaved()
 void GpuDevice::read_interleaved(std::vector<Body>& bodies)
 {
     NBODY_PROFILE_ZONE();
+    finish();
+
     // Copy back only what both sides can hold: the allocation only ever grows, so reading
     // all of it overruns `bodies` whenever the count has shrunk.
     const size_t want = std::min<size_t>(bodies.size() * sizeof(Body), staging_bodies.used);
@@ -390,26 +718,40 @@ void GpuDevice::record_upload_interleaved()
     upload_pending_interleaved = false;
 
     if (staging_bodies.used > 0)
-        command_buffer.copyBuffer(
+        command_buffer().copyBuffer(
             staging_bodies.buffer, buffer_bodies.buffer,
             vk::BufferCopy(0, 0, staging_bodies.used));
 
     if (staging_nodes.used > 0)
-        command_buffer.copyBuffer(
+        command_buffer().copyBuffer(
             staging_nodes.buffer, buffer_nodes.buffer,
             vk::BufferCopy(0, 0, staging_nodes.used));
 
+    if (staging_points.used > 0)
+        command_buffer().copyBuffer(
+            staging_points.buffer, buffer_points.buffer,
+            vk::BufferCopy(0, 0, staging_points.used));
+
+    if (staging_quadrupoles.used > 0)
+        command_buffer().copyBuffer(
+            staging_quadrupoles.buffer, buffer_quadrupoles.buffer,
+            vk::BufferCopy(0, 0, staging_quadrupoles.used));
+
     staging_bodies.clear_dirty();
     staging_nodes.clear_dirty();
+    staging_points.clear_dirty();
+    staging_quadrupoles.clear_dirty();
 
     const vk::MemoryBarrier barrier(
         vk::AccessFlagBits::eTransferWrite,
         vk::AccessFlagBits::eShaderRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eTransfer,
         vk::PipelineStageFlagBits::eComputeShader,
         { }, barrier, { }, { });
+
+    record_timestamp(Segment::Upload);
 }
 
 void GpuDevice::record_readback_interleaved()
@@ -420,36 +762,38 @@ void GpuDevice::record_readback_interleaved()
         vk::AccessFlagBits::eShaderWrite,
         vk::AccessFlagBits::eTransferRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eComputeShader,
         vk::PipelineStageFlagBits::eTransfer,
         { }, before, { }, { });
 
-    command_buffer.copyBuffer(
+    command_buffer().copyBuffer(
         buffer_bodies.buffer, staging_bodies.buffer,
         vk::BufferCopy(0, 0, buffer_bodies.used));
 
-    // Make the transfer visible to the host reads that follow the fence.
+    // Make the transfer visible to the host reads that follow the wait.
     const vk::MemoryBarrier after(
         vk::AccessFlagBits::eTransferWrite,
         vk::AccessFlagBits::eHostRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eTransfer,
         vk::PipelineStageFlagBits::eHost,
         { }, after, { }, { });
+
+    record_timestamp(Segment::Readback);
 }
 
-void GpuDevice::integrate_interleaved(const float dt, const float size, const bool wrap)
+void GpuDevice::integrate_interleaved(const float kick, const float drift, const float size, const bool wrap)
 {
-    set_integrate_constants(dt, size, wrap);
+    set_integrate_constants(kick, drift, size, wrap);
     prepare_interleaved();
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_interleaved();
     record_dispatch(pipeline_integrate_interleaved, pipeline_layout_interleaved, descriptor_set_interleaved);
     record_readback_interleaved();
-    command_buffer.end();
+    command_buffer().end();
 
     submit_and_wait(true, buffer_bodies.buffer);
 }
@@ -457,13 +801,20 @@ void GpuDevice::integrate_interleaved(const float dt, const float size, const bo
 void GpuDevice::accelerate_interleaved(const float theta, const float gravity, const Mode mode)
 {
     set_accelerate_constants(theta, gravity, mode);
+    const bool build = builds_tree(mode);
+    if (build)
+        reserve_tree();
     prepare_interleaved();
+    if (build)
+        prepare_tree();
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_interleaved();
+    if (build)
+        record_tree_build(pipeline_tree_keys, descriptor_set_tree_interleaved);
     record_dispatch(pipeline_accelerate_interleaved, pipeline_layout_interleaved, descriptor_set_interleaved);
     record_readback_interleaved();
-    command_buffer.end();
+    command_buffer().end();
 
     submit_and_wait(false, buffer_bodies.buffer);
 }
@@ -478,10 +829,17 @@ void GpuDevice::step_interleaved(
 {
     NBODY_PROFILE_ZONE();
 
+    const bool build = builds_tree(mode);
+    if (build)
+        reserve_tree();
     prepare_interleaved();
+    if (build)
+        prepare_tree();
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_interleaved();
+    if (build)
+        record_tree_build(pipeline_tree_keys, descriptor_set_tree_interleaved);
 
     set_accelerate_constants(theta, gravity, mode);
     record_dispatch(pipeline_accelerate_interleaved, pipeline_layout_interleaved, descriptor_set_interleaved);
@@ -490,11 +848,35 @@ void GpuDevice::step_interleaved(
 
     // Push constants are recorded into the command buffer, so re-pushing here applies to
     // the second dispatch only and leaves the first one's values alone.
-    set_integrate_constants(dt, size, wrap);
+    set_integrate_constants(dt, dt, size, wrap);
     record_dispatch(pipeline_integrate_interleaved, pipeline_layout_interleaved, descriptor_set_interleaved);
 
     record_readback_interleaved();
-    command_buffer.end();
+    command_buffer().end();
+
+    submit_and_wait(true, buffer_bodies.buffer);
+}
+
+void GpuDevice::run_interleaved(
+    const uint32_t steps,
+    const float dt,
+    const bool leapfrog,
+    const float gravity,
+    const float size,
+    const bool wrap)
+{
+    NBODY_PROFILE_ZONE();
+
+    prepare_interleaved();
+    set_accelerate_constants(0, gravity, Mode::N2);
+
+    begin_recording();
+    record_upload_interleaved();
+    record_steps(steps, dt, leapfrog, size, wrap,
+        pipeline_accelerate_interleaved, pipeline_integrate_interleaved,
+        pipeline_layout_interleaved, descriptor_set_interleaved);
+    record_readback_interleaved();
+    command_buffer().end();
 
     submit_and_wait(true, buffer_bodies.buffer);
 }
@@ -504,6 +886,7 @@ void GpuDevice::step_interleaved(
 void GpuDevice::reserve_bodies(const size_t num_bodies)
 {
     NBODY_PROFILE_ZONE();
+    finish();
     staging_pos_mass.reserve(sizeof(BodyPosMass) * num_bodies);
     staging_vel_radius.reserve(sizeof(BodyVelRadius) * num_bodies);
     staging_acc.reserve(sizeof(BodyAcc) * num_bodies);
@@ -514,6 +897,9 @@ GpuDevice::BodyMapping GpuDevice::map_bodies(const size_t offset, const size_t c
 {
     NBODY_PROFILE_ZONE();
 
+    // A queued dispatch may still be copying out of these, or reading back into them.
+    finish();
+
     // Marked here, on the calling thread: doing it per block inside the parallel loop
     // would race on the dirty range.
     staging_pos_mass.dirty(sizeof(BodyPosMass) * offset, sizeof(BodyPosMass) * count);
@@ -534,15 +920,27 @@ GpuDevice::BodyMapping GpuDevice::map_bodies(const size_t offset, const size_t c
         reinterpret_cast<BodyAcc*>(staging_acc.at(sizeof(BodyAcc) * offset)) };
 }
 
-void GpuDevice::write_nodes(const std::vector<bh::Node>& nodes)
+void GpuDevice::write_nodes(
+    const std::vector<bh::Node>& nodes,
+    const std::vector<bh::Point>& points,
+    const std::vector<bh::Quadrupole>& quadrupoles)
 {
     NBODY_PROFILE_ZONE();
+    finish();
+
     const size_t bytes = sizeof(bh::Node) * nodes.size();
+    const size_t points_bytes = sizeof(bh::Point) * points.size();
+    const size_t quadrupoles_bytes = sizeof(bh::Quadrupole) * quadrupoles.size();
 
     // Sized here rather than by the caller: the tree arrives finished and is rewritten whole.
     staging_nodes.reserve(bytes);
     staging_nodes.write(nodes.data(), 0, bytes);
+    staging_points.reserve(points_bytes);
+    staging_points.write(points.data(), 0, points_bytes);
+    staging_quadrupoles.reserve(quadrupoles_bytes);
+    staging_quadrupoles.write(quadrupoles.data(), 0, quadrupoles_bytes);
     push_constants.num_nodes = static_cast<int>(nodes.size());
+    push_constants.quadrupole = quadrupoles.empty() ? 0 : 1;
 }
 
 size_t GpuDevice::staged_body_count() const
@@ -569,14 +967,17 @@ void GpuDevice::download(const Readback want)
 {
     NBODY_PROFILE_ZONE();
 
+    // Staging is only what staging_valid says once everything queued is done writing it.
+    finish();
+
     // Only what the last submission did not already bring back.
     const Readback missing = want & ~staging_valid;
     if (!any(missing)) { return; }
 
     prepare_split();
-    command_buffer.begin({ });
+    begin_recording();
     record_readback_split(missing);
-    command_buffer.end();
+    command_buffer().end();
     submit_and_wait(false, buffer_pos_mass.buffer);
 }
 
@@ -590,11 +991,11 @@ void GpuDevice::prepare_split()
     // would push a stale array over the device's newer copy.
     const auto grow = [this](nbody::Buffer& device_buffer, nbody::Buffer& staging)
     {
-        if (!device_buffer.reserve(staging.used)) { return false; }
+        if (!reserve_bound(device_buffer, staging.used)) { return false; }
 
         // The old allocation took its contents with it, so nothing partial can be sent.
         staging.dirty(0, staging.used);
-        descriptors_stale_split = true;
+        descriptors_stale_split = descriptors_stale_tree = true;
         return true;
     };
 
@@ -605,26 +1006,44 @@ void GpuDevice::prepare_split()
     // Shared with the interleaved layout, whose bindings a move invalidates as well. Floored
     // at one node because integrate() binds the buffer without ever staging a tree, and a
     // zero-sized allocation is a null handle at range 0 -- VUID-VkDescriptorBufferInfo-range-00341.
-    if (buffer_nodes.reserve(std::max<size_t>(staging_nodes.used, sizeof(bh::Node))))
+    if (reserve_bound(buffer_nodes, std::max<size_t>(staging_nodes.used, sizeof(bh::Node))))
     {
         staging_nodes.dirty(0, staging_nodes.used);
         descriptors_stale_split = true;
         descriptors_stale_interleaved = true;
+        descriptors_stale_tree = true;
+    }
+    if (reserve_bound(buffer_points, std::max<size_t>(staging_points.used, sizeof(bh::Point))))
+    {
+        staging_points.dirty(0, staging_points.used);
+        descriptors_stale_split = true;
+        descriptors_stale_interleaved = true;
+        descriptors_stale_tree = true;
+    }
+    if (reserve_bound(buffer_quadrupoles, std::max<size_t>(staging_quadrupoles.used, sizeof(bh::Quadrupole))))
+    {
+        staging_quadrupoles.dirty(0, staging_quadrupoles.used);
+        descriptors_stale_split = true;
+        descriptors_stale_interleaved = true;
+        descriptors_stale_tree = true;
     }
 
     if (!descriptors_stale_split) { return; }
     descriptors_stale_split = false;
+    finish();
 
     // the shaders bind the device buffers, never the staging pair
-    const std::array<vk::DescriptorBufferInfo, 4> buffer_infos
+    const std::array<vk::DescriptorBufferInfo, 6> buffer_infos
     {
         vk::DescriptorBufferInfo{ buffer_pos_mass.buffer, 0, buffer_pos_mass.size },
         vk::DescriptorBufferInfo{ buffer_vel_radius.buffer, 0, buffer_vel_radius.size },
         vk::DescriptorBufferInfo{ buffer_acc.buffer, 0, buffer_acc.size },
         vk::DescriptorBufferInfo{ buffer_nodes.buffer, 0, buffer_nodes.size },
+        vk::DescriptorBufferInfo{ buffer_points.buffer, 0, buffer_points.size },
+        vk::DescriptorBufferInfo{ buffer_quadrupoles.buffer, 0, buffer_quadrupoles.size },
     };
 
-    std::array<vk::WriteDescriptorSet, 4> descriptor_set_writes;
+    std::array<vk::WriteDescriptorSet, 6> descriptor_set_writes;
     for (uint32_t binding = 0; binding < descriptor_set_writes.size(); ++binding)
         descriptor_set_writes[binding] = vk::WriteDescriptorSet{
             *descriptor_set_split,
@@ -652,7 +1071,7 @@ void GpuDevice::record_upload_split()
         from.clear_dirty();
 
         if (end <= begin) { return false; }
-        command_buffer.copyBuffer(from.buffer, to.buffer, vk::BufferCopy(begin, begin, end - begin));
+        command_buffer().copyBuffer(from.buffer, to.buffer, vk::BufferCopy(begin, begin, end - begin));
         return true;
     };
 
@@ -661,6 +1080,8 @@ void GpuDevice::record_upload_split()
     copied |= copy(staging_vel_radius, buffer_vel_radius);
     copied |= copy(staging_acc, buffer_acc);
     copied |= copy(staging_nodes, buffer_nodes);
+    copied |= copy(staging_points, buffer_points);
+    copied |= copy(staging_quadrupoles, buffer_quadrupoles);
 
     if (!copied) { return; }
 
@@ -668,10 +1089,12 @@ void GpuDevice::record_upload_split()
         vk::AccessFlagBits::eTransferWrite,
         vk::AccessFlagBits::eShaderRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eTransfer,
         vk::PipelineStageFlagBits::eComputeShader,
         { }, barrier, { }, { });
+
+    record_timestamp(Segment::Upload);
 }
 
 // Bring back the arrays named by `what`, once the shaders are done with them.
@@ -683,7 +1106,7 @@ void GpuDevice::record_readback_split(const Readback what)
         vk::AccessFlagBits::eShaderWrite,
         vk::AccessFlagBits::eTransferRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eComputeShader,
         vk::PipelineStageFlagBits::eTransfer,
         { }, before, { }, { });
@@ -691,33 +1114,50 @@ void GpuDevice::record_readback_split(const Readback what)
     const auto copy = [this](const nbody::Buffer& from, const nbody::Buffer& to)
     {
         if (from.used > 0)
-            command_buffer.copyBuffer(from.buffer, to.buffer, vk::BufferCopy(0, 0, from.used));
+            command_buffer().copyBuffer(from.buffer, to.buffer, vk::BufferCopy(0, 0, from.used));
     };
 
     if (any(what & Readback::Positions))     copy(buffer_pos_mass, staging_pos_mass);
     if (any(what & Readback::Velocities))    copy(buffer_vel_radius, staging_vel_radius);
     if (any(what & Readback::Accelerations)) copy(buffer_acc, staging_acc);
 
-    // Make the transfer visible to the host reads that follow the fence.
+    // Make the transfer visible to the host reads that follow the wait.
     const vk::MemoryBarrier after(
         vk::AccessFlagBits::eTransferWrite,
         vk::AccessFlagBits::eHostRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eTransfer,
         vk::PipelineStageFlagBits::eHost,
         { }, after, { }, { });
 
+    record_timestamp(Segment::Readback);
     staging_valid = staging_valid | what;
 }
 
+// One invocation per body, but for the brute-force accelerate, whose invocations each take
+// several.
 void GpuDevice::record_dispatch(vk::raii::Pipeline& pipeline, vk::raii::PipelineLayout& pipeline_layout, vk::raii::DescriptorSet& descriptor_set)
 {
-    command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
-    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipeline_layout, 0, { descriptor_set }, { });
-    command_buffer.pushConstants<PushConstants>(pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, push_constants);
-    const uint32_t group_count = (push_constants.num_bodies + 255) / 256;
-    command_buffer.dispatch(group_count, 1, 1);
+    const bool tiled = push_constants.mode == Mode::N2 &&
+                       (&pipeline == &pipeline_accelerate_interleaved || &pipeline == &pipeline_accelerate_split);
+    const uint32_t bodies_per_group = tiled ? 256 * n2_targets_per_invocation : 256;
+    record_dispatch(pipeline, pipeline_layout, descriptor_set, (uint32_t(push_constants.num_bodies) + bodies_per_group - 1) / bodies_per_group);
+}
+
+// As many workgroups as asked, for the few stages that are not one invocation per body.
+void GpuDevice::record_dispatch(vk::raii::Pipeline& pipeline, vk::raii::PipelineLayout& pipeline_layout, vk::raii::DescriptorSet& descriptor_set, const uint32_t group_count)
+{
+    command_buffer().bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+    command_buffer().bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipeline_layout, 0, { descriptor_set }, { });
+    command_buffer().pushConstants<PushConstants>(pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, push_constants);
+    command_buffer().dispatch(group_count, 1, 1);
+
+    // The tree build's many dispatches are stamped as one, by record_tree_build().
+    if (&pipeline == &pipeline_accelerate_interleaved || &pipeline == &pipeline_accelerate_split)
+        record_timestamp(Segment::Accelerate);
+    else if (&pipeline == &pipeline_integrate_interleaved || &pipeline == &pipeline_integrate_split)
+        record_timestamp(Segment::Integrate);
 }
 
 // Order one compute dispatch after another within a command buffer.
@@ -734,7 +1174,7 @@ void GpuDevice::record_dispatch_barrier()
         vk::AccessFlagBits::eShaderWrite,
         vk::AccessFlagBits::eShaderRead);
 
-    command_buffer.pipelineBarrier(
+    command_buffer().pipelineBarrier(
         vk::PipelineStageFlagBits::eComputeShader,
         vk::PipelineStageFlagBits::eComputeShader,
         { },
@@ -743,21 +1183,97 @@ void GpuDevice::record_dispatch_barrier()
         { });
 }
 
-// Submit the recorded command buffer and block until the device has finished it.
+// ---- frames in flight -------------------------------------------------------------------
+//
+// A submission no longer has a fence of its own to block on: each signals the timeline with
+// the next value up, and each frame's command buffer remembers the value it went out with.
+// Waiting is then a matter of which value, and a frame that needs nothing back from the
+// device does not wait at all, leaving it busy while the host gets on with the next one.
+
+void GpuDevice::set_frames_in_flight(const uint32_t frames)
+{
+    const uint32_t clamped = std::clamp<uint32_t>(frames, 1, max_frames_in_flight);
+    if (clamped == frames_in_flight) { return; }
+
+    // The turn of command buffers starts over, so none may still be in use.
+    finish();
+    frames_in_flight = clamped;
+    frame = 0;
+}
+
+void GpuDevice::finish()
+{
+    wait(submitted);
+}
+
+void GpuDevice::wait(const uint64_t value)
+{
+    if (value <= completed) { return; }
+
+    // Split from the submission: the only span that says how long the shaders took.
+    NBODY_PROFILE_ZONE_NAMED("wait for device");
+    const vk::SemaphoreWaitInfo wait_info({ }, 1, &*timeline, &value);
+    const vk::Result result = device.waitSemaphores(wait_info, UINT64_MAX);
+    assert(result == vk::Result::eSuccess);
+    (void)result;
+    completed = value;
+    collect_timestamps();
+}
+
+void GpuDevice::begin_recording()
+{
+    frame = (frame + 1) % frames_in_flight;
+    wait(frame_done[frame]);
+    command_buffer().begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+
+    frame_timestamps[frame].segments.clear();
+    if (timestamp_mask != 0)
+        command_buffer().resetQueryPool(*query_pool, frame * timestamps_per_frame, timestamps_per_frame);
+
+    // With the last submission possibly still running, queue order is all that stands
+    // between its writes and this one's reads, and queue order orders nothing. Waiting on
+    // the host used to hide that.
+    const vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite |
+        vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite |
+        vk::AccessFlagBits::eIndirectCommandRead);
+
+    command_buffer().pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eDrawIndirect,
+        { }, barrier, { }, { });
+
+    // Written once everything before it is done, the last frame included, so the first
+    // segment counts from where this frame's own work starts.
+    if (timestamp_mask != 0)
+        command_buffer().writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool, frame * timestamps_per_frame);
+}
+
+// Submit the recorded command buffer, to signal the timeline when it is done.
 //
 // `frame_end` closes a frame for capture tools. Only the last submission of a simulation
 // step should set it, or a tool would see each dispatch as a frame of its own.
-void GpuDevice::submit_and_wait(const bool frame_end, const vk::raii::Buffer& frame_buffer)
+void GpuDevice::submit(const bool frame_end, const vk::raii::Buffer& frame_buffer)
 {
     NBODY_PROFILE_ZONE();
-    device.resetFences({ *fence });
+    const uint64_t value = submitted + 1;
+
+    vk::TimelineSemaphoreSubmitInfo timeline_submit_info(
+        0, // wait value count
+        nullptr, // wait values
+        1, // signal value count
+        &value);
 
     vk::SubmitInfo submit_info(
         0, // wait semaphore count
         nullptr, // wait semaphores
         nullptr, // wait destination stage mask flags
         1, // command buffer count
-        &*command_buffer);
+        &*command_buffer(),
+        1, // signal semaphore count
+        &*timeline,
+        &timeline_submit_info);
 
     // The buffer is named as the frame's output so a tool can report what the frame
     // produced; imageCount stays 0, since a compute-only frame renders to nothing.
@@ -768,20 +1284,123 @@ void GpuDevice::submit_and_wait(const bool frame_end, const vk::raii::Buffer& fr
     frame_boundary.pBuffers = &*frame_buffer;
     if (frame_end && frame_boundary_enabled)
     {
-        submit_info.pNext = &frame_boundary;
+        timeline_submit_info.pNext = &frame_boundary;
         ++frame_id;
     }
 
-    queue.submit(submit_info, *fence);
+    queue.submit(submit_info);
+    submitted = value;
+    frame_done[frame] = value;
+    frame_timestamps[frame].value = value;
+    frame_timestamps[frame].pending = true;
+}
+
+void GpuDevice::submit_and_wait(const bool frame_end, const vk::raii::Buffer& frame_buffer)
+{
+    submit(frame_end, frame_buffer);
+    finish();
+}
+
+void GpuDevice::submit_frame(const bool frame_end, const vk::raii::Buffer& frame_buffer)
+{
+    if (frames_in_flight > 1)
+        submit(frame_end, frame_buffer);
+    else
+        submit_and_wait(frame_end, frame_buffer);
+}
+
+// ---- timing -----------------------------------------------------------------------------
+//
+// Each command buffer stamps the end of every segment it records: the uploads, the tree
+// build, each accelerate and integrate dispatch, the readbacks. The span between two stamps
+// is one segment's time on the device. The stamps are only read after the timeline says
+// that frame is done, and never waited for on their own.
+
+void GpuDevice::record_timestamp(const Segment segment)
+{
+    FrameTimestamps& timestamps = frame_timestamps[frame];
+    if (timestamp_mask == 0 || timestamps.segments.size() + 1 >= timestamps_per_frame) { return; }
 
+    timestamps.segments.push_back(segment);
+    command_buffer().writeTimestamp(
+        vk::PipelineStageFlagBits::eBottomOfPipe, *query_pool,
+        frame * timestamps_per_frame + uint32_t(timestamps.segments.size()));
+}
+
+void GpuDevice::collect_timestamps()
+{
+    for (;;)
     {
-        // Split from the submission: the only span that says how long the shaders took.
-        NBODY_PROFILE_ZONE_NAMED("wait for device");
-        const vk::Result result = device.waitForFences({ *fence }, VK_TRUE, UINT64_MAX);
-        assert(result == vk::Result::eSuccess);
+        // Oldest first: step_ends is in submission order.
+        FrameTimestamps* oldest = nullptr;
+        for (FrameTimestamps& timestamps : frame_timestamps)
+            if (timestamps.pending && timestamps.value <= completed && (!oldest || timestamps.value < oldest->value))
+                oldest = &timestamps;
+        if (!oldest) { return; }
+        oldest->pending = false;
+
+        if (!oldest->segments.empty())
+        {
+            const uint32_t first = uint32_t(oldest - frame_timestamps.data()) * timestamps_per_frame;
+            const uint32_t count = uint32_t(oldest->segments.size()) + 1;
+            const auto [result, ticks] = query_pool.getResults<uint64_t>(
+                first, count, sizeof(uint64_t) * count, sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+
+            if (result == vk::Result::eSuccess)
+            {
+                for (size_t i = 0; i < oldest->segments.size(); ++i)
+                {
+                    const double seconds = double((ticks[i + 1] - ticks[i]) & timestamp_mask) * double(timestamp_period) * 1e-9;
+                    switch (oldest->segments[i])
+                    {
+                    case Segment::Upload:     open_step.upload += seconds; break;
+                    case Segment::Tree:       open_step.tree += seconds; break;
+                    case Segment::Accelerate: open_step.accelerate += seconds; break;
+                    case Segment::Integrate:  open_step.integrate += seconds; break;
+                    case Segment::Readback:   open_step.readback += seconds; break;
+                    }
+                }
+            }
+        }
+
+        collected = oldest->value;
+        while (!step_ends.empty() && step_ends.front() <= collected)
+        {
+            step_ends.pop_front();
+            close_step();
+        }
     }
 }
 
+void GpuDevice::close_step()
+{
+    open_step.device_timed = timestamp_mask != 0;
+    closed_step = open_step;
+    open_step = {};
+
+    NBODY_PROFILE_PLOT("gpu upload ms", closed_step.upload * 1e3);
+    NBODY_PROFILE_PLOT("gpu tree ms", closed_step.tree * 1e3);
+    NBODY_PROFILE_PLOT("gpu accelerate ms", closed_step.accelerate * 1e3);
+    NBODY_PROFILE_PLOT("gpu integrate ms", closed_step.integrate * 1e3);
+    NBODY_PROFILE_PLOT("gpu readback ms", closed_step.readback * 1e3);
+}
+
+void GpuDevice::end_step()
+{
+    // A step the device has already done, as every step is when nothing is queued, closes
+    // now; one still on the device closes when its last submission is read.
+    if (submitted <= collected)
+        close_step();
+    else
+        step_ends.push_back(submitted);
+}
+
+nbody::StepStats GpuDevice::last_step()
+{
+    finish();
+    return closed_step;
+}
+
 void GpuDevice::set_accelerate_constants(const float theta, const float gravity, const Mode mode)
 {
     push_constants.theta = theta;
@@ -789,53 +1408,61 @@ void GpuDevice::set_accelerate_constants(const float theta, const float gravity,
     push_constants.mode = mode;
 }
 
-void GpuDevice::set_integrate_constants(const float dt, const float size, const bool wrap)
+void GpuDevice::set_integrate_constants(const float kick, const float drift, const float size, const bool wrap)
 {
-    push_constants.dt = dt;
+    push_constants.kick = kick;
+    push_constants.drift = drift;
     push_constants.size = size;
     push_constants.wrap = wrap ? 1 : 0;
 }
 
-void GpuDevice::integrate(const float dt, const float size, const bool wrap, const Readback readback)
+void GpuDevice::integrate(const float kick, const float drift, const float size, const bool wrap, const Readback readback)
 {
-    set_integrate_constants(dt, size, wrap);
+    set_integrate_constants(kick, drift, size, wrap);
     prepare_split();
 
     // The dispatch overwrites positions and velocities, so staging is a step behind on them.
     staging_valid = staging_valid & ~(Readback::Positions | Readback::Velocities);
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_split();
     record_dispatch(pipeline_integrate_split, pipeline_layout_split, descriptor_set_split);
     record_readback_split(readback);
-    command_buffer.end();
+    command_buffer().end();
 
-    submit_and_wait(true, buffer_pos_mass.buffer);
+    submit_frame(true, buffer_pos_mass.buffer);
 }
 
 void GpuDevice::accelerate(const float theta, const float gravity, const Mode mode, const Readback readback)
 {
     set_accelerate_constants(theta, gravity, mode);
+    const bool build = builds_tree(mode);
+    if (build)
+        reserve_tree();
     prepare_split();
+    if (build)
+        prepare_tree();
 
     // Only the accelerations are touched; staged positions and velocities stay good.
     staging_valid = staging_valid & ~Readback::Accelerations;
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_split();
+    if (build)
+        record_tree_build(pipeline_tree_keys_split, descriptor_set_tree_split);
     record_dispatch(pipeline_accelerate_split, pipeline_layout_split, descriptor_set_split);
     record_readback_split(readback);
-    command_buffer.end();
+    command_buffer().end();
 
-    submit_and_wait(false, buffer_pos_mass.buffer);
+    submit_frame(false, buffer_pos_mass.buffer);
 }
 
 // A whole simulation step in one submission.
 //
 // Running accelerate() and integrate() back to back costs two round trips: the host blocks
-// on the first fence before it has even recorded the second dispatch, so the device
+// on the first wait before it has even recorded the second dispatch, so the device
 // finishes accelerating and then idles while the host wakes up and submits again. Recording
-// both against one barrier keeps the ordering guarantee the fence was providing while
+// both against one barrier keeps the ordering guarantee the wait was providing while
 // leaving the device with work already queued behind the first dispatch.
 //
 // The separate entry points remain for callers that genuinely need one half on its own.
@@ -850,13 +1477,20 @@ void GpuDevice::step(
 {
     NBODY_PROFILE_ZONE();
 
+    const bool build = builds_tree(mode);
+    if (build)
+        reserve_tree();
     prepare_split();
+    if (build)
+        prepare_tree();
 
     // Both dispatches together rewrite all three arrays.
     staging_valid = Readback::None;
 
-    command_buffer.begin({ });
+    begin_recording();
     record_upload_split();
+    if (build)
+        record_tree_build(pipeline_tree_keys_split, descriptor_set_tree_split);
 
     set_accelerate_constants(theta, gravity, mode);
     record_dispatch(pipeline_accelerate_split, pipeline_layout_split, descriptor_set_split);
@@ -865,13 +1499,300 @@ void GpuDevice::step(
 
     // Push constants are recorded into the command buffer, so re-pushing here applies to
     // the second dispatch only and leaves the first one's values alone.
-    set_integrate_constants(dt, size, wrap);
+    set_integrate_constants(dt, dt, size, wrap);
     record_dispatch(pipeline_integrate_split, pipeline_layout_split, descriptor_set_split);
 
     record_readback_split(readback);
-    command_buffer.end();
+    command_buffer().end();
+
+    submit_frame(true, buffer_pos_mass.buffer);
+}
+
+// Many steps in one submission.
+//
+// Where step() saves the round trip between the two halves of a step, this saves the ones
+// between steps: at a few thousand bodies a brute-force step is over in less time than the
+// host takes to wake from its wait, read back, and record and submit the next one.
+void GpuDevice::run(
+    const uint32_t steps,
+    const float dt,
+    const bool leapfrog,
+    const float gravity,
+    const float size,
+    const bool wrap,
+    const Readback readback)
+{
+    NBODY_PROFILE_ZONE();
+
+    prepare_split();
+    staging_valid = Readback::None;
+    set_accelerate_constants(0, gravity, Mode::N2);
+
+    begin_recording();
+    record_upload_split();
+    record_steps(steps, dt, leapfrog, size, wrap,
+        pipeline_accelerate_split, pipeline_integrate_split,
+        pipeline_layout_split, descriptor_set_split);
+    record_readback_split(readback);
+    command_buffer().end();
+
+    submit_frame(true, buffer_pos_mass.buffer);
+}
 
-    submit_and_wait(true, buffer_pos_mass.buffer);
+// Every dispatch after the first reads what the one before it wrote: the positions and
+// velocities each integrate leaves, the accelerations each accelerate does.
+void GpuDevice::record_steps(
+    const uint32_t steps,
+    const float dt,
+    const bool leapfrog,
+    const float size,
+    const bool wrap,
+    vk::raii::Pipeline& accelerate,
+    vk::raii::Pipeline& integrate,
+    vk::raii::PipelineLayout& layout,
+    vk::raii::DescriptorSet& set)
+{
+    for (uint32_t step = 0; step < steps; ++step)
+    {
+        if (step > 0)
+            record_dispatch_barrier();
+
+        if (leapfrog)
+        {
+            set_integrate_constants(.5f * dt, dt, size, wrap);
+            record_dispatch(integrate, layout, set);
+            record_dispatch_barrier();
+        }
+
+        record_dispatch(accelerate, layout, set);
+        record_dispatch_barrier();
+
+        if (leapfrog)
+            set_integrate_constants(.5f * dt, 0, size, wrap);
+        else
+            set_integrate_constants(dt, dt, size, wrap);
+        record_dispatch(integrate, layout, set);
+    }
+}
+
+// Buffer::reserve() for a buffer a queued submission may bind: growing frees the old
+// allocation, so the device has to be done with it first.
+bool GpuDevice::reserve_bound(nbody::Buffer& buffer, const size_t bytes)
+{
+    if (bytes > buffer.size)
+        finish();
+    return buffer.reserve(bytes);
+}
+
+// ---- tree build -------------------------------------------------------------------------
+//
+// The host's build, a sort by morton key and the nodes emitted from the sorted runs, done in
+// compute shaders instead, so that a barnes-hut step needs nothing from the host and sends
+// nothing to it. The stages, each ordered after the last by a barrier:
+//
+//   keys       a 60-bit morton key per body, twenty levels of octant, and its point set aside
+//   sort       sixteen radix passes of four bits, each a histogram per tile, a scan of the
+//              histograms, and a stable scatter; the keys end up where they started
+//   gather     the points into key order, which is leaf order
+//   subdivide  top down, a level at a time: each node holding more than a leaf's worth of
+//              bodies gets eight children, their ranges found by binary search of the keys
+//   moments    bottom up, a level at a time: masses, centers and quadrupoles
+//
+// The node count each level ends up with is only known on the device, so the per-level
+// dispatches are indirect, sized by tree_level.comp as each level closes.
+
+void GpuDevice::build_tree_on_device(const bool enabled, const float size, const bool quadrupoles, const uint32_t leaf_capacity)
+{
+    device_tree.enabled = enabled;
+    device_tree.size = size;
+    device_tree.quadrupoles = quadrupoles;
+    device_tree.leaf_capacity = std::max<uint32_t>(leaf_capacity, 1);
+}
+
+void GpuDevice::reserve_tree()
+{
+    NBODY_PROFILE_ZONE();
+    const size_t num_bodies = size_t(std::max(push_constants.num_bodies, 0));
+    const size_t tiles = (num_bodies + 255) / 256;
+
+    // A split for every four bodies, and a chain of them down through the empty levels
+    // above a cluster, is several times what a galaxy needs: the host's builds of a disk
+    // come to under one node per body. A build that does run out leaves the rest of its
+    // cells as oversized leaves, which cost traversal time but sum the same forces.
+    device_tree.max_nodes = int(1 + 8 * (num_bodies / 4 + 8 * device_tree_depth));
+    const size_t max_nodes = size_t(device_tree.max_nodes);
+
+    // The tree's buffers are bound by both layouts' own sets as well.
+    bool moved = false;
+    moved |= reserve_bound(buffer_nodes, sizeof(bh::Node) * max_nodes);
+    moved |= reserve_bound(buffer_points, sizeof(bh::Point) * std::max<size_t>(num_bodies, 1));
+    moved |= reserve_bound(buffer_quadrupoles, sizeof(bh::Quadrupole) * (device_tree.quadrupoles ? max_nodes : 1));
+    if (moved)
+        descriptors_stale_interleaved = descriptors_stale_split = descriptors_stale_tree = true;
+
+    // Floored at one element, like the tree's: a zero-sized buffer cannot be bound.
+    const size_t count = std::max<size_t>(num_bodies, 1);
+    bool own = false;
+    own |= reserve_bound(buffer_keys, sizeof(uint32_t[2]) * count);
+    own |= reserve_bound(buffer_keys_alt, sizeof(uint32_t[2]) * count);
+    own |= reserve_bound(buffer_order, sizeof(uint32_t) * count);
+    own |= reserve_bound(buffer_order_alt, sizeof(uint32_t) * count);
+    own |= reserve_bound(buffer_histogram, sizeof(uint32_t) * 16 * std::max<size_t>(tiles, 1));
+    own |= reserve_bound(buffer_sources, sizeof(bh::Point) * count);
+    if (own)
+        descriptors_stale_tree = true;
+}
+
+void GpuDevice::prepare_tree()
+{
+    if (!descriptors_stale_tree) { return; }
+    descriptors_stale_tree = false;
+    finish();
+
+    const auto write = [this](vk::raii::DescriptorSet& set, const std::array<const nbody::Buffer*, 13>& buffers)
+    {
+        // Reserved up front: the writes point into it.
+        std::vector<vk::DescriptorBufferInfo> buffer_infos;
+        buffer_infos.reserve(buffers.size());
+        std::vector<vk::WriteDescriptorSet> descriptor_set_writes;
+
+        for (uint32_t binding = 0; binding < buffers.size(); ++binding)
+        {
+            // The bodies of a layout not yet used: nothing to bind, and nothing will read
+            // them until that layout has allocated, which marks the sets stale again.
+            if (buffers[binding]->size == 0)
+                continue;
+
+            buffer_infos.emplace_back(buffers[binding]->buffer, 0, buffers[binding]->size);
+            descriptor_set_writes.emplace_back(
+                *set,
+                binding,
+                0, // starting array element
+                1, // descriptor count
+                vk::DescriptorType::eStorageBuffer,
+                nullptr,
+                &buffer_infos.back());
+        }
+
+        device.updateDescriptorSets(descriptor_set_writes, { });
+    };
+
+    write(descriptor_set_tree_interleaved, {
+        &buffer_bodies, &buffer_bodies, &buffer_bodies,
+        &buffer_nodes, &buffer_points, &buffer_quadrupoles,
+        &buffer_keys, &buffer_keys_alt, &buffer_order, &buffer_order_alt,
+        &buffer_histogram, &buffer_sources, &buffer_tree_state });
+
+    write(descriptor_set_tree_split, {
+        &buffer_pos_mass, &buffer_vel_radius, &buffer_acc,
+        &buffer_nodes, &buffer_points, &buffer_quadrupoles,
+        &buffer_keys, &buffer_keys_alt, &buffer_order, &buffer_order_alt,
+        &buffer_histogram, &buffer_sources, &buffer_tree_state });
+}
+
+void GpuDevice::record_tree_build(vk::raii::Pipeline& keys, vk::raii::DescriptorSet& set)
+{
+    NBODY_PROFILE_ZONE();
+    const uint32_t num_bodies = uint32_t(push_constants.num_bodies);
+
+    // Left in place for the accelerate dispatch that follows: the traversal stops at
+    // num_nodes, and no link it follows leads past the nodes the build wrote.
+    push_constants.size = device_tree.size;
+    push_constants.num_nodes = device_tree.max_nodes;
+    push_constants.max_nodes = device_tree.max_nodes;
+    push_constants.leaf_capacity = int(device_tree.leaf_capacity);
+    push_constants.quadrupole = device_tree.quadrupoles ? 1 : 0;
+
+    // Level 0 is the root alone, holding every body.
+    TreeBuildState state;
+    state.dispatch[0][0] = state.dispatch[0][1] = state.dispatch[0][2] = 1;
+    state.node_count = 1;
+    state.node_limit = uint32_t(device_tree.max_nodes);
+    state.level_begin[1] = 1;
+    const bh::Node root = {
+        .bounds = { .center = { 0, 0, 0 }, .size = device_tree.size },
+        .com = { 0, 0, 0 },
+        .count = num_bodies };
+
+    // Behind any copy an upload just recorded into the node buffer.
+    const vk::MemoryBarrier before(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eTransferWrite);
+    command_buffer().pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eTransfer,
+        { }, before, { }, { });
+
+    command_buffer().updateBuffer<TreeBuildState>(buffer_tree_state.buffer, 0, state);
+    command_buffer().updateBuffer<bh::Node>(buffer_nodes.buffer, 0, root);
+
+    const vk::MemoryBarrier after(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eIndirectCommandRead);
+    command_buffer().pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eDrawIndirect,
+        { }, after, { }, { });
+
+    record_dispatch(keys, pipeline_layout_tree, set);
+    record_tree_barrier();
+
+    // An even number of passes, so the sorted keys and order finish in the buffers the key
+    // stage wrote, where the later stages read them.
+    for (uint32_t pass = 0; pass < 16; ++pass)
+    {
+        push_constants.sort_pass = pass;
+        record_dispatch(pipeline_tree_histogram, pipeline_layout_tree, set);
+        record_tree_barrier();
+        record_dispatch(pipeline_tree_scan, pipeline_layout_tree, set, 1);
+        record_tree_barrier();
+        record_dispatch(pipeline_tree_scatter, pipeline_layout_tree, set);
+        record_tree_barrier();
+    }
+
+    record_dispatch(pipeline_tree_gather, pipeline_layout_tree, set);
+    record_tree_barrier();
+
+    for (int level = 0; level < device_tree_depth; ++level)
+    {
+        push_constants.level = level;
+        record_tree_dispatch_indirect(pipeline_tree_subdivide, set, level);
+        record_tree_barrier();
+        record_dispatch(pipeline_tree_level, pipeline_layout_tree, set, 1);
+        record_tree_barrier();
+    }
+
+    for (int level = device_tree_depth; level >= 0; --level)
+    {
+        push_constants.level = level;
+        record_tree_dispatch_indirect(pipeline_tree_moments, set, level);
+        record_tree_barrier();
+    }
+
+    record_timestamp(Segment::Tree);
+}
+
+// One of a level's dispatches, sized by the workgroup count tree_level.comp left for it.
+void GpuDevice::record_tree_dispatch_indirect(vk::raii::Pipeline& pipeline, vk::raii::DescriptorSet& set, const int level)
+{
+    command_buffer().bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+    command_buffer().bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipeline_layout_tree, 0, { set }, { });
+    command_buffer().pushConstants<PushConstants>(pipeline_layout_tree, vk::ShaderStageFlagBits::eCompute, 0, push_constants);
+    command_buffer().dispatchIndirect(buffer_tree_state.buffer, offsetof(TreeBuildState, dispatch) + sizeof(uint32_t[4]) * size_t(level));
+}
+
+// record_dispatch_barrier(), widened for the build: its stages also overwrite what the stage
+// before them read, and write the arguments of the indirect dispatches after them.
+void GpuDevice::record_tree_barrier()
+{
+    const vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eShaderWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eIndirectCommandRead);
+
+    command_buffer().pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eDrawIndirect,
+        { }, barrier, { }, { });
 }
 
 nbody::Buffer::Buffer(
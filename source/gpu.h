@@ -1,11 +1,15 @@
 #pragma once
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <string>
 #include <vector>
 #include "vulkan/vulkan_raii.hpp"
 #include "nbody/body.h"
 #include "nbody/bhtree.h"
 #include "nbody/constants.h"
+#include "nbody/stats.h"
 
 namespace nbody
 {
@@ -16,7 +20,7 @@ namespace nbody
     // Append new fields at the end so existing offsets stay put.
     struct PushConstants
     {
-        float dt = 0;
+        float kick = 0;   // the integrate stage's: velocity += acceleration * kick
         float theta = 0;
         float G = nbody::G;
         int num_bodies = 0;
@@ -24,6 +28,35 @@ namespace nbody
         Mode mode = Mode::NLogN;
         float size = 0;
         int wrap = 1;
+        int quadrupole = 0;   // whether the staged tree carries quadrupole moments
+        float drift = 0;      // and position += velocity * drift
+        uint32_t sort_pass = 0;   // the rest are the device tree build's: see record_tree_build()
+        int level = 0;
+        int max_nodes = 0;
+        int leaf_capacity = 0;
+    };
+
+    // Levels below the root of a tree built on the device: its morton keys are two 30-bit
+    // words, ten levels to each. Must match TREE_DEPTH in shaders/include/tree_build.glsl.
+    constexpr int device_tree_depth = 20;
+
+    // Bodies each invocation of a brute-force accelerate sums the forces on, so a workgroup
+    // covers this many times its width. Must match N2_TARGETS in
+    // shaders/include/accelerate_n2.glsl.
+    constexpr uint32_t n2_targets_per_invocation = 2;
+
+    // The most submissions GpuDevice::set_frames_in_flight() lets queue on the device at once.
+    constexpr uint32_t max_frames_in_flight = 3;
+
+    // Where the device tree build keeps its place. Must match the TreeState block in
+    // shaders/include/tree_build.glsl field for field; the dispatch counts lead so that level
+    // L's lies at a fixed offset, 16 * L, for vkCmdDispatchIndirect.
+    struct TreeBuildState
+    {
+        uint32_t dispatch[device_tree_depth + 1][4] = {};
+        uint32_t node_count = 0;
+        uint32_t node_limit = 0;
+        uint32_t level_begin[device_tree_depth + 2] = {};
     };
 
     // The bodies as parallel arrays, grouped by how often each field crosses the bus. Must
@@ -131,13 +164,17 @@ namespace nbody
     //
     // Carries two body layouts so they can be measured against each other: `interleaved`,
     // one array of Body moved whole every step, and `split`, three arrays grouped by
-    // transfer lifetime. They share the device, queue, command buffer and node buffer.
+    // transfer lifetime. They share the device, queue, command buffers and node buffer.
     class GpuDevice
     {
     public:
 
-        // Throws if the device cannot be brought up.
-        GpuDevice();
+        // Throws if the device cannot be brought up. Pipelines are kept in `pipeline_cache_dir`
+        // between processes, if it is not empty: see Sim::set_pipeline_cache_dir().
+        explicit GpuDevice(const std::string& pipeline_cache_dir = {});
+
+        // Waits out anything still queued: it binds the buffers about to be freed.
+        ~GpuDevice();
 
         // Is there a compute-capable Vulkan device on this machine? Returns an empty
         // string if so, otherwise a human-readable reason. Never throws.
@@ -149,12 +186,19 @@ namespace nbody
 
         // ---- interleaved layout: the baseline. Everything moves every step. -------------
 
-        void write_interleaved(const std::vector<Body>& bodies, const std::vector<bh::Node>& nodes);
+        void write_interleaved(
+            const std::vector<Body>& bodies,
+            const std::vector<bh::Node>& nodes,
+            const std::vector<bh::Point>& points,
+            const std::vector<bh::Quadrupole>& quadrupoles);
         void read_interleaved(std::vector<Body>& bodies);
-        void integrate_interleaved(float dt, float size, bool wrap);
+        void integrate_interleaved(float kick, float drift, float size, bool wrap);
         void accelerate_interleaved(float theta, float gravity, Mode mode);
         void step_interleaved(float dt, float theta, float gravity, Mode mode, float size, bool wrap);
 
+        // run() below, over the interleaved array, and always read back at the end.
+        void run_interleaved(uint32_t steps, float dt, bool leapfrog, float gravity, float size, bool wrap);
+
         // ---- split layout ----------------------------------------------------------------
 
         // Writable pointers into staging, for a caller de-interleaving in place. Valid until
@@ -173,22 +217,29 @@ namespace nbody
         // Map [offset, offset + count) of the body arrays and mark it for upload.
         BodyMapping map_bodies(size_t offset, size_t count);
 
-        // Stage the barnes-hut nodes. Sizes itself: the tree is rewritten whole every frame.
-        void write_nodes(const std::vector<bh::Node>& nodes);
-
-        // Which staging arrays match the device. Reading one staged() does not name gives
-        // the previous step's data.
+        // Stage the barnes-hut nodes, the leaf bodies they range over (bh::Tree::points()) and
+        // their quadrupoles, if the tree has any. Sizes itself: the tree is rewritten whole
+        // every frame.
+        void write_nodes(
+            const std::vector<bh::Node>& nodes,
+            const std::vector<bh::Point>& points,
+            const std::vector<bh::Quadrupole>& quadrupoles);
+
+        // Which staging arrays match the device, or will once what is queued is done.
+        // Reading one staged() does not name gives the previous step's data, and reading
+        // any before a download() may race the device still writing it.
         [[nodiscard]] Readback staged() const { return staging_valid; }
         [[nodiscard]] size_t staged_body_count() const;
         [[nodiscard]] const BodyPosMass* staged_pos_mass() const;
         [[nodiscard]] const BodyVelRadius* staged_vel_radius() const;
         [[nodiscard]] const BodyAcc* staged_acc() const;
 
-        // Bring back anything in `want` that staging lacks, in a submission of its own. A
-        // no-op when the last dispatch already read it back.
+        // Bring back anything in `want` that staging lacks, in a submission of its own, and
+        // wait for it and for everything queued before it. Only the wait when the last
+        // dispatch already read it back.
         void download(Readback want);
 
-        void integrate(float dt, float size, bool wrap, Readback readback);
+        void integrate(float kick, float drift, float size, bool wrap, Readback readback);
         void accelerate(float theta, float gravity, Mode mode, Readback readback);
 
         // Accelerate and integrate in a single submission, ordered by a pipeline barrier.
@@ -196,27 +247,123 @@ namespace nbody
         // trip between them; prefer it whenever both halves are wanted.
         void step(float dt, float theta, float gravity, Mode mode, float size, bool wrap, Readback readback);
 
+        // `steps` whole brute-force steps in a single submission, each ordered after the last
+        // by a barrier, with nothing read back until the end: euler ones, or kick-drift-kick
+        // if `leapfrog`, which needs the accelerations at the current positions already on
+        // the device. Brute force only, since barnes-hut's tree is built on the host from
+        // each step's positions.
+        void run(uint32_t steps, float dt, bool leapfrog, float gravity, float size, bool wrap, Readback readback);
+
+        // ---- barnes-hut tree built on the device -----------------------------------------
+
+        // Whether barnes-hut dispatches of either layout build their own tree, out of the
+        // bodies already on the device and in the same submission, rather than bind the one
+        // write_interleaved() or write_nodes() last staged. Stays as set. The root cell spans
+        // `size`, the world; `quadrupoles` follows State::quadrupole, and a node holding more
+        // than `leaf_capacity` bodies is split.
+        void build_tree_on_device(bool enabled, float size, bool quadrupoles, uint32_t leaf_capacity);
+
+        // ---- frames in flight --------------------------------------------------------------
+
+        // How many submissions of the split layout's integrate(), accelerate(), step() and
+        // run() may be on the device at once, 1 to max_frames_in_flight. At 1 each waits for
+        // its own before returning. Above that each returns once submitted, into a command
+        // buffer of its own, and the host waits only when it next touches staging -- see
+        // finish() -- or when every command buffer is still in use. The interleaved layout,
+        // the baseline, always waits.
+        void set_frames_in_flight(uint32_t frames);
+
+        // Block until the device has done everything submitted so far. Whatever reads or
+        // writes staging, or moves a buffer, calls this first, so a caller need not; it is
+        // here for one that wants the device idle for reasons of its own, a timer say.
+        void finish();
+
+        // ---- timing ------------------------------------------------------------------------
+
+        // Close a simulation step: what was submitted since the last call makes up the step
+        // last_step() describes, once the device has done it.
+        void end_step();
+
+        // The device's side of the last step end_step() closed, waiting for it if it is still
+        // queued. Only StepStats' device fields are filled in.
+        StepStats last_step();
+
     private:
 
         // RAII vk objects
         vk::raii::Context context;
         vk::raii::Instance instance;
+        vk::raii::DebugUtilsMessengerEXT messenger;   // null unless NBODY_VK_VALIDATE is set
         vk::raii::PhysicalDevice physical_device;
         vk::raii::Device device;
 
-        // The queue and the fence are the same objects every submission, so they are held
-        // rather than built per dispatch. Initialized after `device` and so able to use the
-        // queue_family_index that make_device() resolves.
+        // The queue and the timeline semaphore are the same objects every submission, so
+        // they are held rather than built per dispatch. Initialized after `device` and so
+        // able to use the queue_family_index that make_device() resolves. Each submission
+        // signals the timeline with the next value up, and waiting for a value waits for
+        // that submission and every one before it.
         vk::raii::Queue queue;
-        vk::raii::Fence fence;
+        vk::raii::Semaphore timeline;
 
+        // One command buffer for each frame that may be in flight, taken in turn, and the
+        // timeline value at which each was last done with.
         vk::raii::CommandPool command_pool;
-        vk::raii::CommandBuffer command_buffer;
+        vk::raii::CommandBuffers command_buffers;
+        std::array<uint64_t, max_frames_in_flight> frame_done = {};
+        uint32_t frame = 0;
+        uint32_t frames_in_flight = 1;
+
+        // The value the last submission signals, and the highest one a wait has seen.
+        uint64_t submitted = 0;
+        uint64_t completed = 0;
+
+        // What a timestamp closes: every segment of a command buffer ends with one, and the
+        // buffer opens with another, so that each span is the device's time between them.
+        enum class Segment : uint8_t { Upload, Tree, Accelerate, Integrate, Readback };
+
+        // Timestamps to a frame, the opening one included. A run() of 256 leapfrog steps
+        // takes 771; a longer one goes untimed past the end.
+        static constexpr uint32_t timestamps_per_frame = 1024;
+
+        // Frame f writes queries [f * timestamps_per_frame, (f + 1) * timestamps_per_frame).
+        vk::raii::QueryPool query_pool;
+
+        // The segments a frame's command buffer stamped, in order, and the submission they
+        // went out with, until collect_timestamps() has read them.
+        struct FrameTimestamps
+        {
+            std::vector<Segment> segments;
+            uint64_t value = 0;
+            bool pending = false;
+        };
+        std::array<FrameTimestamps, max_frames_in_flight> frame_timestamps;
+
+        // The submissions end_step() closed steps at, oldest first; the highest whose times
+        // have been read; the step they are being added to; and the last step closed.
+        std::deque<uint64_t> step_ends;
+        uint64_t collected = 0;
+        StepStats open_step;
+        StepStats closed_step;
+
         vk::raii::DescriptorPool descriptor_pool;
 
-        // Shared by both layouts: the tree is the same structure either way.
+        // The file this device's pipeline cache is kept in, named for the device, driver and
+        // shaders it is good for, or empty to keep none; the fingerprint of what the cache was
+        // primed with from it, zero for nothing, as make_pipeline_cache() finds, which runs
+        // after the initializer here; and the cache every pipeline is made through.
+        std::string pipeline_cache_path;
+        uint64_t pipeline_cache_loaded = 0;
+        vk::raii::PipelineCache pipeline_cache;
+
+        // Shared by both layouts: the tree is the same structure either way. The points are
+        // its leaves' bodies, bound right after the nodes, and the quadrupoles one per node
+        // after those, empty unless State::quadrupole is set.
         nbody::Buffer buffer_nodes;
         nbody::Buffer staging_nodes;
+        nbody::Buffer buffer_points;
+        nbody::Buffer staging_points;
+        nbody::Buffer buffer_quadrupoles;
+        nbody::Buffer staging_quadrupoles;
 
         // ---- interleaved layout ----------------------------------------------------------
         vk::raii::DescriptorSetLayout descriptor_set_layout_interleaved;
@@ -261,6 +408,59 @@ namespace nbody
         // Separate from the dirty ranges: re-binding can be needed with no new data.
         bool descriptors_stale_split = true;
 
+        // ---- tree build ------------------------------------------------------------------
+        //
+        // One descriptor set layout for both body layouts: the bodies at bindings 0-2, which
+        // the interleaved set fills with its one array three times over, then the tree and
+        // the build's own buffers. See shaders/include/tree_build.glsl.
+        vk::raii::DescriptorSetLayout descriptor_set_layout_tree;
+        vk::raii::DescriptorSet descriptor_set_tree_interleaved;
+        vk::raii::DescriptorSet descriptor_set_tree_split;
+        vk::raii::PipelineLayout pipeline_layout_tree;
+        vk::raii::ShaderModule shader_tree_keys;
+        vk::raii::ShaderModule shader_tree_keys_split;
+        vk::raii::ShaderModule shader_tree_histogram;
+        vk::raii::ShaderModule shader_tree_scan;
+        vk::raii::ShaderModule shader_tree_scatter;
+        vk::raii::ShaderModule shader_tree_gather;
+        vk::raii::ShaderModule shader_tree_subdivide;
+        vk::raii::ShaderModule shader_tree_level;
+        vk::raii::ShaderModule shader_tree_moments;
+        vk::raii::Pipeline pipeline_tree_keys;
+        vk::raii::Pipeline pipeline_tree_keys_split;
+        vk::raii::Pipeline pipeline_tree_histogram;
+        vk::raii::Pipeline pipeline_tree_scan;
+        vk::raii::Pipeline pipeline_tree_scatter;
+        vk::raii::Pipeline pipeline_tree_gather;
+        vk::raii::Pipeline pipeline_tree_subdivide;
+        vk::raii::Pipeline pipeline_tree_level;
+        vk::raii::Pipeline pipeline_tree_moments;
+
+        // The morton keys and the bodies they belong to, each with the copy a radix sort pass
+        // scatters into; a pass's digit counts; the bodies in their own order; and the
+        // build's bookkeeping, which doubles as its indirect dispatch arguments.
+        nbody::Buffer buffer_keys;
+        nbody::Buffer buffer_keys_alt;
+        nbody::Buffer buffer_order;
+        nbody::Buffer buffer_order_alt;
+        nbody::Buffer buffer_histogram;
+        nbody::Buffer buffer_sources;
+        nbody::Buffer buffer_tree_state;
+
+        // As build_tree_on_device() last set it, and the node capacity reserve_tree() sized.
+        struct DeviceTree
+        {
+            bool enabled = false;
+            float size = 0;
+            bool quadrupoles = false;
+            uint32_t leaf_capacity = 1;
+            int max_nodes = 0;
+        };
+        DeviceTree device_tree;
+
+        // Whether a buffer under either tree set has moved since the two were written.
+        bool descriptors_stale_tree = true;
+
         // cached vk data
         uint32_t queue_family_index;
 
@@ -269,6 +469,11 @@ namespace nbody
         // initializer: those run after the member init list and would clobber it.
         bool frame_boundary_enabled;
 
+        // Nanoseconds to a timestamp tick, and the bits of a timestamp that count: none, on a
+        // queue that cannot write them. Assigned by make_device(), like the two above.
+        float timestamp_period;
+        uint64_t timestamp_mask;
+
         // Labels each frame-end submit so a capture tool can tell the steps apart. Not
         // touched by make_device(), so a default initializer is safe here.
         uint64_t frame_id = 0;
@@ -278,10 +483,13 @@ namespace nbody
 
         // member initializer functions
         vk::raii::Instance make_instance();
+        vk::raii::DebugUtilsMessengerEXT make_messenger();
         vk::raii::PhysicalDevice make_physical_device();
         vk::raii::Device make_device();
         vk::raii::CommandPool make_command_pool();
-        vk::raii::CommandBuffer make_command_buffer();
+        vk::raii::Semaphore make_timeline();
+        vk::raii::CommandBuffers make_command_buffers();
+        vk::raii::QueryPool make_query_pool();
         vk::raii::DescriptorPool make_descriptor_pool();
         vk::raii::DescriptorSetLayout make_descriptor_set_layout(uint32_t num_bindings);
         vk::raii::DescriptorSet make_descriptor_set(vk::raii::DescriptorSetLayout& layout);
@@ -292,8 +500,16 @@ namespace nbody
         vk::raii::ShaderModule make_shader(const unsigned char (&spv)[size])
         { return std::move(make_shader(spv, size)); }
 
+        std::string make_pipeline_cache_path(const std::string& directory) const;
+        vk::raii::PipelineCache make_pipeline_cache();
         vk::raii::Pipeline make_pipeline(vk::raii::ShaderModule& shader, vk::raii::PipelineLayout& layout);
 
+        // Write the pipeline cache out for the next process, unless it is what was read in.
+        void save_pipeline_cache() const;
+
+        // Grow a device buffer, once no queued submission can still be using it.
+        bool reserve_bound(nbody::Buffer& buffer, size_t bytes);
+
         // Size the split device buffers to their staging counterparts and rebind if anything
         // moved. Before recording, so a dispatch that uploads nothing still binds storage.
         void prepare_split();
@@ -301,16 +517,63 @@ namespace nbody
         // Rebind the interleaved set if a buffer under it has moved.
         void prepare_interleaved();
 
+        // The current frame's command buffer.
+        vk::raii::CommandBuffer& command_buffer() { return command_buffers[frame]; }
+
+        // Move on to the next frame's command buffer, waiting until the device is done with
+        // it, and begin recording.
+        void begin_recording();
+
         // command buffer recording and submission
         void record_dispatch(vk::raii::Pipeline& pipeline, vk::raii::PipelineLayout& layout, vk::raii::DescriptorSet& set);
+        void record_dispatch(vk::raii::Pipeline& pipeline, vk::raii::PipelineLayout& layout, vk::raii::DescriptorSet& set, uint32_t group_count);
         void record_dispatch_barrier();
+
+        // Whether a dispatch in `mode` builds its tree first.
+        [[nodiscard]] bool builds_tree(const Mode mode) const { return device_tree.enabled && mode == Mode::NLogN; }
+
+        // Size the tree and the build's buffers for push_constants.num_bodies. Before the
+        // layout's own prepare, since the node buffer is one of its bindings too.
+        void reserve_tree();
+
+        // Rewrite both tree sets if anything under them moved. After the layout's prepare,
+        // which may move the bodies.
+        void prepare_tree();
+
+        // Record a tree build over the bodies `set` binds, keyed by `keys`, leaving the nodes,
+        // points and quadrupoles ready for the accelerate dispatch that follows.
+        void record_tree_build(vk::raii::Pipeline& keys, vk::raii::DescriptorSet& set);
+        void record_tree_dispatch_indirect(vk::raii::Pipeline& pipeline, vk::raii::DescriptorSet& set, int level);
+        void record_tree_barrier();
+
+        // Record the steps of a run() over one layout's pipelines. The accelerate constants
+        // must already be set.
+        void record_steps(
+            uint32_t steps, float dt, bool leapfrog, float size, bool wrap,
+            vk::raii::Pipeline& accelerate, vk::raii::Pipeline& integrate,
+            vk::raii::PipelineLayout& layout, vk::raii::DescriptorSet& set);
         void record_upload_interleaved();
         void record_readback_interleaved();
         void record_upload_split();
         void record_readback_split(Readback what);
+        void submit(bool frame_end, const vk::raii::Buffer& frame_buffer);
         void submit_and_wait(bool frame_end, const vk::raii::Buffer& frame_buffer);
+
+        // submit(), and submit_and_wait() unless more than one frame may be in flight.
+        void submit_frame(bool frame_end, const vk::raii::Buffer& frame_buffer);
+
+        // Block until the timeline reaches `value`.
+        void wait(uint64_t value);
+
+        // Close `segment` with a timestamp, if the device keeps them and the frame has room.
+        void record_timestamp(Segment segment);
+
+        // Read the timestamps of every frame the device has finished, oldest first, into
+        // open_step, closing steps where end_step() said they end.
+        void collect_timestamps();
+        void close_step();
         void set_accelerate_constants(float theta, float gravity, Mode mode);
-        void set_integrate_constants(float dt, float size, bool wrap);
+        void set_integrate_constants(float kick, float drift, float size, bool wrap);
 
         // Storage the shaders bind. Device-local and not host-visible, so it comes from the
         // full VRAM heap rather than the small mappable window, and shader reads never
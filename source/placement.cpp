@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "context.h"
+#include "detail/placement.h"
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+namespace
+{
+    // Every cpu the host has, as one node.
+    std::vector<std::vector<int>> one_node()
+    {
+        std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+        for (size_t i = 0; i < cpus.size(); ++i)
+            cpus[i] = int(i);
+        return { cpus };
+    }
+
+#if defined(__linux__)
+    // A sysfs cpu or node list, "0-3,8,10-11".
+    std::vector<int> parse_list(const std::string& list)
+    {
+        std::vector<int> values;
+        std::stringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ','))
+        {
+            if (range.empty() || range == "\n")
+                continue;
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int value = first; value <= last; ++value)
+                values.push_back(value);
+        }
+        return values;
+    }
+
+    std::string read_line(const std::string& path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+#endif
+}
+
+std::vector<std::vector<int>> nbody::detail::numa_cpus()
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return one_node();
+
+    // Nodes without cpus, memory-only ones, drop out with nothing allowed in them.
+    std::vector<std::vector<int>> nodes;
+    try
+    {
+        for (const int node : parse_list(read_line("/sys/devices/system/node/online")))
+        {
+            std::vector<int> cpus;
+            for (const int cpu : parse_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            if (!cpus.empty())
+                nodes.push_back(std::move(cpus));
+        }
+    }
+    catch (const std::exception&)
+    {
+        nodes.clear();   // a list sysfs wrote some other way than expected
+    }
+    return nodes.empty() ? one_node() : nodes;
+#elif defined(_WIN32)
+    // Cpus as group * 64 + bit, which pin_thread() takes apart again.
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest))
+        return one_node();
+
+    std::vector<std::vector<int>> nodes;
+    for (USHORT node = 0; node <= highest; ++node)
+    {
+        GROUP_AFFINITY affinity = {};
+        if (!GetNumaNodeProcessorMaskEx(node, &affinity))
+            continue;
+        std::vector<int> cpus;
+        for (int bit = 0; bit < 64; ++bit)
+            if (affinity.Mask & (KAFFINITY(1) << bit))
+                cpus.push_back(int(affinity.Group) * 64 + bit);
+        if (!cpus.empty())
+            nodes.push_back(std::move(cpus));
+    }
+    return nodes.empty() ? one_node() : nodes;
+#else
+    return one_node();
+#endif
+}
+
+std::vector<int> nbody::detail::placement_cpus(const Placement placement, const std::vector<std::vector<int>>& nodes)
+{
+    std::vector<int> cpus;
+    switch (placement)
+    {
+    case Placement::Unpinned:
+        break;
+
+    case Placement::Compact:
+        for (const std::vector<int>& node : nodes)
+            cpus.insert(cpus.end(), node.begin(), node.end());
+        break;
+
+    case Placement::Spread:
+        // A cpu from each node in turn, the smaller nodes dropping out as they run dry.
+        for (size_t k = 0;; ++k)
+        {
+            const size_t before = cpus.size();
+            for (const std::vector<int>& node : nodes)
+                if (k < node.size())
+                    cpus.push_back(node[k]);
+            if (cpus.size() == before)
+                break;
+        }
+        break;
+    }
+    return cpus;
+}
+
+bool nbody::detail::pin_thread(const int cpu)
+{
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = WORD(cpu / 64);
+    affinity.Mask = KAFFINITY(1) << (cpu % 64);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+bool nbody::detail::interleave(const void* const data, const size_t bytes)
+{
+#if defined(__linux__)
+    // The nodes with memory, as mbind's mask. Read once: they do not come and go.
+    static const std::vector<unsigned long> mask = []
+    {
+        constexpr size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask;
+        size_t count = 0;
+        try
+        {
+            for (const int node : parse_list(read_line("/sys/devices/system/node/has_memory")))
+            {
+                mask.resize(std::max(mask.size(), size_t(node) / bits + 1));
+                mask[size_t(node) / bits] |= 1ul << (size_t(node) % bits);
+                ++count;
+            }
+        }
+        catch (const std::exception&)
+        {
+            count = 0;
+        }
+        return count < 2 ? std::vector<unsigned long>{} : mask;
+    }();
+    if (mask.empty() || bytes == 0)
+        return false;
+
+    // Whole pages only: mbind takes a page-aligned start, and the partial pages at either
+    // end are shared with whatever the allocator put beside the array.
+    const uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    const uintptr_t begin = (uintptr_t(data) + page - 1) & ~(page - 1);
+    const uintptr_t end = (uintptr_t(data) + bytes) & ~(page - 1);
+    if (end <= begin)
+        return false;
+    return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE, mask.data(), 8 * sizeof(unsigned long) * mask.size() + 1, MPOL_MF_MOVE) == 0;
+#else
+    // Windows places pages when they are allocated, by VirtualAllocExNuma, and has nothing
+    // to move them after.
+    (void)data;
+    (void)bytes;
+    return false;
+#endif
+}
+
+nbody::Context::Context(const Placement placement)
+    : placement(placement)
+    , nodes(detail::numa_cpus())
+{
+    const std::vector<int> cpus = detail::placement_cpus(placement, nodes);
+    if (cpus.empty())
+    {
+        pool = std::make_shared<BS::thread_pool>();
+        return;
+    }
+
+    // Each worker pins itself as it starts, by the index the pool gave it.
+    pool = std::make_shared<BS::thread_pool>(cpus.size(), [cpus]
+    {
+        if (const std::optional<size_t> index = BS::this_thread::get_index(); index && *index < cpus.size())
+            detail::pin_thread(cpus[*index]);
+    });
+}
+
+void nbody::Context::place(const void* const data, const size_t bytes)
+{
+    // Below a megabyte the pages are too few to matter, and the syscall costs more than
+    // it could save.
+    if (placement != Placement::Spread || nodes.size() < 2 || bytes < (size_t(1) << 20))
+        return;
+
+    const std::pair<const void*, size_t> array = { data, bytes };
+    if (std::find(_placed.begin(), _placed.end(), array) != _placed.end())
+        return;
+
+    detail::interleave(data, bytes);
+    if (_placed.size() == 16)
+        _placed.erase(_placed.begin());
+    _placed.push_back(array);
+}
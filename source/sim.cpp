@@ -1,12 +1,18 @@
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
 #include <stdexcept>
 #include "nbody/sim.h"
 #include "nbody/profile.h"
 #include "context.h"
 #include "solver.h"
+#include "detail/tree.h"
 #include "solvers/cpu_barnes_hut.h"
 #include "solvers/cpu_brute_force.h"
+#include "solvers/cpu_fmm.h"
 #include "solvers/gpu_solver.h"
 #include "solvers/gpu_solver_split.h"
 
@@ -51,6 +57,8 @@ namespace
                 Variant::GpuBarnesHutSoA, "GPU Barnes-Hut (SoA)", "As above, over split body arrays", false, "not probed" };
             t[size_t(Variant::GpuBruteForceSoA)] = {
                 Variant::GpuBruteForceSoA, "GPU brute force (SoA)", "As above, over split body arrays", false, "not probed" };
+            t[size_t(Variant::CpuFmm)] = {
+                Variant::CpuFmm, "CPU FMM", "O(n) fast multipole method, multithreaded", true, {} };
             return t;
         }();
         return table;
@@ -67,6 +75,7 @@ namespace
             t[size_t(Variant::GpuBruteForce)] = &make_gpu<nbody::GpuSolver, nbody::Mode::N2>;
             t[size_t(Variant::GpuBarnesHutSoA)] = &make_gpu<nbody::GpuSolverSplit, nbody::Mode::NLogN>;
             t[size_t(Variant::GpuBruteForceSoA)] = &make_gpu<nbody::GpuSolverSplit, nbody::Mode::N2>;
+            t[size_t(Variant::CpuFmm)] = &make<nbody::CpuFmmSolver>;
             return t;
         }();
         return table;
@@ -109,6 +118,17 @@ namespace
         (void)probed;
     }
 
+    // See Sim::set_pipeline_cache_dir(). Process-wide, like the variant table.
+    std::string& pipeline_cache_directory()
+    {
+        static std::string directory = []
+        {
+            const char* const from_environment = std::getenv("NBODY_PIPELINE_CACHE_DIR");
+            return std::string(from_environment ? from_environment : "");
+        }();
+        return directory;
+    }
+
     // Record that a variant which advertised itself as available could not actually be
     // brought up.
     //
@@ -124,6 +144,17 @@ namespace
         infos()[size_t(v)].available = false;
         infos()[size_t(v)].unavailable_reason = reason;
     }
+
+    // Bring a permutation up to the body count: appended bodies take the next indices, and a
+    // count smaller than before starts it over from the identity.
+    void fit_permutation(std::vector<uint32_t>& permutation, const size_t count)
+    {
+        if (permutation.size() > count)
+            permutation.clear();
+        const size_t from = permutation.size();
+        permutation.resize(count);
+        std::iota(permutation.begin() + from, permutation.end(), uint32_t(from));
+    }
 }
 
 std::shared_ptr<nbody::GpuDevice> nbody::Context::require_gpu()
@@ -131,7 +162,7 @@ std::shared_ptr<nbody::GpuDevice> nbody::Context::require_gpu()
     // Cached so that switching between the GPU variants reuses one device rather than
     // recompiling shaders each time.
     if (!gpu)
-        gpu = std::make_shared<GpuDevice>();
+        gpu = std::make_shared<GpuDevice>(Sim::pipeline_cache_dir());
     return gpu;
 }
 
@@ -162,10 +193,20 @@ bool Sim::available(const Variant v)
     return info(v).available;
 }
 
+void Sim::set_pipeline_cache_dir(std::string directory)
+{
+    pipeline_cache_directory() = std::move(directory);
+}
+
+const std::string& Sim::pipeline_cache_dir()
+{
+    return pipeline_cache_directory();
+}
+
 Sim::Sim() : Sim(Variant::CpuBarnesHut) {}
 
-Sim::Sim(const Variant variant)
-    : _context(std::make_shared<Context>())
+Sim::Sim(const Variant variant, const Placement placement)
+    : _context(std::make_shared<Context>(placement))
     , _state(std::make_shared<State>())
 {
     if (set_variant(variant))
@@ -243,6 +284,8 @@ bool Sim::set_variant(const Variant v)
     _state = std::move(state);
     _variant = v;
     _synced_revision = _state->revision;   // adopt() is a full ingest by definition
+    _accelerated = false;                  // the new solver has summed nothing yet
+    _stats = {};                           // nor stepped
     _last_error.clear();
 
     // The adopt() contract: the solver must retain the State it was handed rather than
@@ -254,12 +297,16 @@ bool Sim::set_variant(const Variant v)
     return true;
 }
 
+nbody::Placement Sim::placement() const { return _context->placement; }
+
 void Sim::sync_solver() const
 {
     if (_synced_revision == _state->revision)
         return;
+    number_bodies();
     _solver->ingest();
     _synced_revision = _state->revision;
+    _accelerated = false;
 }
 
 std::shared_ptr<const nbody::State> Sim::state() const
@@ -289,16 +336,58 @@ std::vector<nbody::Body>& Sim::mutable_bodies()
 // these values afresh each step. Bumping here would make a theta tweak cost a full
 // re-upload of the bodies.
 float Sim::size() const { return _state->size; }
-void Sim::set_size(const float v) { _state->size = v; }
+void Sim::set_size(const float v) { _state->size = v; _accelerated = false; }
 
 float Sim::theta() const { return _state->theta; }
 void Sim::set_theta(const float v) { _state->theta = v; }
 
+bool Sim::quadrupole() const { return _state->quadrupole; }
+void Sim::set_quadrupole(const bool v) { _state->quadrupole = v; }
+
+bool Sim::gpu_tree() const { return _state->gpu_tree; }
+void Sim::set_gpu_tree(const bool v) { _state->gpu_tree = v; }
+
+int Sim::frames_in_flight() const { return _state->frames_in_flight; }
+void Sim::set_frames_in_flight(const int v) { _state->frames_in_flight = v; }
+
+int Sim::fmm_order() const { return _state->fmm_order; }
+void Sim::set_fmm_order(const int v) { _state->fmm_order = v; }
+
+size_t Sim::block_targets() const { return _state->block_targets; }
+void Sim::set_block_targets(const size_t v) { _state->block_targets = v; }
+
+size_t Sim::block_sources() const { return _state->block_sources; }
+void Sim::set_block_sources(const size_t v) { _state->block_sources = v; }
+
+bool Sim::symmetric() const { return _state->symmetric; }
+void Sim::set_symmetric(const bool v) { _state->symmetric = v; }
+
 float Sim::gravity() const { return _state->gravity; }
-void Sim::set_gravity(const float v) { _state->gravity = v; }
+void Sim::set_gravity(const float v) { _state->gravity = v; _accelerated = false; }
 
 bool Sim::wrap() const { return _state->wrap; }
-void Sim::set_wrap(const bool v) { _state->wrap = v; }
+void Sim::set_wrap(const bool v) { _state->wrap = v; _accelerated = false; }
+
+nbody::Integrator Sim::integrator() const { return _state->integrator; }
+void Sim::set_integrator(const Integrator v) { _state->integrator = v; }
+
+nbody::Precision Sim::precision() const { return _state->precision; }
+void Sim::set_precision(const Precision v) { _state->precision = v; }
+
+size_t Sim::reorder_every() const { return _state->reorder_every; }
+void Sim::set_reorder_every(const size_t v) { _state->reorder_every = v; }
+
+int Sim::timestep_levels() const { return _state->timestep_levels; }
+void Sim::set_timestep_levels(const int v) { _state->timestep_levels = v; }
+
+float Sim::timestep_accuracy() const { return _state->timestep_accuracy; }
+void Sim::set_timestep_accuracy(const float v) { _state->timestep_accuracy = v; }
+
+float Sim::timestep_eta() const { return _state->timestep_eta; }
+void Sim::set_timestep_eta(const float v) { _state->timestep_eta = v; }
+
+double Sim::time() const { return _state->time; }
+void Sim::set_time(const double v) { _state->time = v; }
 
 // update() forwards to the solver rather than calling Sim::accelerate() +
 // Sim::integrate(), so a normal frame does one revision comparison and, in the steady
@@ -308,8 +397,21 @@ void Sim::update(const float dt)
 {
     NBODY_PROFILE_ZONE();
     NBODY_PROFILE_PLOT("bodies", static_cast<int64_t>(_state->bodies.size()));
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     sync_solver();
+
+    // A leapfrog step opens with the accelerations at the current positions, which the
+    // last one left behind unless something has since moved the bodies or changed the
+    // forces. Euler needs none, and leaves the ones from before its drift. Hierarchical
+    // steps are leapfrog ones, and pick their levels from these too.
+    const bool leapfrog = _state->integrator != Integrator::Euler;
+    if (leapfrog && !_accelerated)
+        _solver->accelerate();
     _solver->update(dt);
+    _accelerated = leapfrog;
+    _state->time += dt;
+    count_steps(1);
+    end_step(1, start);
 }
 
 void Sim::accelerate()
@@ -317,13 +419,196 @@ void Sim::accelerate()
     NBODY_PROFILE_ZONE();
     sync_solver();
     _solver->accelerate();
+    _accelerated = true;
 }
 
 void Sim::integrate(const float dt)
 {
     NBODY_PROFILE_ZONE();
     sync_solver();
-    _solver->integrate(dt);
+    _solver->integrate(dt, dt);
+    _accelerated = false;
+    _state->time += dt;
+}
+
+float Sim::step(const float max_dt)
+{
+    NBODY_PROFILE_ZONE();
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    sync_solver();
+
+    // The bound is read off the accelerations at the current positions, which every
+    // integrator's step opens with: leapfrog's last step left them, and euler's did not.
+    if (!_accelerated)
+        _solver->accelerate();
+    _accelerated = true;
+
+    const float dt = std::min(max_dt, _state->timestep_eta * std::sqrt(_solver->step_limit_sq()));
+    if (!(dt > 0))
+        return 0;
+
+    if (_state->integrator == Integrator::Euler)
+    {
+        // update() less the accelerate() already done.
+        _solver->integrate(dt, dt);
+        _accelerated = false;
+    }
+    else
+    {
+        _solver->update(dt);
+    }
+    _state->time += dt;
+    count_steps(1);
+    end_step(1, start);
+    return dt;
+}
+
+void Sim::run(const size_t steps, const float dt, const size_t observe_every, const std::function<void(const Sim&)>& observer)
+{
+    NBODY_PROFILE_ZONE();
+    NBODY_PROFILE_PLOT("bodies", static_cast<int64_t>(_state->bodies.size()));
+
+    // As update(), but once a batch rather than once a step. The observer only reads, so
+    // nothing can change between batches that the solver would have to take in.
+    sync_solver();
+    const bool leapfrog = _state->integrator != Integrator::Euler;
+    const size_t batch = observe_every == 0 ? steps : observe_every;
+    for (size_t done = 0; done < steps;)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // Up to the next observation, or the next reorder if that comes first.
+        size_t count = std::min(batch - done % batch, steps - done);
+        if (const size_t every = _state->reorder_every; every != 0)
+            count = std::min(count, every > _since_reorder ? every - _since_reorder : size_t{1});
+        if (leapfrog && !_accelerated)
+            _solver->accelerate();
+        _solver->run(count, dt);
+        _accelerated = leapfrog;
+        _state->time += double(dt) * double(count);
+        count_steps(count);
+        end_step(count, start);
+        done += count;
+
+        if (observer && (done % batch == 0 || done == steps))
+            observer(*this);
+    }
+}
+
+nbody::StepStats Sim::stats() const
+{
+    StepStats stats = _solver->device_stats();
+    stats.steps = _stats.steps;
+    stats.host = _stats.host;
+    return stats;
+}
+
+void Sim::end_step(const size_t steps, const std::chrono::steady_clock::time_point start)
+{
+    _solver->end_step();
+    _stats.steps = steps;
+    _stats.host = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+size_t Sim::run_until(const double t, const float max_dt)
+{
+    NBODY_PROFILE_ZONE();
+    size_t steps = 0;
+    while (_state->time < t)
+    {
+        const double remaining = t - _state->time;
+        const bool last = remaining <= max_dt;
+        const float cap = last ? float(remaining) : max_dt;
+        const float dt = step(cap);
+        if (dt == 0)
+            break;
+        ++steps;
+
+        // The step is a float and the clock a double, so a last step of the whole remainder
+        // can still land a rounding short of `t`, and cost a step of next to nothing more.
+        if (last && dt == cap)
+            _state->time = t;
+    }
+    return steps;
+}
+
+void Sim::reorder()
+{
+    NBODY_PROFILE_ZONE();
+    sync_solver();
+    _since_reorder = 0;
+
+    const StateRef state = _solver->state();
+    const size_t count = state->bodies.size();
+    fit_permutation(state->permutation, count);
+
+    // The order a barnes-hut build lays its leaves out in, which is the morton curve's.
+    bh::Tree curve;
+    detail::build_tree(*_context->pool, curve, state->bodies, state->size);
+    const std::vector<uint32_t>& order = curve.slots();
+    assert(order.size() == count);
+
+    std::vector<uint32_t> permutation(count);
+    for (size_t i = 0; i < count; ++i)
+        permutation[i] = state->permutation[order[i]];
+    state->permutation = std::move(permutation);
+
+    // Not a change of the caller's: the revision stays, and the accelerations move with the
+    // bodies they belong to.
+    _solver->reorder(order);
+    _slots_stale = true;
+}
+
+std::span<const uint32_t> Sim::permutation() const
+{
+    sync_solver();
+    fit_permutation(_state->permutation, _state->bodies.size());
+    return _state->permutation;
+}
+
+std::optional<size_t> Sim::index_of(const uint32_t id) const
+{
+    sync_solver();
+    if (_slots_stale)
+        index_bodies();
+    if (id >= _slots.size() || _slots[id] == no_slot)
+        return std::nullopt;
+    return _slots[id];
+}
+
+void Sim::number_bodies() const
+{
+    std::vector<Body>& bodies = _state->bodies;
+    _slots.assign(_state->next_id, no_slot);
+    for (size_t i = 0; i < bodies.size(); ++i)
+    {
+        uint32_t& id = bodies[i].id;
+        if (id == 0 || id >= _state->next_id || _slots[id] != no_slot)
+        {
+            id = _state->next_id++;
+            _slots.push_back(no_slot);
+        }
+        _slots[id] = uint32_t(i);
+    }
+    _slots_stale = false;
+}
+
+void Sim::index_bodies() const
+{
+    const std::vector<Body>& bodies = _solver->state()->bodies;
+    _slots.assign(_state->next_id, no_slot);
+    for (size_t i = 0; i < bodies.size(); ++i)
+        _slots[bodies[i].id] = uint32_t(i);
+    _slots_stale = false;
+}
+
+void Sim::count_steps(const size_t steps)
+{
+    if (_state->reorder_every == 0)
+        return;
+    _since_reorder += steps;
+    if (_since_reorder >= _state->reorder_every)
+        reorder();
 }
 
 const nbody::bh::Tree* Sim::tree() const { return _solver->tree(); }
@@ -1,7 +1,15 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <span>
+#include <vector>
 #include "nbody/state.h"
+#include "nbody/stats.h"
 #include "nbody/bhtree.h"
+#include "detail/physics.h"
 
 namespace nbody
 {
@@ -55,8 +63,68 @@ namespace nbody
 
         // --- stepping ------------------------------------------------------------
         virtual void accelerate() = 0;
-        virtual void integrate(float dt) = 0;
-        virtual void update(const float dt) { accelerate(); integrate(dt); }
+
+        // Kick every body's velocity by its acceleration times `kick`, then drift its
+        // position by its velocity times `drift`. With both set to `dt` this is an euler step;
+        // a leapfrog step is two of these either side of an accelerate().
+        virtual void integrate(float kick, float drift) = 0;
+
+        // One step of State::integrator. For leapfrog the accelerations must already be
+        // those at the current positions; Sim sees to that. A solver without block timesteps
+        // steps Hierarchical as plain leapfrog.
+        virtual void update(const float dt)
+        {
+            if (_state->integrator != Integrator::Euler)
+            {
+                integrate(.5f * dt, dt);
+                accelerate();
+                integrate(.5f * dt, 0);
+                return;
+            }
+            accelerate();
+            integrate(dt, dt);
+        }
+
+        // `steps` steps of `dt` back to back, with nothing handed back to the caller between
+        // them: what Sim::run() calls between observations. The default is a loop of
+        // update(); a solver that can keep the steps to itself does better.
+        virtual void run(const size_t steps, const float dt)
+        {
+            for (size_t step = 0; step < steps; ++step)
+                update(dt);
+        }
+
+        // Move the bodies into `order`: the body at i afterwards is the one at order[i] before.
+        // For Sim::reorder(). The default permutes the canonical State and ingests it as it
+        // would a caller's change; a solver holding anything indexed by body must drop or
+        // permute it too.
+        virtual void reorder(const std::span<const uint32_t> order)
+        {
+            std::vector<Body>& bodies = state()->bodies;
+            std::vector<Body> moved(order.size());
+            for (size_t i = 0; i < order.size(); ++i)
+                moved[i] = bodies[order[i]];
+            bodies = std::move(moved);
+            ingest();
+        }
+
+        // The least detail::step_limit_sq() over the bodies, for the accelerations the last
+        // accelerate() left: what Sim::step() cuts its step to. The default reads the bodies
+        // back through state() to scan them; the CPU solvers fold it into the pass that
+        // writes the accelerations instead.
+        [[nodiscard]] virtual float step_limit_sq() const
+        {
+            float least = std::numeric_limits<float>::infinity();
+            for (const Body& body : state()->bodies)
+                least = std::min(least, detail::step_limit_sq(body));
+            return least;
+        }
+
+        // --- statistics ------------------------------------------------------------
+        // Sim calls end_step() after each step, and device_stats() for the last one it
+        // closed: see Sim::stats(). A solver with no device to time leaves both alone.
+        virtual void end_step() {}
+        [[nodiscard]] virtual StepStats device_stats() const { return {}; }
 
         // --- visualization ---------------------------------------------------------
         // The barnes-hut tree this solver built, or nullptr if it builds none.
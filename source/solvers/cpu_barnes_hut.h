@@ -1,4 +1,8 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
 #include "solvers/cpu_solver.h"
 #include "detail/tree.h"
 #include "nbody/profile.h"
@@ -6,7 +10,7 @@
 namespace nbody
 {
     // O(n log n) barnes-hut approximation: build the tree, then sum forces against
-    // nodes far enough away to be treated as a single mass.
+    // nodes far enough away to be treated as a single mass, walking the tree once per leaf.
     class CpuBarnesHutSolver final : public CpuSolver
     {
     public:
@@ -17,36 +21,259 @@ namespace nbody
         {
             _state = std::move(state);
             _tree.clear({ .size = _state->size });   // last variant's tree is meaningless here
+            _cost.clear();
+            _slot_of.clear();
         }
 
         void accelerate() override
         {
             NBODY_PROFILE_ZONE();
-            detail::build_tree(_tree, _state->bodies, _state->size);
+            prepare();
+            if (_state->quadrupole)
+                sum<true, false>(0, 0);
+            else
+                sum<false, false>(0, 0);
+        }
+
+        // One pass rather than two: each group's bodies are integrated as soon as their
+        // forces are summed, while the group is still in cache. Safe because the forces read
+        // only the tree, a snapshot of where the bodies were, and each body's own position,
+        // which only its own group moves; and because every body is in exactly one group.
+        //
+        // A leapfrog step's opening kick and drift need the forces of the step before, so
+        // they are a pass of their own, and only the closing kick is fused.
+        void update(const float dt) override
+        {
+            NBODY_PROFILE_ZONE();
+            if (_state->integrator == Integrator::Hierarchical)
+            {
+                CpuSolver::update(dt);
+                return;
+            }
+
+            float kick = dt;
+            float drift = dt;
+            if (_state->integrator == Integrator::Leapfrog)
+            {
+                integrate(.5f * dt, dt);
+                kick = .5f * dt;
+                drift = 0;
+            }
+
+            prepare();
+            if (_state->quadrupole)
+                sum<true, true>(kick, drift);
+            else
+                sum<false, true>(kick, drift);
+        }
+
+        // A refit finds each body by its index, so after a reorder the tree must be built
+        // afresh: by the next sum, accelerate_some()'s included, since _slot_of goes with it.
+        void reorder(const std::span<const uint32_t> order) override
+        {
+            CpuSolver::reorder(order);
+            _tree.clear({ .size = _state->size });
+            _slot_of.clear();
+            _cost.clear();   // a step of equal counts rather than move these along too
+        }
+
+        [[nodiscard]] const bh::Tree* tree() const override { return &_tree; }
+
+    protected:
+
+        // Against the tree as it stands, unless the share of the bodies asking is large
+        // enough to pay for a refit: a refit costs about a quarter of a full sum. Otherwise
+        // the sources are where the last refit saw them, at most a step ago, and the bodies
+        // at the finer levels, which move the most between, do little of the pulling. Each
+        // body passes over its own slot, the copy of itself left behind where it was, which
+        // with no radius to stop it would pull it back without bound.
+        void accelerate_some(const std::span<const uint32_t> active) override
+        {
+            NBODY_PROFILE_ZONE();
+            if (active.size() * 4 >= _state->bodies.size() || _slot_of.size() != _state->bodies.size())
+                prepare();
 
             const float theta = _state->theta;
             const float G = _state->gravity;
-            detail::parallel_blocks(*_context->pool, _state->bodies.size(),
-                [this, theta, G](const size_t begin, const size_t end)
+            const bool quadrupole = _state->quadrupole;
+            detail::parallel_blocks(*_context->pool, active.size(),
+                [this, active, theta, G, quadrupole](const size_t begin, const size_t end)
                 {
-                    // Not zoned per traversal: hundreds of node visits per body.
-                    NBODY_PROFILE_ZONE_NAMED("barnes-hut block");
-                    for (size_t i = begin; i < end; ++i)
+                    for (size_t k = begin; k < end; ++k)
                     {
-                        Body& body = _state->bodies[i];
-                        body.acc = { 0, 0, 0 };
-                        _tree.apply(body.pos, [this, &body, G](const bh::Node& node)
-                        {
-                            body.acc += detail::gravity(body.pos, body.radius, node.com, node.mass, G);
-                        }, theta);
+                        Body& body = _state->bodies[active[k]];
+                        const Vector pos = body.pos;
+                        const float radius = body.radius;
+                        const uint32_t own = _slot_of[active[k]];
+                        Vector acc = { 0, 0, 0 };
+                        if (quadrupole)
+                            _tree.apply(pos, [&acc, pos, radius, G](const bh::Node& node, const bh::Quadrupole& q)
+                            {
+                                acc += detail::gravity(pos, radius, node.com, node.mass, q, G);
+                            }, theta, own);
+                        else
+                            _tree.apply(pos, [&acc, pos, radius, G](const bh::Node& node)
+                            {
+                                acc += detail::gravity(pos, radius, node.com, node.mass, G);
+                            }, theta, own);
+                        body.acc = acc;
                     }
                 });
         }
 
-        [[nodiscard]] const bh::Tree* tree() const override { return &_tree; }
-
     private:
 
+        void prepare()
+        {
+            detail::refit_tree(*_context->pool, _tree, _state->bodies, _state->size, _state->quadrupole);
+            _context->place(_tree.nodes());
+            _context->place(_tree.points());
+
+            // The leaves are the groups: up to detail::leaf_capacity bodies, close together.
+            _groups.clear();
+            const std::vector<bh::Node>& nodes = _tree.nodes();
+            for (uint32_t i = 0; i < nodes.size(); ++i)
+                if (nodes[i].children == 0 && nodes[i].count > 0)
+                    _groups.push_back(i);
+
+            // Each body's slot, the other way round from slots(), for accelerate_some().
+            const std::vector<uint32_t>& slots = _tree.slots();
+            _slot_of.assign(_state->bodies.size(), bh::Tree::no_slot);
+            for (const uint32_t g : _groups)
+                for (uint32_t s = nodes[g].first; s < nodes[g].first + nodes[g].count; ++s)
+                    _slot_of[slots[s]] = s;
+
+            // A group near the middle of a disk sums many times the nodes one on the rim does,
+            // so equal counts of groups leave threads idle. Split them by what their bodies
+            // cost last step instead, each body counting one until it has been summed once.
+            const size_t count = _state->bodies.size();
+            if (_cost.size() != count)
+                _cost.assign(count, 1);
+            _offsets.resize(_groups.size() + 1);
+            _offsets[0] = 0;
+            for (size_t g = 0; g < _groups.size(); ++g)
+            {
+                const bh::Node& group = nodes[_groups[g]];
+                uint64_t cost = 0;
+                for (uint32_t i = group.first; i < group.first + group.count; ++i)
+                    cost += _cost[slots[i]];
+                _offsets[g + 1] = _offsets[g] + cost;
+            }
+            _cuts = detail::balanced_cuts(_offsets, _context->pool->get_thread_count() * blocks_per_thread);
+        }
+
+        // A node accepted whole, with the moment to add to its monopole.
+        struct Far
+        {
+            Vector com;
+            float mass;
+            bh::Quadrupole quadrupole;
+        };
+
+        // One traversal per group into an interaction list, then a tight loop over the list
+        // for each of its bodies. The list is shared by the group, so a body near the edge of
+        // its leaf opens a few nodes it would have accepted walking alone: never less accurate
+        // than a walk per body, for a fraction of the traversals.
+        //
+        // With quadrupoles on, the nodes accepted whole go to their own list; single bodies
+        // have no moment and stay on the monopole one. With Integrate, each body is then
+        // kicked and drifted, as CpuSolver::integrate() would.
+        template <bool Quadrupole, bool Integrate>
+        void sum(const float kick, const float drift)
+        {
+            const float theta = _state->theta;
+            const float G = _state->gravity;
+            const float size = _state->size;
+            const bool wrap = _state->wrap;
+            detail::Precise* const wide = Integrate ? precise() : nullptr;
+            _step_limit_sq = detail::parallel_reduce_cuts(*_context->pool, _cuts, std::numeric_limits<float>::infinity(),
+                [this, theta, G, kick, drift, size, wrap, wide](const size_t begin, const size_t end)
+                {
+                    // Not zoned per traversal: thousands of groups per block.
+                    NBODY_PROFILE_ZONE_NAMED("barnes-hut block");
+                    const std::vector<bh::Node>& nodes = _tree.nodes();
+                    const std::vector<uint32_t>& slots = _tree.slots();
+                    const bh::Point* const points = _tree.points().data();
+                    std::vector<bh::Point> near;
+                    std::vector<Far> far;
+                    float limit = std::numeric_limits<float>::infinity();
+                    for (size_t g = begin; g < end; ++g)
+                    {
+                        const bh::Node& group = nodes[_groups[g]];
+                        const uint32_t first = group.first;
+                        const uint32_t last = group.first + group.count;
+
+                        Vector min = points[first].pos;
+                        Vector max = points[first].pos;
+                        for (uint32_t i = first + 1; i < last; ++i)
+                            for (size_t axis = 0; axis < 3; ++axis)
+                            {
+                                min[axis] = std::min(min[axis], points[i].pos[axis]);
+                                max[axis] = std::max(max[axis], points[i].pos[axis]);
+                            }
+
+                        near.clear();
+                        far.clear();
+                        if constexpr (Quadrupole)
+                            _tree.apply_group(min, max, [&near, &far](const bh::Node& node, const bh::Quadrupole& q)
+                            {
+                                if (node.children == 0 && node.count <= 1)
+                                    near.push_back({ node.com, node.mass });
+                                else
+                                    far.push_back({ node.com, node.mass, q });
+                            }, theta);
+                        else
+                            _tree.apply_group(min, max, [&near](const bh::Node& node)
+                            {
+                                near.push_back({ node.com, node.mass });
+                            }, theta);
+
+                        // What each of the group's bodies costs, for the next step's cuts.
+                        const uint32_t cost = uint32_t(near.size() + far.size()) + 1;
+                        for (uint32_t i = first; i < last; ++i)
+                        {
+                            _cost[slots[i]] = cost;
+                            Body& body = _state->bodies[slots[i]];
+                            const Vector pos = body.pos;
+                            const float radius = body.radius;
+                            Vector acc = { 0, 0, 0 };
+                            for (const bh::Point& p : near)
+                                acc += detail::gravity(pos, radius, p.pos, p.mass, G);
+                            if constexpr (Quadrupole)
+                                for (const Far& f : far)
+                                    acc += detail::gravity(pos, radius, f.com, f.mass, f.quadrupole, G);
+                            body.acc = acc;
+                            limit = std::min(limit, detail::step_limit_sq(body));
+                            if constexpr (Integrate)
+                            {
+                                if (wide)
+                                    detail::integrate(body, wide[slots[i]], kick, drift, size, wrap);
+                                else
+                                    detail::integrate(body, kick, drift, size, wrap);
+                            }
+                        }
+                    }
+                    return limit;
+                }, least);
+        }
+
         bh::Tree _tree;
+
+        // the leaves holding bodies, rebuilt each step
+        std::vector<uint32_t> _groups;
+
+        // Each body's slot in _tree as of the last refit, or empty when _tree is not of these
+        // bodies.
+        std::vector<uint32_t> _slot_of;
+
+        // Ranges of groups per thread: enough that a range costing more than the interactions
+        // last step promised is made up by the others taking what is left in the queue.
+        static constexpr size_t blocks_per_thread = 8;
+
+        // For each body, the interactions its group summed last step. Then the running total
+        // of the groups' costs, and where that cuts them into ranges of equal cost.
+        std::vector<uint32_t> _cost;
+        std::vector<uint64_t> _offsets;
+        std::vector<size_t> _cuts;
     };
 }
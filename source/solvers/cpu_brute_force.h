@@ -1,11 +1,14 @@
 #pragma once
+#include <limits>
 #include "solvers/cpu_solver.h"
+#include "detail/brute_force.h"
 #include "nbody/profile.h"
 
 namespace nbody
 {
     // Exact O(n^2) summation. Slow by design: this is the reference the approximate
-    // variants are checked against, and it builds no tree.
+    // variants are checked against, and it builds no tree. The sum itself is the vector
+    // kernel in detail/brute_force.h, picked for this CPU at run time.
     class CpuBruteForceSolver final : public CpuSolver
     {
     public:
@@ -17,29 +20,55 @@ namespace nbody
         void accelerate() override
         {
             NBODY_PROFILE_ZONE();
+            _sources.pack(*_context->pool, _state->bodies);
+
             const float G = _state->gravity;
-            const std::vector<Body>& bodies = _state->bodies;
-            detail::parallel_blocks(*_context->pool, bodies.size(),
-                [this, G, &bodies](const size_t begin, const size_t end)
+            const detail::Simd simd = detail::simd_supported();
+            const detail::Blocking blocking = { .targets = _state->block_targets, .sources = _state->block_sources };
+            if (_state->symmetric)
+            {
+                // The accelerations are written by the reduction inside, so the step limit
+                // takes a pass of its own: one read of each body, next to half of n^2 pairs.
+                detail::brute_force_symmetric(
+                    *_context->pool, simd, blocking, _sources, _pairs, _state->bodies.data(), _state->bodies.size(), G);
+                _step_limit_sq = detail::parallel_reduce(*_context->pool, _state->bodies.size(), std::numeric_limits<float>::infinity(),
+                    [this](const size_t begin, const size_t end) { return least_step_limit_sq(begin, end); }, least);
+                return;
+            }
+
+            _step_limit_sq = detail::parallel_reduce(*_context->pool, _state->bodies.size(), std::numeric_limits<float>::infinity(),
+                [this, G, simd, blocking](const size_t begin, const size_t end)
                 {
                     NBODY_PROFILE_ZONE_NAMED("brute force block");
-                    for (size_t i = begin; i < end; ++i)
-                    {
-                        Body& body = _state->bodies[i];
-                        const Vector pos = body.pos;
-                        const float radius = body.radius;
-                        Vector acc = { 0, 0, 0 };
-                        for (size_t j = 0; j < bodies.size(); ++j)
-                        {
-                            // Skip self-interaction. detail::gravity returns zero at zero
-                            // distance anyway, so this just saves the call.
-                            if (j == i)
-                                continue;
-                            acc += detail::gravity(pos, radius, bodies[j].pos, bodies[j].mass, G);
-                        }
-                        body.acc = acc;
-                    }
+                    detail::brute_force(simd, blocking, _sources, _state->bodies.data(), begin, end, G);
+                    return least_step_limit_sq(begin, end);
+                }, least);
+        }
+
+    protected:
+
+        void accelerate_some(const std::span<const uint32_t> active) override
+        {
+            NBODY_PROFILE_ZONE();
+            _sources.pack(*_context->pool, _state->bodies);
+
+            const float G = _state->gravity;
+            const detail::Simd simd = detail::simd_supported();
+            const detail::Blocking blocking = { .targets = 1, .sources = _state->block_sources };
+            detail::parallel_blocks(*_context->pool, active.size(),
+                [this, active, G, simd, blocking](const size_t begin, const size_t end)
+                {
+                    for (size_t k = begin; k < end; ++k)
+                        detail::brute_force(simd, blocking, _sources, _state->bodies.data(), active[k], active[k] + 1, G);
                 });
         }
+
+    private:
+
+        // every body's position and mass, repacked each step for the vector kernels
+        detail::SourceTiles _sources;
+
+        // per-worker partial sums for State::symmetric
+        detail::PairSums _pairs;
     };
 }
@@ -0,0 +1,305 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <vector>
+#include "solvers/cpu_solver.h"
+#include "detail/fmm.h"
+#include "detail/tree.h"
+#include "nbody/profile.h"
+
+namespace nbody
+{
+    // O(n) fast multipole method over the barnes-hut octree. Where barnes-hut sums each body
+    // against the cells it accepts, this accepts whole pairs of cells: a dual walk of the tree
+    // against itself translates each well separated source cell's multipole into a local
+    // expansion about the target cell, once for all of the target's bodies, and sums only
+    // neighbouring leaves directly. The local expansions are then pushed down the tree to
+    // the bodies. Accuracy is set by the expansion order, State::fmm_order.
+    class CpuFmmSolver final : public CpuSolver
+    {
+    public:
+
+        using CpuSolver::CpuSolver;
+
+        void adopt(StateRef state) override
+        {
+            _state = std::move(state);
+            _tree.clear({ .size = _state->size });   // last variant's tree is meaningless here
+        }
+
+        void accelerate() override
+        {
+            NBODY_PROFILE_ZONE();
+            detail::refit_tree(*_context->pool, _tree, _state->bodies, _state->size, false);
+            _context->place(_tree.nodes());
+            _context->place(_tree.points());
+
+            const int order = std::clamp(_state->fmm_order, 1, detail::fmm::max_order);
+            if (!_expansion || _expansion->order() != order)
+                _expansion.emplace(order);
+
+            const size_t coefficients = _tree.nodes().size() * _expansion->size();
+            _multipoles.resize(coefficients);
+            _locals.resize(coefficients);
+            _radii.resize(_tree.nodes().size());
+
+            partition();
+            upward();
+            downward();
+        }
+
+        // As for barnes-hut: the tree would refit the wrong bodies into its leaves.
+        void reorder(const std::span<const uint32_t> order) override
+        {
+            CpuSolver::reorder(order);
+            _tree.clear({ .size = _state->size });
+        }
+
+        [[nodiscard]] const bh::Tree* tree() const override { return &_tree; }
+
+    private:
+
+        // Two cells are far enough apart for a translation when their reaches sum to less
+        // than this fraction of the distance between them. The expansions converge at any
+        // value under one, as a power of it in the order. Fixed rather than taken from
+        // State::theta, which barnes-hut reads the other way up and against the cell size.
+        static constexpr float opening = .5f;
+
+        // Split the top of the tree into subtrees for the workers, a few per thread so an
+        // uneven one does not hold up the rest. Each subtree is a target for the dual walk
+        // whole, so the workers never write to the same node or body.
+        void partition()
+        {
+            const std::vector<bh::Node>& nodes = _tree.nodes();
+            const size_t want = 8 * size_t(_context->pool->get_thread_count());
+
+            _top.clear();
+            _subtrees.assign(1, 0);
+            std::vector<uint32_t> next;
+            while (_subtrees.size() < want)
+            {
+                next.clear();
+                for (const uint32_t index : _subtrees)
+                {
+                    if (nodes[index].children == 0)
+                    {
+                        next.push_back(index);
+                        continue;
+                    }
+                    _top.push_back(index);
+                    for (uint32_t q = 0; q < 8; ++q)
+                        next.push_back(nodes[index].children + q);
+                }
+                if (next.size() == _subtrees.size())
+                    break;   // all leaves
+                _subtrees.swap(next);
+            }
+        }
+
+        // Multipoles bottom up: from the bodies at the leaves, then shifted into each parent.
+        void upward()
+        {
+            NBODY_PROFILE_ZONE();
+            detail::parallel_for(*_context->pool, _subtrees.size(), [this](const size_t i)
+            {
+                upward(_subtrees[i]);
+            });
+
+            // _top is in breadth first order, so backwards has every child done first.
+            for (auto it = _top.rbegin(); it != _top.rend(); ++it)
+                gather(*it);
+        }
+
+        void upward(const uint32_t index)
+        {
+            const bh::Node& node = _tree.nodes()[index];
+            if (node.children != 0)
+            {
+                for (uint32_t q = 0; q < 8; ++q)
+                    upward(node.children + q);
+                gather(index);
+                return;
+            }
+
+            const bh::Point* const points = _tree.points().data() + node.first;
+            float reach_sq = 0;
+            for (uint32_t p = 0; p < node.count; ++p)
+                reach_sq = std::max(reach_sq, (points[p].pos - node.com).size_sq());
+            _radii[index] = std::sqrt(reach_sq);
+            _expansion->p2m(multipole(index), node.com, points, node.count);
+        }
+
+        // An internal node's multipole and reach from its children's.
+        void gather(const uint32_t index)
+        {
+            const std::vector<bh::Node>& nodes = _tree.nodes();
+            const bh::Node& node = nodes[index];
+
+            // No further than the corner of its cell farthest from its center of mass, and no
+            // further than its farthest child reaches.
+            const float corner = std::sqrt((node.com - node.bounds.center).size_sq()) + node.bounds.size * .8660254f;
+            float reach = 0;
+
+            float* const m = multipole(index);
+            std::fill(m, m + _expansion->size(), 0.f);
+            for (uint32_t q = 0; q < 8; ++q)
+            {
+                const uint32_t child = node.children + q;
+                if (nodes[child].mass == 0)
+                    continue;
+                const Vector shift = nodes[child].com - node.com;
+                reach = std::max(reach, std::sqrt(shift.size_sq()) + _radii[child]);
+                _expansion->m2m(m, multipole(child), shift);
+            }
+            _radii[index] = std::min(reach, corner);
+        }
+
+        // The dual walk of each subtree against the whole tree, then the local expansions
+        // down to its bodies.
+        void downward()
+        {
+            NBODY_PROFILE_ZONE();
+            _step_limit_sq = detail::parallel_reduce(*_context->pool, _subtrees.size(), std::numeric_limits<float>::infinity(),
+                [this](const size_t begin, const size_t end)
+                {
+                    float limit = std::numeric_limits<float>::infinity();
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        NBODY_PROFILE_ZONE_NAMED("fmm subtree");
+                        clear(_subtrees[i]);
+                        interact(_subtrees[i], 0);
+                        limit = std::min(limit, descend(_subtrees[i]));
+                    }
+                    return limit;
+                }, least);
+        }
+
+        void clear(const uint32_t index)
+        {
+            const bh::Node& node = _tree.nodes()[index];
+            std::fill(local(index), local(index) + _expansion->size(), 0.f);
+            if (node.children != 0)
+            {
+                for (uint32_t q = 0; q < 8; ++q)
+                    clear(node.children + q);
+                return;
+            }
+
+            const std::vector<uint32_t>& slots = _tree.slots();
+            for (uint32_t s = node.first; s < node.first + node.count; ++s)
+                _state->bodies[slots[s]].acc = { 0, 0, 0 };
+        }
+
+        // Everything source cell `b` exerts on the bodies of target cell `a`: one multipole to
+        // local translation if the two are far enough apart, direct sums if both are leaves,
+        // and otherwise the same for the children of whichever is larger.
+        void interact(const uint32_t a, const uint32_t b)
+        {
+            const std::vector<bh::Node>& nodes = _tree.nodes();
+            const bh::Node& target = nodes[a];
+            const bh::Node& source = nodes[b];
+            if (target.mass == 0 || source.mass == 0)
+                return;
+
+            // A pair of small leaves is cheaper summed directly than translated, however far
+            // apart: a translation costs about as much as an interaction per coefficient.
+            const bool target_leaf = target.children == 0;
+            const bool source_leaf = source.children == 0;
+            if (target_leaf && source_leaf && target.count * source.count <= 2 * _expansion->size())
+            {
+                direct(target, source);
+                return;
+            }
+
+            const Vector R = target.com - source.com;
+            const float reach = _radii[a] + _radii[b];
+            if (reach * reach < opening * opening * R.size_sq())
+            {
+                _expansion->m2l(local(a), multipole(b), R);
+                return;
+            }
+
+            if (target_leaf && source_leaf)
+            {
+                direct(target, source);
+                return;
+            }
+
+            if (!target_leaf && (source_leaf || _radii[a] >= _radii[b]))
+                for (uint32_t q = 0; q < 8; ++q)
+                    interact(target.children + q, b);
+            else
+                for (uint32_t q = 0; q < 8; ++q)
+                    interact(a, source.children + q);
+        }
+
+        // Leaf to leaf, body by body. A leaf against itself included: gravity() is zero at
+        // zero distance, so each body skips itself.
+        void direct(const bh::Node& target, const bh::Node& source)
+        {
+            const std::vector<uint32_t>& slots = _tree.slots();
+            const bh::Point* const points = _tree.points().data();
+            const float G = _state->gravity;
+            for (uint32_t s = target.first; s < target.first + target.count; ++s)
+            {
+                Body& body = _state->bodies[slots[s]];
+                Vector acc = { 0, 0, 0 };
+                for (uint32_t p = source.first; p < source.first + source.count; ++p)
+                    acc += detail::gravity(body.pos, body.radius, points[p].pos, points[p].mass, G);
+                body.acc += acc;
+            }
+        }
+
+        // Shift each node's local expansion into its children's, and at the leaves evaluate it
+        // at the bodies. Returns the least step limit among them, now their sums are complete.
+        float descend(const uint32_t index)
+        {
+            const std::vector<bh::Node>& nodes = _tree.nodes();
+            const bh::Node& node = nodes[index];
+            float limit = std::numeric_limits<float>::infinity();
+            if (node.mass == 0)
+                return limit;
+
+            if (node.children != 0)
+            {
+                for (uint32_t q = 0; q < 8; ++q)
+                {
+                    const uint32_t child = node.children + q;
+                    if (nodes[child].mass == 0)
+                        continue;
+                    _expansion->l2l(local(child), local(index), nodes[child].com - node.com);
+                    limit = std::min(limit, descend(child));
+                }
+                return limit;
+            }
+
+            const std::vector<uint32_t>& slots = _tree.slots();
+            const float G = _state->gravity;
+            for (uint32_t s = node.first; s < node.first + node.count; ++s)
+            {
+                Body& body = _state->bodies[slots[s]];
+                body.acc += G * _expansion->l2p(local(index), body.pos - node.com);
+                limit = std::min(limit, detail::step_limit_sq(body));
+            }
+            return limit;
+        }
+
+        float* multipole(const uint32_t index) { return _multipoles.data() + index * _expansion->size(); }
+        float* local(const uint32_t index) { return _locals.data() + index * _expansion->size(); }
+
+        bh::Tree _tree;
+        std::optional<detail::fmm::Expansion> _expansion;
+
+        // Per node: its multipole and local expansion, _expansion->size() coefficients each,
+        // and its reach, the farthest any of its bodies is from its center of mass.
+        std::vector<float> _multipoles;
+        std::vector<float> _locals;
+        std::vector<float> _radii;
+
+        // The nodes above the workers' subtrees, breadth first, and the subtrees' roots.
+        std::vector<uint32_t> _top;
+        std::vector<uint32_t> _subtrees;
+    };
+}
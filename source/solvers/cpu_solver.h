@@ -1,4 +1,11 @@
 #pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
 #include "context.h"
 #include "solver.h"
 #include "detail/parallel.h"
@@ -9,7 +16,8 @@ namespace nbody
 {
     // Shared base for the CPU solvers. Both work on State::bodies in place, so the
     // standard-format conversion is free in both directions: state() is a plain getter
-    // and ingest() has nothing to do.
+    // and ingest() has nothing to do beyond dropping the double-precision copies of the
+    // bodies that State::precision may have had it keep.
     //
     // The integrator lives here rather than in each solver so that the barnes-hut and
     // brute-force variants cannot drift apart on anything but the force summation.
@@ -26,19 +34,238 @@ namespace nbody
 
         [[nodiscard]] StateRef state() const override { return _state; }
 
-        void integrate(const float dt) override
+        // The caller's floats are now the bodies, and the doubles are reseeded from them.
+        // The caller may also have grown them into a new allocation, with pages of its own.
+        void ingest() const override
+        {
+            _precise.clear();
+            _context->place(_state->bodies);
+        }
+
+        void integrate(const float kick, const float drift) override
         {
             NBODY_PROFILE_ZONE();
             const float size = _state->size;
             const bool wrap = _state->wrap;
+            detail::Precise* const wide = precise();
             detail::parallel_blocks(*_context->pool, _state->bodies.size(),
-                [this, dt, size, wrap](const size_t begin, const size_t end)
+                [this, kick, drift, size, wrap, wide](const size_t begin, const size_t end)
                 {
                     // Inside the block, so each worker's share shows on its own thread.
                     NBODY_PROFILE_ZONE_NAMED("integrate block");
+                    if (wide)
+                        for (size_t i = begin; i < end; ++i)
+                            detail::integrate(_state->bodies[i], wide[i], kick, drift, size, wrap);
+                    else
+                        for (size_t i = begin; i < end; ++i)
+                            detail::integrate(_state->bodies[i], kick, drift, size, wrap);
+                });
+        }
+
+        [[nodiscard]] float step_limit_sq() const override { return _step_limit_sq; }
+
+        // In place, and the doubles with the bodies rather than dropped with them: a reorder
+        // is no change of the caller's, and must not cost the precision they were kept for.
+        void reorder(const std::span<const uint32_t> order) override
+        {
+            NBODY_PROFILE_ZONE();
+            std::vector<Body>& bodies = _state->bodies;
+            std::vector<Body> moved(order.size());
+            std::vector<detail::Precise> moved_precise(_precise.size() == bodies.size() ? order.size() : 0);
+            detail::parallel_blocks(*_context->pool, order.size(), [&](const size_t begin, const size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                    moved[i] = bodies[order[i]];
+                if (!moved_precise.empty())
+                    for (size_t i = begin; i < end; ++i)
+                        moved_precise[i] = _precise[order[i]];
+            });
+            bodies = std::move(moved);
+            _precise = std::move(moved_precise);
+            _context->place(bodies);
+        }
+
+        void update(const float dt) override
+        {
+            if (_state->integrator == Integrator::Hierarchical)
+                update_hierarchical(dt);
+            else
+                Solver::update(dt);
+        }
+
+    protected:
+
+        // Set by each solver's accelerate(), in the pass that writes the accelerations: the
+        // bodies are in cache there, and a pass of its own would bring them all back in.
+        float _step_limit_sq = std::numeric_limits<float>::infinity();
+
+        // The double-precision positions and velocities of the bodies, one to a body, or
+        // nullptr when State::precision does not ask for them. Seeded from the bodies on
+        // first use, and again after a caller has changed them.
+        detail::Precise* precise()
+        {
+            if (_state->precision != Precision::Double)
+            {
+                if (!_precise.empty())
+                    _precise = {};
+                return nullptr;
+            }
+
+            const size_t count = _state->bodies.size();
+            if (_precise.size() != count)
+            {
+                _precise.resize(count);
+                detail::parallel_blocks(*_context->pool, count, [this](const size_t begin, const size_t end)
+                {
                     for (size_t i = begin; i < end; ++i)
-                        detail::integrate_euler(_state->bodies[i], dt, size, wrap);
+                        _precise[i] = detail::Precise::of(_state->bodies[i]);
                 });
+            }
+            return _precise.data();
+        }
+
+        // The least step limit of bodies [begin, end), and the fold of two such, for the
+        // blocks of an accelerate() pass to reduce into _step_limit_sq.
+        float least_step_limit_sq(const size_t begin, const size_t end) const
+        {
+            float limit = std::numeric_limits<float>::infinity();
+            for (size_t i = begin; i < end; ++i)
+                limit = std::min(limit, detail::step_limit_sq(_state->bodies[i]));
+            return limit;
+        }
+        static float least(const float a, const float b) { return std::min(a, b); }
+
+        // The accelerations of the bodies listed, at least, from every body where it now is.
+        // For the sub-steps of a hierarchical step, which need only those finishing their own
+        // step. The default sums them all. Need not set _step_limit_sq: a step's last sub-step
+        // always sums every body through accelerate().
+        virtual void accelerate_some(std::span<const uint32_t> active)
+        {
+            (void)active;
+            accelerate();
+        }
+
+        // Kick-drift-kick with block timesteps. The step of `dt` is cut into 2^deepest
+        // sub-steps, for the deepest level any body needs. A body of level L opens its own
+        // step every 2^(deepest - L) of them with half a kick and closes it with its forces
+        // and the other half; every body drifts every sub-step, which is cheap next to a
+        // force sum. At each sub-step the levels opening or closing are those at or past
+        // some level, so with the bodies ordered deepest first each set is a prefix.
+        void update_hierarchical(const float dt)
+        {
+            NBODY_PROFILE_ZONE();
+            std::vector<Body>& bodies = _state->bodies;
+            const size_t count = bodies.size();
+            const int deepest_allowed = std::clamp(_state->timestep_levels, 0, max_levels);
+            const float accuracy = _state->timestep_accuracy;
+            detail::Precise* const wide = precise();
+
+            _levels.resize(count);
+            detail::parallel_blocks(*_context->pool, count, [&](const size_t begin, const size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                    _levels[i] = uint8_t(detail::timestep_level(bodies[i], dt, accuracy, deepest_allowed));
+            });
+
+            // Counting sort, deepest first: _at_least[L] bodies lead _order with level >= L.
+            std::fill(std::begin(_at_least), std::end(_at_least), uint32_t(0));
+            int deepest = 0;
+            for (const uint8_t level : _levels)
+            {
+                ++_at_least[level];
+                deepest = std::max(deepest, int(level));
+            }
+            for (int level = max_levels; level >= 0; --level)
+                _at_least[level] += _at_least[level + 1];
+            _order.resize(count);
+            uint32_t next[max_levels + 1];
+            for (int level = 0; level <= max_levels; ++level)
+                next[level] = _at_least[level + 1];
+            for (uint32_t i = 0; i < count; ++i)
+                _order[next[_levels[i]]++] = i;
+
+            const uint32_t substeps = uint32_t(1) << deepest;
+            const float h = dt / float(substeps);
+            for (uint32_t s = 0; s < substeps; ++s)
+            {
+                kick(_at_least[s == 0 ? 0 : deepest - std::countr_zero(s)], dt, wide);
+
+                const bool last = s + 1 == substeps;
+                drift(h, last && _state->wrap, wide);
+
+                const uint32_t closing = _at_least[last ? 0 : deepest - std::countr_zero(s + 1)];
+                if (closing == count)
+                    accelerate();
+                else
+                    accelerate_some(std::span<const uint32_t>(_order.data(), closing));
+                kick(closing, dt, wide);
+            }
+        }
+
+    private:
+
+        static constexpr int max_levels = 16;
+
+        // Half a kick, for the first `active` bodies of _order, each of its own step.
+        void kick(const uint32_t active, const float dt, detail::Precise* const wide)
+        {
+            detail::parallel_blocks(*_context->pool, active, [this, dt, wide](const size_t begin, const size_t end)
+            {
+                for (size_t k = begin; k < end; ++k)
+                {
+                    const uint32_t i = _order[k];
+                    Body& body = _state->bodies[i];
+                    const float step = std::ldexp(.5f * dt, -int(_levels[i]));
+                    if (!wide)
+                    {
+                        body.vel += body.acc * step;
+                        continue;
+                    }
+                    for (size_t axis = 0; axis < 3; ++axis)
+                    {
+                        wide[i].vel[axis] += double(body.acc[axis]) * step;
+                        body.vel[axis] = float(wide[i].vel[axis]);
+                    }
+                }
+            });
+        }
+
+        // Every body moves with the velocity its last kick left it. Space wraps only at the
+        // end of the whole step, so that a sub-step costs no more than the move itself.
+        void drift(const float h, const bool wrap, detail::Precise* const wide)
+        {
+            const float size = _state->size;
+            detail::parallel_blocks(*_context->pool, _state->bodies.size(), [this, h, wrap, size, wide](const size_t begin, const size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    Body& body = _state->bodies[i];
+                    if (!wide)
+                    {
+                        body.pos += body.vel * h;
+                        if (wrap)
+                            for (size_t axis = 0; axis < 3; ++axis)
+                                body.pos[axis] = detail::wrap(body.pos[axis], size);
+                        continue;
+                    }
+                    for (size_t axis = 0; axis < 3; ++axis)
+                    {
+                        wide[i].pos[axis] += wide[i].vel[axis] * h;
+                        if (wrap)
+                            wide[i].pos[axis] = detail::wrap(wide[i].pos[axis], double(size));
+                        body.pos[axis] = float(wide[i].pos[axis]);
+                    }
+                }
+            });
         }
+
+        // Scratch for update_hierarchical(): each body's level, the bodies deepest level
+        // first, and how many of them are at or past each level.
+        std::vector<uint8_t> _levels;
+        std::vector<uint32_t> _order;
+        uint32_t _at_least[max_levels + 2] = {};
+
+        // For precise(). Mutable because ingest() is const, and drops it.
+        mutable std::vector<detail::Precise> _precise;
     };
 }
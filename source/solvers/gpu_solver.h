@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <memory>
 #include "context.h"
 #include "solver.h"
@@ -36,6 +37,7 @@ namespace nbody
             _device_dirty = false;
             _host_dirty = true;
             _tree.clear({ .size = _state->size });
+            _tree_stale = true;
         }
 
         void ingest() const override
@@ -48,10 +50,19 @@ namespace nbody
         }
 
         // Both halves in one submission, ordered by a barrier, rather than the base
-        // implementation's two submits with a host wait between them.
+        // implementation's two submits with a host wait between them. Leapfrog takes the
+        // base's three, its forces summed at the drifted positions: with State::gpu_tree the
+        // device builds their tree where they are, and nothing is read back for it; without,
+        // the host builds it from the drifted bodies, read back first.
         void update(const float dt) override
         {
             NBODY_PROFILE_ZONE();
+            if (_state->integrator != Integrator::Euler)
+            {
+                Solver::update(dt);
+                return;
+            }
+
             // See accelerate(): an empty body array cannot be bound as a descriptor.
             if (_state->bodies.empty())
                 return;
@@ -81,7 +92,7 @@ namespace nbody
             _device_dirty = true;
         }
 
-        void integrate(const float dt) override
+        void integrate(const float kick, const float drift) override
         {
             NBODY_PROFILE_ZONE();
             // See accelerate(): an empty body array cannot be bound as a descriptor.
@@ -95,7 +106,7 @@ namespace nbody
             if (_host_dirty)
                 upload();
 
-            _gpu->integrate_interleaved(dt, _state->size, _state->wrap);
+            _gpu->integrate_interleaved(kick, drift, _state->size, _state->wrap);
             _device_dirty = true;
 
             // Publish every step. The demo reads the bodies each frame anyway, so
@@ -104,22 +115,104 @@ namespace nbody
             materialize();
         }
 
+        // Brute force keeps the bodies on the device for the whole run, and reads them back
+        // once at the end. Barnes-hut steps one at a time, each step's tree over the positions
+        // the last one left: built by the device with State::gpu_tree, or without it by the
+        // host, from the bodies read back after each step.
+        void run(const size_t steps, const float dt) override
+        {
+            NBODY_PROFILE_ZONE();
+            if (_mode != Mode::N2)
+            {
+                Solver::run(steps, dt);
+                return;
+            }
+
+            // See accelerate(): an empty body array cannot be bound as a descriptor.
+            if (_state->bodies.empty())
+                return;
+
+            // Only if the caller has changed the bodies: otherwise the device is ahead of them.
+            if (_host_dirty)
+            {
+                build_or_clear_tree();
+                upload();
+            }
+
+            const bool leapfrog = _state->integrator != Integrator::Euler;
+            for (size_t done = 0; done < steps; done += max_batch)
+            {
+                const uint32_t batch = uint32_t(std::min(steps - done, max_batch));
+                _gpu->run_interleaved(batch, dt, leapfrog, _state->gravity, _state->size, _state->wrap);
+            }
+            _device_dirty = true;
+            materialize();
+        }
+
+        // The device's own timing of each step: see GpuDevice::end_step().
+        void end_step() override
+        {
+            _gpu->end_step();
+        }
+
+        [[nodiscard]] StepStats device_stats() const override
+        {
+            return _gpu->last_step();
+        }
+
+        // Bodies through the State, the tree dropped: a refit finds each body by its index.
+        void reorder(const std::span<const uint32_t> order) override
+        {
+            Solver::reorder(order);
+            _tree.clear({ .size = _state->size });
+            _tree_stale = true;
+        }
+
         // N^2 mode's root-only tree is a binding placeholder, not a real acceleration
         // structure, so don't offer it to the renderer.
+        //
+        // The tree the device builds for itself stays there. A caller that wants to look
+        // at one gets the same cells built here from the bodies, and pays for reading them.
         [[nodiscard]] const bh::Tree* tree() const override
         {
-            return _mode == Mode::NLogN ? &_tree : nullptr;
+            if (_mode != Mode::NLogN)
+                return nullptr;
+            if (_tree_stale)
+            {
+                materialize();
+                detail::build_tree(*_context->pool, _tree, _state->bodies, _state->size);
+                _tree_stale = false;
+            }
+            return &_tree;
         }
 
     private:
 
-        // Bring _tree in line with the current bodies, ready to be bound for a dispatch.
+        // The most steps in one submission. Bounded so that one cannot run long enough for
+        // the driver to take it for a hung device and reset it; at the sizes batching is for,
+        // a few hundred steps are over in milliseconds.
+        static constexpr size_t max_batch = 256;
+
+        // Barnes-hut with State::gpu_tree: the device builds the tree the dispatch reads.
+        [[nodiscard]] bool device_tree() const
+        {
+            return _mode == Mode::NLogN && _state->gpu_tree;
+        }
+
+        // Bring _tree in line with the current bodies, ready to be bound for a dispatch, or
+        // have the device build its own.
         void build_or_clear_tree()
         {
             NBODY_PROFILE_ZONE();
-            if (_mode == Mode::NLogN)
+            _gpu->build_tree_on_device(device_tree(), _state->size, _state->quadrupole, detail::leaf_capacity);
+            if (device_tree())
             {
-                detail::build_tree(_tree, _state->bodies, _state->size);
+                _tree_stale = true;
+            }
+            else if (_mode == Mode::NLogN)
+            {
+                detail::refit_tree(*_context->pool, _tree, _state->bodies, _state->size, _state->quadrupole);
+                _tree_stale = false;
             }
             else
             {
@@ -136,7 +229,10 @@ namespace nbody
         void upload()
         {
             NBODY_PROFILE_ZONE();
-            _gpu->write_interleaved(_state->bodies, _tree.nodes());
+            if (device_tree())
+                _gpu->write_interleaved(_state->bodies, {}, {}, {});
+            else
+                _gpu->write_interleaved(_state->bodies, _tree.nodes(), _tree.points(), _tree.quadrupoles());
             _host_dirty = false;
         }
 
@@ -154,7 +250,12 @@ namespace nbody
 
         std::shared_ptr<GpuDevice> _gpu;
         Mode _mode;
-        bh::Tree _tree;
+
+        // mutable: tree() builds it on demand when the device built the one it used.
+        mutable bh::Tree _tree;
+
+        // _tree is not the tree of the current bodies.
+        mutable bool _tree_stale = true;
 
         // The device holds results the canonical State has not seen yet.
         // mutable: materialize() is called from the const state().
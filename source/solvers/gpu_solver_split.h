@@ -40,6 +40,7 @@ namespace nbody
             _device_dirty = false;
             _host_dirty = true;
             _tree.clear({ .size = _state->size });
+            _tree_stale = true;
         }
 
         void ingest() const override
@@ -52,14 +53,25 @@ namespace nbody
         }
 
         // Both halves in one submission, ordered by a barrier, rather than the base
-        // implementation's two submits with a host wait between them.
+        // implementation's two submits with a host wait between them. Leapfrog takes the
+        // base's three, its forces summed at the drifted positions: with State::gpu_tree the
+        // tree over them is built on the device and nothing crosses the bus; without, the
+        // host builds it from the drifted positions, staged on the way back.
         void update(const float dt) override
         {
             NBODY_PROFILE_ZONE();
+            if (_state->integrator != Integrator::Euler)
+            {
+                Solver::update(dt);
+                return;
+            }
+
             // See accelerate(): an empty body array cannot be bound as a descriptor.
             if (_state->bodies.empty())
                 return;
 
+            queue_steps();
+
             // Before the tree is built off positions the device has not been told about.
             if (_host_dirty)
                 upload_bodies();
@@ -81,6 +93,8 @@ namespace nbody
             if (_state->bodies.empty())
                 return;
 
+            queue_steps();
+
             if (_host_dirty)
                 upload_bodies();
 
@@ -92,13 +106,15 @@ namespace nbody
             _device_dirty = true;
         }
 
-        void integrate(const float dt) override
+        void integrate(const float kick, const float drift) override
         {
             NBODY_PROFILE_ZONE();
             // See accelerate(): an empty body array cannot be bound as a descriptor.
             if (_state->bodies.empty())
                 return;
 
+            queue_steps();
+
             // Upload first if a caller has mutated the bodies since the last dispatch.
             // Without this, integrate() without a preceding accelerate() would step the
             // device's pre-mutation copy and then materialize() would download the
@@ -106,35 +122,127 @@ namespace nbody
             if (_host_dirty)
                 upload_bodies();
 
-            _gpu->integrate(dt, _state->size, _state->wrap, Readback::None);
+            _gpu->integrate(kick, drift, _state->size, _state->wrap, Readback::None);
+            _device_dirty = true;
+        }
+
+        // Brute force keeps the bodies on the device for the whole run, and reads back only
+        // what a caller reading every run will want. Barnes-hut steps one at a time, each
+        // step's tree over the positions the last one left: with State::gpu_tree the device
+        // builds it and reads nothing back for it; without, the host builds it from the
+        // positions staged after each step.
+        void run(const size_t steps, const float dt) override
+        {
+            NBODY_PROFILE_ZONE();
+            if (_mode != Mode::N2)
+            {
+                Solver::run(steps, dt);
+                return;
+            }
+
+            // See accelerate(): an empty body array cannot be bound as a descriptor.
+            if (_state->bodies.empty())
+                return;
+
+            queue_steps();
+
+            if (_host_dirty)
+                upload_bodies();
+            build_or_clear_tree();
+            upload_nodes();
+
+            const bool leapfrog = _state->integrator != Integrator::Euler;
+            for (size_t done = 0; done < steps; done += max_batch)
+            {
+                const uint32_t batch = uint32_t(std::min(steps - done, max_batch));
+                const bool last = done + batch == steps;
+                _gpu->run(batch, dt, leapfrog, _state->gravity, _state->size, _state->wrap,
+                    last ? wanted_readback() : Readback::None);
+            }
             _device_dirty = true;
         }
 
-        // N^2 mode's root-only tree is a binding placeholder, not a real acceleration
-        // structure, so don't offer it to the renderer.
+        // See GpuSolver::end_step().
+        void end_step() override
+        {
+            _gpu->end_step();
+        }
+
+        [[nodiscard]] StepStats device_stats() const override
+        {
+            return _gpu->last_step();
+        }
+
+        // See GpuSolver::reorder().
+        void reorder(const std::span<const uint32_t> order) override
+        {
+            Solver::reorder(order);
+            _tree.clear({ .size = _state->size });
+            _tree_stale = true;
+        }
+
+        // See GpuSolver::tree(). Here the read is the whole of what a device-built step
+        // would otherwise never bring back.
         [[nodiscard]] const bh::Tree* tree() const override
         {
-            return _mode == Mode::NLogN ? &_tree : nullptr;
+            if (_mode != Mode::NLogN)
+                return nullptr;
+            if (_tree_stale)
+            {
+                materialize();
+                detail::build_tree(*_context->pool, _tree, _state->bodies, _state->size);
+                _tree_stale = false;
+            }
+            return &_tree;
         }
 
     private:
 
-        // Positions in barnes-hut mode, because the next frame's tree is built from them.
+        // The most steps in one submission. Bounded so that one cannot run long enough for
+        // the driver to take it for a hung device and reset it; at the sizes batching is for,
+        // a few hundred steps are over in milliseconds.
+        static constexpr size_t max_batch = 256;
+
+        // Positions only in barnes-hut mode when !device_tree(): the host then builds the
+        // next frame's tree from them, where the device's own build needs none back.
         // Everything, if the last step was followed by a materialize(): a caller that reads
         // every frame will read again, and folding it in here saves a whole round trip.
         [[nodiscard]] Readback wanted_readback() const
         {
-            Readback want = _mode == Mode::NLogN ? Readback::Positions : Readback::None;
+            Readback want = _mode == Mode::NLogN && !device_tree() ? Readback::Positions : Readback::None;
             if (_materialize_expected)
                 want = want | Readback::All;
             _materialize_expected = false;
             return want;
         }
 
-        // Bring _tree in line with the current bodies, ready to be bound for a dispatch.
+        // Let the device run State::frames_in_flight steps ahead, read afresh each dispatch as
+        // the other settings are. Whatever reads the results waits for them: materialize(),
+        // and without State::gpu_tree the host's tree build, both go through download(). A
+        // device-built tree waits for nothing.
+        void queue_steps()
+        {
+            _gpu->set_frames_in_flight(uint32_t(std::max(_state->frames_in_flight, 1)));
+        }
+
+        // Barnes-hut with State::gpu_tree: the device builds the tree the dispatch reads.
+        [[nodiscard]] bool device_tree() const
+        {
+            return _mode == Mode::NLogN && _state->gpu_tree;
+        }
+
+        // Bring _tree in line with the current bodies, ready to be bound for a dispatch, or
+        // have the device build its own: then the step crosses the bus not at all.
         void build_or_clear_tree()
         {
             NBODY_PROFILE_ZONE();
+            _gpu->build_tree_on_device(device_tree(), _state->size, _state->quadrupole, detail::leaf_capacity);
+            if (device_tree())
+            {
+                _tree_stale = true;
+                return;
+            }
+
             if (_mode != Mode::NLogN)
             {
                 // The N^2 shader never reads the node buffer, but prepare() binds it
@@ -147,7 +255,8 @@ namespace nbody
             // Straight out of the staging positions: the same values as State::bodies, but
             // without re-interleaving a million bodies to reach two fields.
             _gpu->download(Readback::Positions);
-            detail::build_tree(_tree, _gpu->staged_pos_mass(), _gpu->staged_body_count(), _state->size);
+            detail::refit_tree(*_context->pool, _tree, _gpu->staged_pos_mass(), _gpu->staged_body_count(), _state->size, _state->quadrupole);
+            _tree_stale = false;
         }
 
         // De-interleave Body straight into the mapped staging allocations. The split has to
@@ -176,11 +285,13 @@ namespace nbody
             _host_dirty = false;
         }
 
-        // Rebuilt from scratch every frame, so there is no sending less than all of it.
+        // Rebuilt from scratch every frame, so there is no sending less than all of it, unless
+        // the device is building its own.
         void upload_nodes()
         {
             NBODY_PROFILE_ZONE();
-            _gpu->write_nodes(_tree.nodes());
+            if (!device_tree())
+                _gpu->write_nodes(_tree.nodes(), _tree.points(), _tree.quadrupoles());
         }
 
         // Reassemble Body from the parallel arrays. The only thing that asks for velocities
@@ -222,7 +333,12 @@ namespace nbody
 
         std::shared_ptr<GpuDevice> _gpu;
         Mode _mode;
-        bh::Tree _tree;
+
+        // mutable: tree() builds it on demand when the device built the one it used.
+        mutable bh::Tree _tree;
+
+        // _tree is not the tree of the current bodies.
+        mutable bool _tree_stale = true;
 
         // The device holds results the canonical State has not seen yet.
         // mutable: materialize() is called from the const state().
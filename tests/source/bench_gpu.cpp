@@ -1,11 +1,18 @@
+#include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/benchmark/catch_benchmark.hpp>
+#include "BS_thread_pool.hpp"
 #include "nbody/bhtree.h"
+#include "nbody/constants.h"
 #include "nbody/sim.h"
 #include "nbody/util.h"
+#include "detail/brute_force.h"
+#include "detail/physics.h"
+#include "detail/tree.h"
 
 // The two GPU body layouts, timed against each other. Hidden behind [.] so a normal test
 // run does not pay for them:
@@ -83,17 +90,96 @@ TEST_CASE("gpu brute force, 30k bodies", "[.][benchmark][gpu]")
     NBODY_BENCH_PAIR("bf 30k", nbody::Variant::GpuBruteForce, nbody::Variant::GpuBruteForceSoA, 30000);
 }
 
-// The serial host-side tree build, which every barnes-hut step pays before the device is
-// given anything to do. The ceiling on what any device-side or transfer-side change can win
-// back in that mode, and the reason the two layouts look alike there.
+// A hundred small steps, one update() at a time against one run(): what batching saves is
+// the host's round trip per step, which at this size is most of the step.
+TEST_CASE("gpu brute force, 2k bodies, batched", "[.][benchmark][gpu]")
+{
+    if (no_gpu()) return;
+    for (const nbody::Variant v : { nbody::Variant::GpuBruteForce, nbody::Variant::GpuBruteForceSoA })
+    {
+        const std::string label = v == nbody::Variant::GpuBruteForce ? "interleaved" : "split";
+        BENCHMARK_ADVANCED("bf 2k / " + label + " / 100 updates")(Catch::Benchmark::Chronometer m)
+        {
+            const auto sim = seeded(v, 2000);
+            m.measure([&](int) { for (int step = 0; step < 100; ++step) sim->update(dt); });
+        };
+        BENCHMARK_ADVANCED("bf 2k / " + label + " / run of 100")(Catch::Benchmark::Chronometer m)
+        {
+            const auto sim = seeded(v, 2000);
+            m.measure([&](int) { sim->run(100, dt); });
+        };
+    }
+}
+
+// What State::precision costs on the host: the integration on its own, where the doubles
+// are as many bytes again as the bodies, and whole barnes-hut steps, where the force sum
+// hides most of it.
+TEST_CASE("host integration precision", "[.][benchmark]")
+{
+    for (const nbody::Precision precision : { nbody::Precision::Single, nbody::Precision::Double })
+    {
+        const std::string label = precision == nbody::Precision::Single ? "single" : "double";
+        nbody::Sim sim;
+        sim.set_precision(precision);
+        sim.mutable_bodies().resize(1000000);
+        nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 1000.f });
+        sim.update(dt);   // seeds the doubles
+
+        BENCHMARK("integrate, " + label + ", 1000000")
+        {
+            sim.integrate(dt);
+        };
+        BENCHMARK("barnes-hut update, " + label + ", 1000000")
+        {
+            sim.update(dt);
+        };
+    }
+}
+
+// Each placement against the others, on whole barnes-hut and integration steps. On one node
+// they should be level; across sockets Spread is the one meant to pull ahead, with the
+// bodies and the tree interleaved under a pool that reads them from every socket.
+TEST_CASE("host placement across numa nodes", "[.][benchmark]")
+{
+    const std::pair<nbody::Placement, const char*> placements[] = {
+        { nbody::Placement::Unpinned, "unpinned" },
+        { nbody::Placement::Compact, "compact" },
+        { nbody::Placement::Spread, "spread" },
+    };
+    for (const auto& [placement, label] : placements)
+    {
+        nbody::Sim sim(nbody::Variant::CpuBarnesHut, placement);
+        sim.mutable_bodies().resize(1000000);
+        nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 1000.f });
+        sim.update(dt);
+
+        BENCHMARK(std::string("integrate, ") + label + ", 1000000")
+        {
+            sim.integrate(dt);
+        };
+        BENCHMARK(std::string("barnes-hut update, ") + label + ", 1000000")
+        {
+            sim.update(dt);
+        };
+    }
+}
+
+// The host-side tree build, which every barnes-hut step pays before the device is given
+// anything to do. The ceiling on what any device-side or transfer-side change can win back
+// in that mode, and the reason the two layouts look alike there.
+//
+// Three ways to the same tree: one insert() per body, which is how it used to be built, and
+// the morton build on one thread and then on the pool. The last is what the solvers run.
 TEST_CASE("host barnes-hut tree build", "[.][benchmark]")
 {
+    BS::thread_pool pool;
+
     for (const size_t num : { size_t(100000), size_t(500000) })
     {
         std::vector<nbody::Body> bodies(num);
         nbody::util::disk(bodies.begin(), bodies.end(), { .outer_radius = 100.f });
 
-        BENCHMARK_ADVANCED("tree build, " + std::to_string(num))(Catch::Benchmark::Chronometer m)
+        BENCHMARK_ADVANCED("tree build, insert, " + std::to_string(num))(Catch::Benchmark::Chronometer m)
         {
             nbody::bh::Tree tree;
             m.measure([&](int)
@@ -105,5 +191,159 @@ TEST_CASE("host barnes-hut tree build", "[.][benchmark]")
                 return tree.nodes().size();
             });
         };
+
+        BENCHMARK_ADVANCED("tree build, morton, serial, " + std::to_string(num))(Catch::Benchmark::Chronometer m)
+        {
+            nbody::bh::Tree tree;
+            m.measure([&](int)
+            {
+                tree.build({ .size = 10000.f }, bodies.data(), bodies.size());
+                return tree.nodes().size();
+            });
+        };
+
+        BENCHMARK_ADVANCED("tree build, morton, " + std::to_string(pool.get_thread_count()) + " threads, " + std::to_string(num))(Catch::Benchmark::Chronometer m)
+        {
+            nbody::bh::Tree tree;
+            m.measure([&](int)
+            {
+                nbody::detail::build_tree(pool, tree, bodies, 10000.f);
+                return tree.nodes().size();
+            });
+        };
+
+        // Steady state of a slowly evolving disk: each run advances the bodies a step too
+        // short for more than a few percent of them to change leaf, then refits to them,
+        // with a rebuild whenever the default refit limits call for one.
+        BENCHMARK_ADVANCED("tree refit, " + std::to_string(pool.get_thread_count()) + " threads, " + std::to_string(num))(Catch::Benchmark::Chronometer m)
+        {
+            nbody::bh::Tree tree;
+            nbody::detail::build_tree(pool, tree, bodies, 10000.f);
+            std::vector<nbody::Body> moving = bodies;
+            m.measure([&](int)
+            {
+                for (nbody::Body& b : moving)
+                    b.pos += b.vel * 2e-5f;
+                nbody::detail::refit_tree(pool, tree, moving, 10000.f, false);
+                return tree.nodes().size();
+            });
+        };
+    }
+}
+
+TEST_CASE("host barnes-hut traversal", "[.][benchmark]")
+{
+    // One force sum per body over a fixed tree, serially: the per-body cost of the walk
+    // itself, through a std::function and with the visitor inlined.
+    std::vector<nbody::Body> bodies(100000);
+    nbody::util::disk(bodies.begin(), bodies.end(), { .outer_radius = 100.f });
+
+    BS::thread_pool pool;
+    nbody::bh::Tree tree;
+    nbody::detail::build_tree(pool, tree, bodies, 10000.f);
+
+    BENCHMARK("tree apply, std::function, 100000")
+    {
+        float sum = 0;
+        for (const nbody::Body& body : bodies)
+        {
+            nbody::Vector acc = { 0, 0, 0 };
+            const std::function<void(const nbody::bh::Node&)> visit = [&acc, &body](const nbody::bh::Node& node)
+            {
+                acc += nbody::detail::gravity(body.pos, body.radius, node.com, node.mass, nbody::G);
+            };
+            tree.apply(body.pos, visit);
+            sum += acc.x;
+        }
+        return sum;
+    };
+
+    BENCHMARK("tree apply, inlined, 100000")
+    {
+        float sum = 0;
+        for (const nbody::Body& body : bodies)
+        {
+            nbody::Vector acc = { 0, 0, 0 };
+            tree.apply(body.pos, [&acc, &body](const nbody::bh::Node& node)
+            {
+                acc += nbody::detail::gravity(body.pos, body.radius, node.com, node.mass, nbody::G);
+            });
+            sum += acc.x;
+        }
+        return sum;
+    };
+}
+
+TEST_CASE("host brute-force kernels", "[.][benchmark]")
+{
+    // The full O(n^2) sum over the packed tiles, serially, once per kernel this CPU runs, one
+    // sided and symmetric.
+    std::vector<nbody::Body> bodies(8192);
+    nbody::util::disk(bodies.begin(), bodies.end(), { .outer_radius = 100.f });
+
+    BS::thread_pool pool;
+    nbody::detail::SourceTiles sources;
+    sources.pack(pool, bodies);
+
+    const nbody::State defaults;
+    const nbody::detail::Blocking blocking = { .targets = defaults.block_targets, .sources = defaults.block_sources };
+    for (int simd = 0; simd <= int(nbody::detail::simd_supported()); ++simd)
+    {
+        const auto kernel = nbody::detail::Simd(simd);
+        BENCHMARK(std::string("brute force, ") + nbody::detail::simd_name(kernel) + ", 8192")
+        {
+            nbody::detail::brute_force(kernel, blocking, sources, bodies.data(), 0, bodies.size(), nbody::G);
+            return bodies[0].acc.x;
+        };
     }
+
+    BS::thread_pool serial(1);
+    nbody::detail::PairSums sums;
+    for (int simd = 0; simd <= int(nbody::detail::simd_supported()); ++simd)
+    {
+        const auto kernel = nbody::detail::Simd(simd);
+        BENCHMARK(std::string("symmetric brute force, ") + nbody::detail::simd_name(kernel) + ", 8192")
+        {
+            nbody::detail::brute_force_symmetric(serial, kernel, blocking, sources, sums, bodies.data(), bodies.size(), nbody::G);
+            return bodies[0].acc.x;
+        };
+    }
+}
+
+TEST_CASE("brute-force blocking", "[.][benchmark]")
+{
+    // The widest kernel over a sweep of State::block_targets x State::block_sources, serially,
+    // to choose them for a host. Unblocked is a source block of everything. Large enough that
+    // the sources no longer fit in L2; the sweep is slow, so run it on its own:
+    //
+    //     nbody_tests "brute-force blocking" --benchmark-samples 3
+    constexpr size_t count = 1 << 17;
+    std::vector<nbody::Body> bodies(count);
+    nbody::util::disk(bodies.begin(), bodies.end(), { .outer_radius = 100.f });
+
+    BS::thread_pool pool;
+    nbody::detail::SourceTiles sources;
+    sources.pack(pool, bodies);
+
+    // A slice of the targets: every one sweeps all of the sources whatever the blocking, so
+    // this costs the same per target and keeps a sample to a second or so.
+    constexpr size_t targets = 4096;
+    const nbody::detail::Simd kernel = nbody::detail::simd_supported();
+
+    BENCHMARK("unblocked")
+    {
+        nbody::detail::brute_force(kernel, { .targets = 1, .sources = count }, sources, bodies.data(), 0, targets, nbody::G);
+        return bodies[0].acc.x;
+    };
+
+    for (const size_t block_targets : { 16, 64, 256, 1024 })
+        for (const size_t block_sources : { 512, 2048, 8192, 32768 })
+        {
+            const nbody::detail::Blocking blocking = { .targets = block_targets, .sources = block_sources };
+            BENCHMARK(std::to_string(block_targets) + " x " + std::to_string(block_sources))
+            {
+                nbody::detail::brute_force(kernel, blocking, sources, bodies.data(), 0, targets, nbody::G);
+                return bodies[0].acc.x;
+            };
+        }
 }
@@ -4,11 +4,15 @@
 #include <random>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
+#include "BS_thread_pool.hpp"
 #include "nbody/bhtree.h"
 #include "nbody/vector.h"
+#include "detail/physics.h"
+#include "detail/tree.h"
 
 using nbody::Vector;
 using nbody::bh::Node;
+using nbody::bh::Quadrupole;
 using nbody::bh::Tree;
 
 namespace
@@ -25,6 +29,49 @@ namespace
         };
         return close(a.x, b.x) && close(a.y, b.y) && close(a.z, b.z);
     }
+
+    // Whether two trees hold the same cells with the same contents, whatever order their
+    // node arrays happen to be in. insert() appends each split where it happens to occur and
+    // build() lays splits out depth first, so only the shape is comparable, not the indices.
+    bool same_tree(const std::vector<Node>& a, const uint32_t ai, const std::vector<Node>& b, const uint32_t bi)
+    {
+        const Node& na = a[ai];
+        const Node& nb = b[bi];
+        if (na.bounds.center != nb.bounds.center || na.bounds.size != nb.bounds.size)
+            return false;
+        if ((na.children == 0) != (nb.children == 0))
+            return false;
+        if (std::abs(na.mass - nb.mass) > 1e-5f * std::max(1.f, na.mass))
+            return false;
+        if (na.mass > 0 && !compare(na.com, nb.com))
+            return false;
+        if (na.children == 0)
+            return true;
+        for (uint32_t q = 0; q < 8; ++q)
+            if (!same_tree(a, na.children + q, b, nb.children + q))
+                return false;
+        return true;
+    }
+
+    struct Mass
+    {
+        Vector pos;
+        float mass = 1;
+    };
+
+    std::vector<Mass> gaussian_cloud(const size_t num, const float size)
+    {
+        std::default_random_engine generator;
+        std::normal_distribution<float> distribution(0, .5f);
+        std::vector<Mass> masses(num);
+        for (Mass& m : masses)
+            m.pos = {
+                .x = std::clamp(distribution(generator), -1.f, 1.f) * size,
+                .y = std::clamp(distribution(generator), -1.f, 1.f) * size,
+                .z = std::clamp(distribution(generator), -1.f, 1.f) * size
+            };
+        return masses;
+    }
 }
 
 TEST_CASE("create tree", "[bh tree 3]")
@@ -215,6 +262,431 @@ TEST_CASE("insert 100000 particles", "[bh tree 3]")
 // one does not, but reserve(10 * num) asks for a single contiguous 480 MB block, which
 // is a hard failure on a memory-capped CI container rather than a useful signal.
 
+TEST_CASE("build lays out the nodes insert does", "[bh tree 3]")
+{
+    // The two-body cases above, built in one go. Small enough that depth-first order and
+    // insertion order coincide, so these compare index for index.
+    const std::vector<std::vector<Mass>> cases = {
+        { { { 1,1,1 }, 1 }, { { -1,-1,-1 }, 2 } },
+        { { { 1,1,1 }, 1 }, { { 99,99,99 }, 1 } },
+        { { { 50,50,50 }, 1 }, { { -50,50,50 }, 1 }, { { 50,-50,50 }, 1 } },
+    };
+
+    for (const std::vector<Mass>& masses : cases)
+    {
+        Tree inserted({ .size = 100 });
+        for (const Mass& m : masses)
+            inserted.insert(m.pos, m.mass);
+
+        Tree built;
+        built.build({ .size = 100 }, masses.data(), masses.size());
+
+        REQUIRE(built.nodes().size() == inserted.nodes().size());
+        for (size_t i = 0; i < built.nodes().size(); ++i)
+        {
+            INFO("node " << i);
+            REQUIRE(built.nodes()[i].children == inserted.nodes()[i].children);
+            REQUIRE(built.nodes()[i].next == inserted.nodes()[i].next);
+            REQUIRE(built.nodes()[i].mass == inserted.nodes()[i].mass);
+            REQUIRE(compare(built.nodes()[i].com, inserted.nodes()[i].com));
+        }
+    }
+}
+
+TEST_CASE("build matches insert over 100000 particles", "[bh tree 3]")
+{
+    const float size = 100;
+    const std::vector<Mass> masses = gaussian_cloud(100000, size);
+
+    Tree inserted({ .size = size * 2 });
+    inserted.reserve(10 * masses.size());
+    for (const Mass& m : masses)
+        inserted.insert(m.pos, m.mass);
+
+    Tree built;
+    built.build({ .size = size * 2 }, masses.data(), masses.size());
+
+    REQUIRE(built.nodes()[0].mass == float(masses.size()));
+    REQUIRE(built.nodes().size() == inserted.nodes().size());
+    REQUIRE(same_tree(built.nodes(), 0, inserted.nodes(), 0));
+
+    // Every child block must close with its parent's `next`, or the skip-pointer walk the
+    // shaders and apply() both rely on would wander off into another subtree.
+    for (const Node& node : built.nodes())
+        if (node.children != 0)
+            REQUIRE(built.nodes()[node.children + 7].next == node.next);
+}
+
+TEST_CASE("a parallel build is identical to a serial one", "[bh tree 3]")
+{
+    // Big enough that the top of the tree is split into subtrees for the workers, which are
+    // then stitched back together: the part the serial path runs without any threads at all.
+    const std::vector<Mass> masses = gaussian_cloud(50000, 100);
+
+    Tree serial;
+    serial.build({ .size = 200 }, masses.data(), masses.size());
+
+    BS::thread_pool pool;
+    Tree parallel;
+    parallel.build({ .size = 200 }, masses.data(), masses.size(), nbody::detail::executor(pool));
+
+    REQUIRE(parallel.nodes().size() == serial.nodes().size());
+    for (size_t i = 0; i < serial.nodes().size(); ++i)
+    {
+        REQUIRE(parallel.nodes()[i].children == serial.nodes()[i].children);
+        REQUIRE(parallel.nodes()[i].next == serial.nodes()[i].next);
+        REQUIRE(parallel.nodes()[i].mass == serial.nodes()[i].mass);
+        REQUIRE(parallel.nodes()[i].com == serial.nodes()[i].com);
+    }
+}
+
+TEST_CASE("build separates bodies closer than a morton cell", "[bh tree 3]")
+{
+    // A morton key resolves size/2^21 and no finer, so these share one. insert() keeps
+    // splitting until they part, and build() has to as well.
+    const std::vector<Mass> masses = {
+        { { 1.f, 1.f, 1.f }, 1 },
+        { { 1.f + 1e-5f, 1.f, 1.f }, 1 },
+        { { 1.f, 1.f, 1.f }, 1 },   // coincident: never separable, so merged
+    };
+
+    Tree inserted({ .size = 100 });
+    for (const Mass& m : masses)
+        inserted.insert(m.pos, m.mass);
+
+    Tree built;
+    built.build({ .size = 100 }, masses.data(), masses.size());
+
+    REQUIRE(built.nodes()[0].mass == 3.f);
+    REQUIRE(built.nodes().size() == inserted.nodes().size());
+    REQUIRE(same_tree(built.nodes(), 0, inserted.nodes(), 0));
+}
+
+TEST_CASE("refit follows bodies that move", "[bh tree 3]")
+{
+    const float size = 100;
+    std::vector<Mass> masses = gaussian_cloud(50000, size);
+
+    BS::thread_pool pool;
+    Tree serial;
+    Tree parallel;
+    serial.build({ .size = size * 2 }, masses.data(), masses.size());
+    parallel.build({ .size = size * 2 }, masses.data(), masses.size(), nbody::detail::executor(pool));
+
+    // A step's worth of drift: small next to the cloud, large next to most leaves, so a
+    // few percent of the bodies change leaf.
+    std::default_random_engine generator(7);
+    std::normal_distribution<float> drift(0, .002f);
+    for (Mass& m : masses)
+        m.pos += Vector{ drift(generator), drift(generator), drift(generator) };
+
+    REQUIRE(serial.refit({ .size = size * 2 }, masses.data(), masses.size()));
+    REQUIRE(parallel.refit({ .size = size * 2 }, masses.data(), masses.size(), nbody::detail::executor(pool)));
+
+    Tree fresh;
+    fresh.build({ .size = size * 2 }, masses.data(), masses.size());
+
+    const std::vector<Node>& nodes = serial.nodes();
+    REQUIRE(nodes[0].mass == float(masses.size()));
+    REQUIRE(compare(nodes[0].com, fresh.nodes()[0].com));
+
+    // Every body in exactly one leaf, and that leaf the cell it now lies in.
+    std::vector<size_t> seen(masses.size(), 0);
+    for (const Node& node : nodes)
+    {
+        if (node.children != 0)
+        {
+            REQUIRE(nodes[node.children + 7].next == node.next);
+            float mass = 0;
+            for (uint32_t q = 0; q < 8; ++q)
+                mass += nodes[node.children + q].mass;
+            REQUIRE(node.mass == mass);
+            continue;
+        }
+        REQUIRE((node.count <= 1 || node.bounds.size < std::numeric_limits<float>::epsilon()));
+        for (uint32_t s = node.first; s < node.first + node.count; ++s)
+        {
+            const uint32_t body = serial.slots()[s];
+            ++seen[body];
+            // The cloud is clamped to the root's faces, so drift carries some outside it,
+            // into the edge leaves.
+            const Vector& pos = masses[body].pos;
+            REQUIRE((node.bounds.contains(pos) || !nodes[0].bounds.contains(pos)));
+        }
+    }
+    REQUIRE(std::all_of(seen.begin(), seen.end(), [](const size_t n) { return n == 1; }));
+
+    // Laid out differently from a fresh build, but summing to the same forces.
+    const auto force = [](const Tree& tree, const Vector& pos)
+    {
+        Vector f = { 0, 0, 0 };
+        tree.apply(pos, [&f, &pos](const Node& node)
+        {
+            const Vector delta = node.com - pos;
+            const float dist_sq = dot(delta, delta) + 1e-2f;
+            f += delta * (node.mass / (dist_sq * std::sqrt(dist_sq)));
+        });
+        return f;
+    };
+    double error = 0;
+    for (size_t i = 0; i < masses.size(); i += 100)
+    {
+        const Vector expected = force(fresh, masses[i].pos);
+        error += std::sqrt((force(serial, masses[i].pos) - expected).size_sq() / expected.size_sq());
+    }
+    REQUIRE(error / double(masses.size() / 100) < 1e-4);
+
+    // And the workers change nothing about the result.
+    REQUIRE(parallel.nodes().size() == nodes.size());
+    REQUIRE(parallel.slots() == serial.slots());
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        REQUIRE(parallel.nodes()[i].children == nodes[i].children);
+        REQUIRE(parallel.nodes()[i].mass == nodes[i].mass);
+        REQUIRE(parallel.nodes()[i].com == nodes[i].com);
+    }
+}
+
+TEST_CASE("refit falls back to a build", "[bh tree 3]")
+{
+    const float size = 100;
+    const std::vector<Mass> masses = gaussian_cloud(10000, size);
+    Tree tree;
+
+    SECTION("with nothing built to refit")
+    {
+        REQUIRE_FALSE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+        REQUIRE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+
+        tree.insert({ 1, 1, 1 }, 1);
+        REQUIRE_FALSE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+    }
+
+    SECTION("when the bodies or the bounds change")
+    {
+        tree.build({ .size = size * 2 }, masses.data(), masses.size());
+        REQUIRE_FALSE(tree.refit({ .size = size * 2 }, masses.data(), masses.size() - 1));
+        REQUIRE_FALSE(tree.refit({ .size = size * 4 }, masses.data(), masses.size() - 1));
+        REQUIRE(tree.nodes()[0].mass == float(masses.size() - 1));
+    }
+
+    SECTION("when too many bodies left their leaves")
+    {
+        tree.build({ .size = size * 2 }, masses.data(), masses.size());
+        std::vector<Mass> reversed(masses.rbegin(), masses.rend());
+        REQUIRE_FALSE(tree.refit({ .size = size * 2 }, reversed.data(), reversed.size()));
+
+        Tree fresh;
+        fresh.build({ .size = size * 2 }, reversed.data(), reversed.size());
+        REQUIRE(tree.nodes().size() == fresh.nodes().size());
+        REQUIRE(same_tree(tree.nodes(), 0, fresh.nodes(), 0));
+    }
+
+    SECTION("after enough refits in a row")
+    {
+        tree.set_refit_limits({ .max_refits = 2 });
+        tree.build({ .size = size * 2 }, masses.data(), masses.size());
+        const size_t built = tree.nodes().size();
+        REQUIRE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+        REQUIRE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+        REQUIRE_FALSE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+        REQUIRE(tree.refit({ .size = size * 2 }, masses.data(), masses.size()));
+        REQUIRE(tree.nodes().size() == built);
+    }
+}
+
+TEST_CASE("bucketed leaves hold up to the leaf capacity", "[bh tree 3]")
+{
+    const float size = 100;
+    std::vector<Mass> masses = gaussian_cloud(20000, size);
+
+    Tree single;
+    single.build({ .size = size * 2 }, masses.data(), masses.size());
+
+    Tree bucketed;
+    bucketed.set_leaf_capacity(16);
+    bucketed.build({ .size = size * 2 }, masses.data(), masses.size());
+
+    // Checked after a build, and again after a refit has moved bodies between the leaves.
+    const auto check = [&masses](const Tree& tree)
+    {
+        const std::vector<Node>& nodes = tree.nodes();
+        REQUIRE(nodes[0].mass == float(masses.size()));
+
+        std::vector<size_t> seen(masses.size(), 0);
+        for (const Node& node : nodes)
+        {
+            if (node.children != 0)
+                continue;
+            REQUIRE(node.count <= 16);
+
+            Vector weighted = { 0, 0, 0 };
+            for (uint32_t s = node.first; s < node.first + node.count; ++s)
+            {
+                const uint32_t body = tree.slots()[s];
+                ++seen[body];
+                REQUIRE(tree.points()[s].pos == masses[body].pos);
+                weighted += tree.points()[s].pos;
+            }
+            REQUIRE(node.mass == float(node.count));
+            if (node.count > 0)
+                REQUIRE(compare(node.com, weighted / float(node.count)));
+        }
+        REQUIRE(std::all_of(seen.begin(), seen.end(), [](const size_t n) { return n == 1; }));
+    };
+
+    check(bucketed);
+    REQUIRE(bucketed.nodes().size() * 8 < single.nodes().size());
+
+    std::default_random_engine generator(3);
+    std::normal_distribution<float> drift(0, .05f);
+    for (Mass& m : masses)
+        m.pos += Vector{ drift(generator), drift(generator), drift(generator) };
+    REQUIRE(bucketed.refit({ .size = size * 2 }, masses.data(), masses.size()));
+    check(bucketed);
+}
+
+TEST_CASE("apply sums a close leaf body by body", "[bh tree 3]")
+{
+    const std::vector<Mass> masses = {
+        { { 10.f, 10.f, 10.f }, 1 },
+        { { 11.f, 10.f, 10.f }, 2 },
+        { { 10.f, 12.f, 10.f }, 3 },
+    };
+
+    Tree tree;
+    tree.set_leaf_capacity(4);
+    tree.build({ .size = 100 }, masses.data(), masses.size());
+    REQUIRE(tree.nodes().size() == 1);
+
+    // From inside the leaf, each body is its own interaction, in the leaf's morton order.
+    std::vector<float> seen;
+    tree.apply({ 10.5f, 10.5f, 10.f }, [&seen](const Node& node) { seen.push_back(node.mass); });
+    std::sort(seen.begin(), seen.end());
+    REQUIRE(seen == std::vector<float>{ 1.f, 2.f, 3.f });
+
+    // From far enough away, the leaf is one mass like any other node.
+    seen.clear();
+    tree.apply({ 1000.f, 1000.f, 1000.f }, [&seen](const Node& node) { seen.push_back(node.mass); });
+    REQUIRE(seen == std::vector<float>{ 6.f });
+}
+
+TEST_CASE("apply_group accepts only nodes far from the whole box", "[bh tree 3]")
+{
+    const std::vector<Mass> masses = gaussian_cloud(5000, 40);
+    Tree tree;
+    tree.set_leaf_capacity(8);
+    tree.build({ .size = 100 }, masses.data(), masses.size());
+
+    float total = 0;
+    for (const Mass& m : masses)
+        total += m.mass;
+
+    // A box shrunk to a point is a single body's walk.
+    const Vector pos{ 3, -7, 12 };
+    std::vector<Vector> single;
+    std::vector<Vector> grouped;
+    tree.apply(pos, [&single](const Node& node) { single.push_back(node.com); });
+    tree.apply_group(pos, pos, [&grouped](const Node& node) { grouped.push_back(node.com); });
+    REQUIRE(single == grouped);
+
+    // Whatever the box, every body is counted once, and every node accepted whole passes
+    // the opening test from each corner of it.
+    const Vector min{ -10, -5, 0 };
+    const Vector max{ 5, 5, 20 };
+    float mass = 0;
+    tree.apply_group(min, max, [&](const Node& node)
+    {
+        mass += node.mass;
+        if (node.children == 0 && node.count <= 1)
+            return;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const Vector p{ corner & 1 ? max.x : min.x, corner & 2 ? max.y : min.y, corner & 4 ? max.z : min.z };
+            REQUIRE(node.com.dist_sq(p) > node.bounds.size * node.bounds.size * .25f);
+        }
+    });
+    REQUIRE(std::abs(mass - total) <= 1e-3f * total);
+}
+
+TEST_CASE("quadrupoles sharpen the far field of an elongated cluster", "[bh tree 3]")
+{
+    // A cigar of bodies seen from off its end, where a monopole is at its worst: the
+    // quadrupole term should take out most of what the monopole misses.
+    std::vector<Mass> masses = gaussian_cloud(2000, 10);
+    for (Mass& m : masses)
+        m.pos.x *= 4;
+
+    Tree tree;
+    tree.set_leaf_capacity(8);
+    tree.set_quadrupoles(true);
+    tree.build({ .size = 100 }, masses.data(), masses.size());
+    REQUIRE(tree.quadrupoles().size() == tree.nodes().size());
+
+    const std::vector<Vector> probes = { { 120, 30, 0 }, { 0, 90, 40 }, { -70, -70, 70 } };
+    double monopole_error = 0;
+    double quadrupole_error = 0;
+    for (const Vector& probe : probes)
+    {
+        Vector exact{ 0, 0, 0 };
+        for (const Mass& m : masses)
+            exact += nbody::detail::gravity(probe, 0, m.pos, m.mass, 1);
+
+        Vector monopole{ 0, 0, 0 };
+        tree.apply(probe, [&](const Node& node)
+        {
+            monopole += nbody::detail::gravity(probe, 0, node.com, node.mass, 1);
+        }, 1.f);
+
+        Vector quadrupole{ 0, 0, 0 };
+        tree.apply(probe, [&](const Node& node, const Quadrupole& q)
+        {
+            quadrupole += nbody::detail::gravity(probe, 0, node.com, node.mass, q, 1);
+        }, 1.f);
+
+        const double mag = std::sqrt(exact.size_sq());
+        monopole_error += std::sqrt((monopole - exact).size_sq()) / mag;
+        quadrupole_error += std::sqrt((quadrupole - exact).size_sq()) / mag;
+    }
+
+    INFO("monopole " << monopole_error << ", quadrupole " << quadrupole_error);
+    REQUIRE(monopole_error > 0);
+    REQUIRE(quadrupole_error < monopole_error / 4);
+}
+
+TEST_CASE("refit keeps the quadrupoles current", "[bh tree 3]")
+{
+    std::vector<Mass> masses = gaussian_cloud(5000, 40);
+    Tree tree;
+    tree.set_leaf_capacity(8);
+    tree.set_quadrupoles(true);
+    tree.build({ .size = 100 }, masses.data(), masses.size());
+
+    std::default_random_engine generator(3);
+    std::normal_distribution<float> drift(0, .05f);
+    for (Mass& m : masses)
+        m.pos += Vector{ drift(generator), drift(generator), drift(generator) };
+    REQUIRE(tree.refit({ .size = 100 }, masses.data(), masses.size()));
+    REQUIRE(tree.quadrupoles().size() == tree.nodes().size());
+
+    // The root's moment depends only on the bodies, not on how the tree got to them.
+    Tree fresh;
+    fresh.set_leaf_capacity(8);
+    fresh.set_quadrupoles(true);
+    fresh.build({ .size = 100 }, masses.data(), masses.size());
+
+    const Quadrupole& a = tree.quadrupoles()[0];
+    const Quadrupole& b = fresh.quadrupoles()[0];
+    const float scale = std::max({ std::abs(b.xx), std::abs(b.yy), std::abs(b.zz) });
+    for (const auto& [x, y] : { std::pair{ a.xx, b.xx }, { a.yy, b.yy }, { a.zz, b.zz }, { a.xy, b.xy }, { a.xz, b.xz }, { a.yz, b.yz } })
+        REQUIRE(std::abs(x - y) <= 1e-3f * scale);
+
+    // And turning them off drops them at the next build.
+    tree.set_quadrupoles(false);
+    tree.refit({ .size = 100 }, masses.data(), masses.size());
+    REQUIRE(tree.quadrupoles().empty());
+}
+
 TEST_CASE("apply with 1 far away particle", "[bh tree 3]")
 {
 	Tree tree({ .size=200 });
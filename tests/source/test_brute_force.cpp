@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include "BS_thread_pool.hpp"
+#include "nbody/body.h"
+#include "nbody/constants.h"
+#include "detail/brute_force.h"
+#include "detail/physics.h"
+
+using nbody::Body;
+using nbody::Vector;
+using nbody::detail::Simd;
+
+namespace
+{
+    std::vector<Body> scattered(const size_t count)
+    {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> coord(-50.f, 50.f);
+        std::uniform_real_distribution<float> mass(.5f, 2.f);
+        std::vector<Body> bodies(count);
+        for (Body& body : bodies)
+        {
+            body.pos = { coord(rng), coord(rng), coord(rng) };
+            body.mass = mass(rng);
+            body.radius = .5f;
+        }
+        return bodies;
+    }
+}
+
+// Every kernel this CPU can run against the scalar law it vectorizes, pair by pair. The
+// counts straddle the tile width, so the padding in the last tile is exercised both ways,
+// and the blockings include ones that divide nothing evenly and the degenerate zero.
+TEST_CASE("every brute-force kernel matches gravity()", "[brute force]")
+{
+    BS::thread_pool pool;
+
+    const size_t count = GENERATE(size_t{1}, 15, 16, 17, 100, 513);
+    const nbody::detail::Blocking blocking = GENERATE(
+        nbody::detail::Blocking{ .targets = 256, .sources = 8192 },
+        nbody::detail::Blocking{ .targets = 7, .sources = 40 },
+        nbody::detail::Blocking{ .targets = 0, .sources = 0 });
+    std::vector<Body> bodies = scattered(count);
+
+    // Two coincident bodies: zero distance, where the estimated reciprocal square root is
+    // infinite and only the radius mask keeps the lane from turning the sum into NaN.
+    if (count > 2)
+        bodies[1].pos = bodies[0].pos;
+
+    std::vector<Vector> expected(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        expected[i] = { 0, 0, 0 };
+        for (const Body& source : bodies)
+            expected[i] += nbody::detail::gravity(bodies[i].pos, bodies[i].radius, source.pos, source.mass, nbody::G);
+    }
+
+    nbody::detail::SourceTiles sources;
+    sources.pack(pool, bodies);
+    REQUIRE(sources.tile_count() == (count + 15) / 16);
+
+    for (int simd = 0; simd <= int(nbody::detail::simd_supported()); ++simd)
+    {
+        INFO(nbody::detail::simd_name(Simd(simd)) << ", " << blocking.targets << " x " << blocking.sources);
+        nbody::detail::brute_force(Simd(simd), blocking, sources, bodies.data(), 0, count, nbody::G);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            INFO("body " << i);
+            REQUIRE(std::isfinite(bodies[i].acc.x));
+            REQUIRE(std::isfinite(bodies[i].acc.y));
+            REQUIRE(std::isfinite(bodies[i].acc.z));
+
+            // Relative to the largest component: a sum of many pairs cancels, and a lone
+            // small component would otherwise be held to more bits than float has.
+            const float scale = std::max({ 1e-12f, std::abs(expected[i].x), std::abs(expected[i].y), std::abs(expected[i].z) });
+            REQUIRE(std::abs(bodies[i].acc.x - expected[i].x) <= 1e-4f * scale);
+            REQUIRE(std::abs(bodies[i].acc.y - expected[i].y) <= 1e-4f * scale);
+            REQUIRE(std::abs(bodies[i].acc.z - expected[i].z) <= 1e-4f * scale);
+        }
+    }
+}
+
+// Each pair once, applied to both bodies, against every pair from both sides. The radii vary,
+// so that a pair inside one body's cutoff and outside the other's is in there, and two bodies
+// coincide. Only the order of the sums differs, and the threads add a third order of their
+// own, so the bound is the same relative one.
+TEST_CASE("the symmetric brute-force sum matches the one-sided one", "[brute force]")
+{
+    BS::thread_pool pool(4);
+
+    const size_t count = GENERATE(size_t{1}, 2, 17, 100, 513, 3000);
+    const size_t block_sources = GENERATE(size_t{8192}, 40, 0);
+    std::vector<Body> bodies = scattered(count);
+    for (size_t i = 0; i < count; ++i)
+        bodies[i].radius = float(i % 7);
+    if (count > 2)
+        bodies[1].pos = bodies[0].pos;
+
+    nbody::detail::SourceTiles sources;
+    sources.pack(pool, bodies);
+    const nbody::detail::Blocking blocking = { .targets = 256, .sources = block_sources };
+
+    nbody::detail::brute_force(Simd::Scalar, blocking, sources, bodies.data(), 0, count, nbody::G);
+    std::vector<Vector> expected(count);
+    for (size_t i = 0; i < count; ++i)
+        expected[i] = bodies[i].acc;
+
+    nbody::detail::PairSums sums;
+    for (int simd = 0; simd <= int(nbody::detail::simd_supported()); ++simd)
+    {
+        INFO(nbody::detail::simd_name(Simd(simd)) << ", sources " << block_sources);
+        for (Body& body : bodies)
+            body.acc = { 1e9f, 1e9f, 1e9f };   // every one must be overwritten
+        nbody::detail::brute_force_symmetric(pool, Simd(simd), blocking, sources, sums, bodies.data(), count, nbody::G);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            INFO("body " << i);
+            const float scale = std::max({ 1e-12f, std::abs(expected[i].x), std::abs(expected[i].y), std::abs(expected[i].z) });
+            REQUIRE(std::abs(bodies[i].acc.x - expected[i].x) <= 1e-4f * scale);
+            REQUIRE(std::abs(bodies[i].acc.y - expected[i].y) <= 1e-4f * scale);
+            REQUIRE(std::abs(bodies[i].acc.z - expected[i].z) <= 1e-4f * scale);
+        }
+    }
+}
@@ -1,4 +1,8 @@
 #include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
@@ -8,6 +12,11 @@
 // The GPU solver is the first one that keeps a representation of its own, so it is the
 // first real exercise of the State conversion protocol. Everything here skips cleanly
 // when no compute device is present.
+//
+// With NBODY_VK_VALIDATE set, every device runs under the Khronos validation layer and the
+// first error it reports ends the run. On a machine with no GPU, lavapipe stands in:
+//
+//     VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json NBODY_VK_VALIDATE=1 nbody_tests "[gpu]"
 namespace
 {
     bool skip_without_gpu(const nbody::Variant v)
@@ -116,6 +125,88 @@ TEST_CASE("stepping blind agrees with stepping while reading", "[sim][gpu]")
     REQUIRE(worst < 1e-3f);
 }
 
+TEST_CASE("steps queued ahead agree with steps waited on", "[sim][gpu]")
+{
+    const nbody::Variant v = GENERATE(nbody::Variant::GpuBruteForceSoA, nbody::Variant::GpuBarnesHutSoA);
+    const bool gpu_tree = GENERATE(false, true);
+    const int frames = GENERATE(2, 3);
+    INFO("variant: " << nbody::Sim::info(v).name << ", gpu tree: " << gpu_tree << ", frames: " << frames);
+    if (skip_without_gpu(v))
+        return;
+
+    // Queueing changes when the host waits, never what the device is given, so the two
+    // runs should end in the same place. A read and an edit partway through, to check the
+    // waits that do remain: the read has to see the step before it, and the edit must
+    // reach the device ahead of the steps after it rather than under them.
+    constexpr float dt = 0.02f;
+    constexpr size_t num = 4096;
+
+    nbody::Sim seed(v);
+    seed_disk(seed, num);
+    const std::vector<nbody::Body> initial = seed.bodies();
+
+    const auto run = [&](const int frames_in_flight, nbody::Vector& halfway)
+    {
+        nbody::Sim sim(v);
+        sim.set_gpu_tree(gpu_tree);
+        sim.set_frames_in_flight(frames_in_flight);
+        sim.mutable_bodies() = initial;
+        for (int i = 0; i < 8; ++i)
+            sim.update(dt);
+        halfway = sim.bodies()[7].pos;
+        sim.mutable_bodies()[7].vel = { 50.f, 0.f, 0.f };
+        for (int i = 0; i < 8; ++i)
+            sim.update(dt);
+        return sim.bodies();
+    };
+
+    nbody::Vector waited_halfway;
+    nbody::Vector queued_halfway;
+    const std::vector<nbody::Body> waited = run(1, waited_halfway);
+    const std::vector<nbody::Body> queued = run(frames, queued_halfway);
+
+    REQUIRE(waited.size() == queued.size());
+    REQUIRE(std::sqrt((waited_halfway - queued_halfway).size_sq()) < 1e-4f);
+
+    float worst = 0.f;
+    for (size_t i = 0; i < waited.size(); ++i)
+    {
+        worst = std::max(worst, std::sqrt((waited[i].pos - queued[i].pos).size_sq()));
+        worst = std::max(worst, std::sqrt((waited[i].vel - queued[i].vel).size_sq()));
+    }
+
+    INFO("worst divergence: " << worst);
+    REQUIRE(worst < 1e-3f);
+}
+
+TEST_CASE("the device times the segments of a step", "[sim][gpu]")
+{
+    const nbody::Variant v = GENERATE(nbody::Variant::GpuBarnesHut, nbody::Variant::GpuBruteForceSoA, nbody::Variant::GpuBarnesHutSoA);
+    const int frames = GENERATE(1, 3);
+    INFO("variant: " << nbody::Sim::info(v).name << ", frames: " << frames);
+    if (skip_without_gpu(v))
+        return;
+
+    nbody::Sim sim(v);
+    sim.set_gpu_tree(true);
+    sim.set_frames_in_flight(frames);
+    seed_disk(sim, 4096);
+    for (int i = 0; i < 4; ++i)
+        sim.update(0.02f);
+
+    // Asking waits for a queued step, so the numbers are never half a step's.
+    const nbody::StepStats stats = sim.stats();
+    REQUIRE(stats.steps == 1);
+    if (!stats.device_timed)
+        SKIP("the device's compute queue writes no timestamps");
+
+    REQUIRE(stats.accelerate > 0.);
+    REQUIRE(stats.integrate > 0.);
+    if (v != nbody::Variant::GpuBruteForceSoA)
+        REQUIRE(stats.tree > 0.);
+    REQUIRE(stats.compute() >= stats.accelerate + stats.integrate);
+}
+
 TEST_CASE("reading bodies materializes the device's work", "[sim][gpu]")
 {
     // Both body layouts, so the conversion protocol is checked for each rather than for
@@ -253,16 +344,81 @@ TEST_CASE("gpu barnes-hut agrees with cpu barnes-hut", "[sim][gpu]")
     REQUIRE(worst < 1e-2f);
 }
 
+TEST_CASE("a tree built on the device agrees with one built on the host", "[sim][gpu]")
+{
+    const nbody::Variant v = GENERATE(nbody::Variant::GpuBarnesHut, nbody::Variant::GpuBarnesHutSoA);
+    const bool quadrupole = GENERATE(false, true);
+    INFO("variant: " << nbody::Sim::info(v).name << ", quadrupole: " << quadrupole);
+    if (skip_without_gpu(v))
+        return;
+
+    // The device's build splits the same cells as the host's and keeps the bodies of each
+    // leaf in the same order, so only how the masses and moments are totalled separates the
+    // two. Enough bodies for the sort to span many tiles and the tree many levels.
+    constexpr size_t num = 20000;
+    nbody::Sim seed(v);
+    seed_disk(seed, num);
+    const std::vector<nbody::Body> initial = seed.bodies();
+
+    const auto run = [&](const bool gpu_tree)
+    {
+        nbody::Sim sim(v);
+        sim.set_gpu_tree(gpu_tree);
+        sim.set_quadrupole(quadrupole);
+        sim.mutable_bodies() = initial;
+        sim.accelerate();
+        return sim.bodies();
+    };
+
+    const std::vector<nbody::Body> host = run(false);
+    const std::vector<nbody::Body> device = run(true);
+
+    REQUIRE(host.size() == device.size());
+    REQUIRE(device[1].acc.size_sq() > 0.f);
+
+    const float worst = max_relative_acc_error(host, device);
+    INFO("worst relative acceleration error: " << worst);
+    REQUIRE(worst < 1e-3f);
+}
+
+TEST_CASE("a device-built tree is still there to look at", "[sim][gpu]")
+{
+    const nbody::Variant v = GENERATE(nbody::Variant::GpuBarnesHut, nbody::Variant::GpuBarnesHutSoA);
+    INFO("variant: " << nbody::Sim::info(v).name);
+    if (skip_without_gpu(v))
+        return;
+
+    // The device never sends its tree back; what tree() hands out is built from the bodies
+    // on request, and has to be of the bodies as they are after the step.
+    nbody::Sim sim(v);
+    sim.set_gpu_tree(true);
+    seed_disk(sim, 4096);
+    for (int i = 0; i < 4; ++i)
+        sim.update(.01f);
+
+    const nbody::bh::Tree* tree = sim.tree();
+    REQUIRE(tree != nullptr);
+
+    float mass = 0.f;
+    for (const nbody::Body& body : sim.bodies())
+        mass += body.mass;
+    REQUIRE(std::abs(tree->nodes()[0].mass - mass) <= 1e-4f * mass);
+    REQUIRE(tree->points().size() == sim.bodies().size());
+}
+
 TEST_CASE("gpu brute force agrees with cpu brute force", "[sim][gpu]")
 {
     // Both are exact summations, so this is the strongest agreement check available.
+    // Counts that fill the device's tiles exactly, leave the last workgroup part empty, and
+    // leave most of one workgroup empty.
     const nbody::Variant gpu = GENERATE(nbody::Variant::GpuBruteForce, nbody::Variant::GpuBruteForceSoA);
-    INFO("variant: " << nbody::Sim::info(gpu).name);
+    const size_t num = GENERATE(size_t(1024), size_t(700), size_t(3));
+    INFO("variant: " << nbody::Sim::info(gpu).name << ", bodies: " << num);
     if (skip_without_gpu(gpu))
         return;
 
     nbody::Sim sim(nbody::Variant::CpuBruteForce);
-    seed_disk(sim, 1024);
+    seed_disk(sim, num);
 
     sim.accelerate();
     const std::vector<nbody::Body> cpu = sim.bodies();
@@ -360,3 +516,66 @@ TEST_CASE("switching between gpu variants reuses one device", "[sim][gpu]")
 
     REQUIRE(sim.bodies().size() == 512);
 }
+
+TEST_CASE("the pipeline cache is written once and passed over when it is not the device's", "[sim][gpu]")
+{
+    const nbody::Variant v = nbody::Variant::GpuBruteForce;
+    if (skip_without_gpu(v))
+        return;
+
+    namespace fs = std::filesystem;
+    const fs::path directory = fs::temp_directory_path() / ("nbody-pipelines-" + std::to_string(std::random_device()()));
+    // The setting is process-wide: put it back, and the directory away, however this ends,
+    // or every GPU test after a failure here would write its caches into the leftover.
+    struct Restore
+    {
+        std::string previous;
+        fs::path directory;
+        ~Restore()
+        {
+            nbody::Sim::set_pipeline_cache_dir(previous);
+            std::error_code error;
+            fs::remove_all(directory, error);
+        }
+    } restore{ nbody::Sim::pipeline_cache_dir(), directory };
+    nbody::Sim::set_pipeline_cache_dir(directory.string());
+
+    const auto files = [&directory]
+    {
+        std::vector<fs::path> found;
+        if (fs::exists(directory))
+            for (const fs::directory_entry& entry : fs::directory_iterator(directory))
+                found.push_back(entry.path());
+        return found;
+    };
+
+    // Each Sim brings up a device of its own, as a process of its own would.
+    const auto step = [v]
+    {
+        nbody::Sim sim(v);
+        REQUIRE(sim.variant() == v);
+        seed_disk(sim, 512);
+        sim.update(0.02f);
+        REQUIRE(sim.bodies()[1].acc.size_sq() > 0.f);
+    };
+
+    step();
+    const std::vector<fs::path> written = files();
+    REQUIRE(written.size() == 1);
+    const uintmax_t size = fs::file_size(written[0]);
+    REQUIRE(size > 32);   // more than the header
+
+    // Read, not written again, and nothing left lying beside it.
+    step();
+    REQUIRE(files() == written);
+    REQUIRE(fs::file_size(written[0]) == size);
+
+    // A file that is no cache of this device's is ignored, and replaced by one that is.
+    {
+        std::ofstream file(written[0], std::ios::binary | std::ios::trunc);
+        file << "not a pipeline cache";
+    }
+    step();
+    REQUIRE(files() == written);
+    REQUIRE(fs::file_size(written[0]) > 32);
+}
@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 #include "BS_thread_pool.hpp"
 #include "detail/parallel.h"
+#include "detail/placement.h"
+#include "nbody/sim.h"
+#include "nbody/util.h"
 
 // The partitioning in the old Sim::visit() dropped the trailing n % num_threads
 // elements, and processed nothing at all when n < num_threads. On a 128-core machine
@@ -60,3 +65,116 @@ TEST_CASE("parallel_blocks covers the whole range exactly once", "[parallel]")
     for (const std::atomic<int>& hit : hits)
         REQUIRE(hit.load() == 1);
 }
+
+TEST_CASE("parallel_reduce folds every block exactly once", "[parallel]")
+{
+    BS::thread_pool pool;
+
+    const size_t n = GENERATE(size_t{0}, 1, 5, 127, 128, 129, 1000);
+
+    // The blocks' sums of their indices, so a block dropped, repeated or overlapping another
+    // shows in the total.
+    const size_t total = nbody::detail::parallel_reduce(pool, n, size_t{0},
+        [](const size_t begin, const size_t end)
+        {
+            size_t sum = 0;
+            for (size_t i = begin; i < end; ++i)
+                sum += i;
+            return sum;
+        },
+        [](const size_t a, const size_t b) { return a + b; });
+
+    REQUIRE(total == (n == 0 ? 0 : n * (n - 1) / 2));
+}
+
+// Cuts by cost: each range within one index's cost of an equal share, whatever the spread,
+// and the reduce over them folds every index once.
+TEST_CASE("balanced cuts split a range by cost", "[parallel]")
+{
+    BS::thread_pool pool;
+
+    const size_t n = GENERATE(size_t{0}, 1, 5, 129, 1000);
+    const size_t blocks = GENERATE(size_t{1}, 3, 8, 64);
+
+    // Costs rising steeply towards one end, as the groups at the middle of a disk do, with
+    // one index that outweighs a share by itself.
+    std::vector<uint64_t> offsets = { 0 };
+    uint64_t heaviest = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const uint64_t cost = i == n / 2 ? 50 * n : 1 + i * i / 64;
+        heaviest = std::max(heaviest, cost);
+        offsets.push_back(offsets.back() + cost);
+    }
+
+    const std::vector<size_t> cuts = nbody::detail::balanced_cuts(offsets, blocks);
+    REQUIRE(cuts.front() == 0);
+    REQUIRE(cuts.back() == n);
+    REQUIRE(cuts.size() <= blocks + 1);
+    for (size_t b = 0; b + 1 < cuts.size(); ++b)
+    {
+        INFO("range " << b << ": [" << cuts[b] << ", " << cuts[b + 1] << ")");
+        REQUIRE(cuts[b] < cuts[b + 1]);
+        REQUIRE(offsets[cuts[b + 1]] - offsets[cuts[b]] <= offsets.back() / blocks + heaviest);
+    }
+
+    const size_t total = nbody::detail::parallel_reduce_cuts(pool, cuts, size_t{0},
+        [](const size_t begin, const size_t end)
+        {
+            size_t sum = 0;
+            for (size_t i = begin; i < end; ++i)
+                sum += i;
+            return sum;
+        },
+        [](const size_t a, const size_t b) { return a + b; });
+    REQUIRE(total == (n == 0 ? 0 : n * (n - 1) / 2));
+}
+
+// Two nodes of unequal size, as a host with cpus offlined or outside the process's affinity
+// can have. Compact takes them node by node, Spread alternates until the smaller runs out.
+TEST_CASE("placements order the cpus by node", "[parallel]")
+{
+    const std::vector<std::vector<int>> nodes = { { 0, 1, 2 }, { 8, 9, 10, 11, 12 } };
+    REQUIRE(nbody::detail::placement_cpus(nbody::Placement::Unpinned, nodes).empty());
+    REQUIRE(nbody::detail::placement_cpus(nbody::Placement::Compact, nodes) == std::vector<int>{ 0, 1, 2, 8, 9, 10, 11, 12 });
+    REQUIRE(nbody::detail::placement_cpus(nbody::Placement::Spread, nodes) == std::vector<int>{ 0, 8, 1, 9, 2, 10, 11, 12 });
+
+    // Whatever this host is, it has a cpu to run on, and no cpu twice.
+    std::vector<int> cpus;
+    for (const std::vector<int>& node : nbody::detail::numa_cpus())
+    {
+        REQUIRE_FALSE(node.empty());
+        cpus.insert(cpus.end(), node.begin(), node.end());
+    }
+    REQUIRE_FALSE(cpus.empty());
+    std::sort(cpus.begin(), cpus.end());
+    REQUIRE(std::adjacent_find(cpus.begin(), cpus.end()) == cpus.end());
+}
+
+// Placement moves threads and pages, never a result: the same steps, bit for bit.
+TEST_CASE("every placement steps the same bodies", "[parallel]")
+{
+    const auto stepped = [](const nbody::Placement placement)
+    {
+        nbody::Sim sim(nbody::Variant::CpuBarnesHut, placement);
+        REQUIRE(sim.placement() == placement);
+        sim.mutable_bodies().resize(3000);
+        nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100.f });
+        for (int step = 0; step < 5; ++step)
+            sim.update(1.f / 60.f);
+        return sim.bodies();
+    };
+
+    const std::vector<nbody::Body> unpinned = stepped(nbody::Placement::Unpinned);
+    for (const nbody::Placement placement : { nbody::Placement::Compact, nbody::Placement::Spread })
+    {
+        const std::vector<nbody::Body> placed = stepped(placement);
+        REQUIRE(placed.size() == unpinned.size());
+        for (size_t i = 0; i < placed.size(); ++i)
+        {
+            INFO("placement " << int(placement) << ", body " << i);
+            REQUIRE(placed[i].pos == unpinned[i].pos);
+            REQUIRE(placed[i].vel == unpinned[i].vel);
+        }
+    }
+}
@@ -1,11 +1,15 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <numeric>
+#include <optional>
+#include <random>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 #include "nbody/sim.h"
 #include "nbody/util.h"
+#include "detail/physics.h"
 
 namespace
 {
@@ -107,3 +111,346 @@ TEST_CASE("every body is integrated regardless of body count", "[sim]")
     for (size_t i = first_star; i < sim.bodies().size(); ++i)
         REQUIRE(sim.bodies()[i].pos.dist_sq(before[i]) > 0.f);
 }
+
+TEST_CASE("leapfrog holds energy at a step euler cannot", "[sim]")
+{
+    // The disk of the orbit test at four times its step: about 100 steps an orbit. Semi-
+    // implicit euler keeps its orbits bounded too, but its velocities run half a step out
+    // of phase with its positions, so the energy it reports swings by a share that grows
+    // with the step. Leapfrog's are synchronized, and its error is second order.
+    const auto energy = [](const std::vector<nbody::Body>& bodies)
+    {
+        double total = 0;
+        for (size_t i = 0; i < bodies.size(); ++i)
+        {
+            total += .5 * bodies[i].mass * bodies[i].vel.size_sq();
+            for (size_t j = i + 1; j < bodies.size(); ++j)
+                total -= nbody::G * bodies[i].mass * bodies[j].mass / std::sqrt(bodies[i].pos.dist_sq(bodies[j].pos));
+        }
+        return total;
+    };
+
+    const auto worst_drift = [&energy](const nbody::Integrator integrator)
+    {
+        nbody::Sim sim;
+        sim.set_integrator(integrator);
+        sim.mutable_bodies().resize(16);
+        nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100 });
+
+        const double initial = energy(sim.bodies());
+        double worst = 0;
+        for (size_t step = 0; step < 100; ++step)
+        {
+            sim.update(1.f / 30.f);
+            worst = std::max(worst, std::abs(energy(sim.bodies()) - initial) / std::abs(initial));
+        }
+        return worst;
+    };
+
+    const double euler = worst_drift(nbody::Integrator::Euler);
+    const double leapfrog = worst_drift(nbody::Integrator::Leapfrog);
+    INFO("worst relative energy drift, euler " << euler << ", leapfrog " << leapfrog);
+    REQUIRE(leapfrog < euler / 4);
+    REQUIRE(leapfrog < 1e-3);
+}
+
+TEST_CASE("hierarchical timesteps refine only the bodies that need it", "[sim]")
+{
+    // The disk again, at a base step of an eighth of a second, some 25 steps an orbit at the
+    // rim, and fewer nearer in. Leapfrog at that step loses the inner orbits; block steps give
+    // each star a level of its own and keep them, for a fraction of the force sums of
+    // stepping everything at the finest level.
+    const auto run = [](const nbody::Integrator integrator, std::vector<float>& drifts)
+    {
+        nbody::Sim sim;
+        sim.set_integrator(integrator);
+        sim.mutable_bodies().resize(64);
+        nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100 });
+
+        std::vector<float> initial;
+        for (const nbody::Body& body : sim.bodies())
+            initial.push_back(radius_of(body));
+        for (size_t step = 0; step < 25; ++step)
+            sim.update(1.f / 8.f);
+
+        drifts.clear();
+        for (size_t i = first_star; i < sim.bodies().size(); ++i)
+            drifts.push_back(std::abs(radius_of(sim.bodies()[i]) - initial[i]) / initial[i]);
+    };
+
+    std::vector<float> leapfrog;
+    std::vector<float> hierarchical;
+    run(nbody::Integrator::Leapfrog, leapfrog);
+    run(nbody::Integrator::Hierarchical, hierarchical);
+
+    const float leapfrog_worst = *std::max_element(leapfrog.begin(), leapfrog.end());
+    const float hierarchical_worst = *std::max_element(hierarchical.begin(), hierarchical.end());
+    INFO("worst radial drift, leapfrog " << leapfrog_worst << ", hierarchical " << hierarchical_worst);
+    REQUIRE(hierarchical_worst < 0.05f);
+    REQUIRE(hierarchical_worst < leapfrog_worst / 4);
+}
+
+TEST_CASE("a body's timestep level follows how fast its velocity turns", "[sim]")
+{
+    nbody::Body body{ .vel = { 1.f, 0.f, 0.f } };
+    body.acc = { 0.f, 0.f, 0.f };
+    REQUIRE(nbody::detail::timestep_level(body, 1.f, .1f, 8) == 0);   // unaccelerated
+
+    // |v| / |a| = 1, so a step of .1 is the most the accuracy allows: one of 1 needs four
+    // halvings, to 1/16.
+    body.acc = { 0.f, 1.f, 0.f };
+    REQUIRE(nbody::detail::timestep_level(body, 1.f, .1f, 8) == 4);
+    REQUIRE(nbody::detail::timestep_level(body, .1f, .1f, 8) == 0);
+
+    // Eight times the acceleration, three levels deeper; and never past the deepest.
+    body.acc = { 0.f, 8.f, 0.f };
+    REQUIRE(nbody::detail::timestep_level(body, 1.f, .1f, 8) == 7);
+    REQUIRE(nbody::detail::timestep_level(body, 1.f, .1f, 5) == 5);
+
+    body.vel = { 0.f, 0.f, 0.f };
+    REQUIRE(nbody::detail::timestep_level(body, 1.f, .1f, 8) == 8);   // at rest
+}
+
+TEST_CASE("run_until lands on the time asked for", "[sim]")
+{
+    nbody::Sim sim;
+    sim.mutable_bodies().resize(32);
+    nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100 });
+
+    sim.update(.25f);
+    sim.integrate(.25f);
+    REQUIRE(sim.time() == .5);
+
+    // A third is no float and no sum of steps of one, so only the landing gets it exactly.
+    const size_t steps = sim.run_until(1.5 + 1. / 3., .1f);
+    REQUIRE(sim.time() == 1.5 + 1. / 3.);
+    REQUIRE(steps >= 14);
+
+    // Already there: nothing to do.
+    REQUIRE(sim.run_until(1., .1f) == 0);
+    REQUIRE(sim.time() == 1.5 + 1. / 3.);
+
+    // A bound that allows no step stops the run rather than spinning on it.
+    sim.set_timestep_eta(0);
+    REQUIRE(sim.run_until(10., .1f) == 0);
+    REQUIRE(sim.time() == 1.5 + 1. / 3.);
+}
+
+TEST_CASE("adaptive steps shorten through a close encounter", "[sim]")
+{
+    // A light body on an orbit of eccentricity .9 about a heavy one: it closes from 50 to
+    // some 2.6 and back, and its acceleration grows 360-fold on the way in. A step short
+    // enough for the close pass over-resolves the rest of the orbit; one long enough for
+    // the rest misses the close pass. The adaptive step, for the same number of force sums,
+    // gets both.
+    const float G = nbody::G;
+    const float heavy = 1000.f;
+    const float apocentre = 50.f;
+    const float speed = std::sqrt(G * heavy * (1.f - .9f) / apocentre);
+    const std::vector<nbody::Body> initial = {
+        nbody::Body{ .pos = { 0.f, 0.f, 0.f }, .radius = .5f, .mass = heavy },
+        nbody::Body{ .pos = { apocentre, 0.f, 0.f }, .radius = .5f, .vel = { 0.f, speed, 0.f }, .mass = 1.f },
+    };
+    const auto energy = [G](const std::vector<nbody::Body>& bodies)
+    {
+        double total = -G * bodies[0].mass * bodies[1].mass / std::sqrt(bodies[0].pos.dist_sq(bodies[1].pos));
+        for (const nbody::Body& body : bodies)
+            total += .5 * body.mass * body.vel.size_sq();
+        return total;
+    };
+
+    // Three orbits, at a period of 2 pi sqrt(a^3 / GM) with a = apocentre / 1.9.
+    const double a = apocentre / 1.9;
+    const double duration = 3 * 2 * 3.14159265358979 * std::sqrt(a * a * a / (G * heavy));
+    const float max_dt = .5f;
+
+    nbody::Sim adaptive;
+    adaptive.set_integrator(nbody::Integrator::Leapfrog);
+    adaptive.set_timestep_eta(.1f);
+    adaptive.set_wrap(false);
+    adaptive.mutable_bodies() = initial;
+    const double initial_energy = energy(adaptive.bodies());
+
+    float shortest = max_dt;
+    float longest = 0;
+    double adaptive_worst = 0;
+    size_t steps = 0;
+    while (adaptive.time() < duration)
+    {
+        const float cap = std::min<float>(max_dt, float(duration - adaptive.time()));
+        const float dt = adaptive.step(cap);
+        if (dt < cap)   // cut by the bound, not by the end of the run
+        {
+            shortest = std::min(shortest, dt);
+            longest = std::max(longest, dt);
+        }
+        adaptive_worst = std::max(adaptive_worst, std::abs(energy(adaptive.bodies()) - initial_energy) / std::abs(initial_energy));
+        ++steps;
+    }
+
+    nbody::Sim fixed;
+    fixed.set_integrator(nbody::Integrator::Leapfrog);
+    fixed.set_wrap(false);
+    fixed.mutable_bodies() = initial;
+    double fixed_worst = 0;
+    for (size_t step = 0; step < steps; ++step)
+    {
+        fixed.update(float(duration / double(steps)));
+        fixed_worst = std::max(fixed_worst, std::abs(energy(fixed.bodies()) - initial_energy) / std::abs(initial_energy));
+    }
+
+    INFO(steps << " steps from " << shortest << " to " << longest << "; worst relative energy error, adaptive "
+        << adaptive_worst << ", fixed " << fixed_worst);
+    REQUIRE(longest > 10 * shortest);
+    REQUIRE(adaptive_worst < fixed_worst / 10);
+    REQUIRE(adaptive_worst < 1e-2);
+}
+
+TEST_CASE("double precision keeps a slow body moving near the edge", "[sim]")
+{
+    // Half a unit inside the edge of a world of 10000, a body moving 3.75e-4 a step. Floats
+    // are 4.9e-4 apart there, and the wrap shifts by half the world to 9.8e-4 apart, so in
+    // single each step rounds away to nothing and the body never moves. In double it moves as
+    // it should, across the edge and around to the far side.
+    const auto error = [](const nbody::Precision precision, const nbody::Integrator integrator)
+    {
+        nbody::Sim sim;
+        sim.set_precision(precision);
+        sim.set_integrator(integrator);
+        sim.mutable_bodies() = { nbody::Body{ .pos = { 4999.5f, 0.f, 0.f }, .vel = { .003f, 0.f, 0.f }, .mass = 1.f } };
+        for (int step = 0; step < 2000; ++step)
+            sim.update(1.f / 8.f);
+        return std::abs(sim.bodies()[0].pos.x - -4999.75f);
+    };
+
+    for (const nbody::Integrator integrator : { nbody::Integrator::Euler, nbody::Integrator::Leapfrog, nbody::Integrator::Hierarchical })
+    {
+        const float single = error(nbody::Precision::Single, integrator);
+        const float twice = error(nbody::Precision::Double, integrator);
+        INFO("integrator " << int(integrator) << ": error in single " << single << ", in double " << twice);
+        REQUIRE(single > .1f);
+        REQUIRE(twice < 1e-3f);
+    }
+}
+
+TEST_CASE("double precision starts again from bodies the caller changes", "[sim]")
+{
+    nbody::Sim sim;
+    sim.set_precision(nbody::Precision::Double);
+    sim.mutable_bodies() = { nbody::Body{ .pos = { 10.f, 0.f, 0.f }, .vel = { 1.f, 0.f, 0.f }, .mass = 1.f } };
+    sim.update(1.f);
+    REQUIRE(sim.bodies()[0].pos.x == 11.f);
+
+    // The doubles must not carry on from 11 over the caller's write.
+    sim.mutable_bodies()[0].pos.x = -20.f;
+    sim.update(1.f);
+    REQUIRE(sim.bodies()[0].pos.x == -19.f);
+
+    // Nor from -19 after a stretch in single.
+    sim.set_precision(nbody::Precision::Single);
+    sim.update(1.f);
+    sim.set_precision(nbody::Precision::Double);
+    sim.update(1.f);
+    REQUIRE(sim.bodies()[0].pos.x == -17.f);
+}
+
+TEST_CASE("reordering keeps every body and brings neighbours together", "[sim]")
+{
+    // A shuffled disk: neighbours in memory are no nearer each other than any two bodies.
+    nbody::Sim sim;
+    sim.mutable_bodies().resize(4096);
+    nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100.f });
+    std::shuffle(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), std::mt19937(3));
+    const std::vector<nbody::Body> original = sim.bodies();
+
+    const auto mean_gap = [](const std::vector<nbody::Body>& bodies)
+    {
+        double sum = 0;
+        for (size_t i = 1; i < bodies.size(); ++i)
+            sum += std::sqrt(bodies[i].pos.dist_sq(bodies[i - 1].pos));
+        return sum / double(bodies.size() - 1);
+    };
+
+    // None yet: the identity.
+    std::vector<uint32_t> identity(original.size());
+    std::iota(identity.begin(), identity.end(), 0u);
+    REQUIRE(std::ranges::equal(sim.permutation(), identity));
+
+    sim.reorder();
+    const std::span<const uint32_t> permutation = sim.permutation();
+    REQUIRE(permutation.size() == original.size());
+    std::vector<uint32_t> seen(permutation.begin(), permutation.end());
+    std::ranges::sort(seen);
+    REQUIRE(seen == identity);
+    for (size_t i = 0; i < original.size(); ++i)
+    {
+        INFO("body " << i);
+        REQUIRE(sim.bodies()[i].pos == original[permutation[i]].pos);
+        REQUIRE(sim.bodies()[i].mass == original[permutation[i]].mass);
+    }
+
+    INFO("mean gap shuffled " << mean_gap(original) << ", reordered " << mean_gap(sim.bodies()));
+    REQUIRE(mean_gap(sim.bodies()) < mean_gap(original) / 4);
+
+    // Appended bodies take the next indices, and a second reorder composes with the first.
+    sim.mutable_bodies().push_back(nbody::Body{ .pos = { 1.f, 2.f, 3.f }, .mass = 1.f });
+    REQUIRE(sim.permutation().back() == original.size());
+    sim.reorder();
+    const auto appended = std::ranges::find(sim.permutation(), uint32_t(original.size()));
+    REQUIRE(appended != sim.permutation().end());
+    REQUIRE(sim.bodies()[size_t(appended - sim.permutation().begin())].pos == nbody::Vector{ 1.f, 2.f, 3.f });
+    for (size_t i = 0; i < sim.bodies().size(); ++i)
+        if (sim.permutation()[i] < original.size())
+            REQUIRE(sim.bodies()[i].pos == original[sim.permutation()[i]].pos);
+
+    // Fewer bodies than before: no telling which went, so the count starts over.
+    sim.mutable_bodies().pop_back();
+    REQUIRE(std::ranges::equal(sim.permutation(), identity));
+}
+
+TEST_CASE("body ids follow their bodies through reorders and removals", "[sim]")
+{
+    std::vector<nbody::Body> disk(1000);
+    nbody::util::disk(disk.begin(), disk.end(), { .outer_radius = 100.f });
+    std::shuffle(disk.begin(), disk.end(), std::mt19937(5));
+    nbody::Sim sim;
+    sim.mutable_bodies() = disk;
+
+    // Numbered in order, from one.
+    for (size_t i = 0; i < sim.bodies().size(); ++i)
+        REQUIRE(sim.bodies()[i].id == i + 1);
+    REQUIRE_FALSE(sim.index_of(0).has_value());
+    REQUIRE_FALSE(sim.index_of(1001).has_value());
+
+    const nbody::Body tracked = sim.bodies()[123];
+    sim.reorder();
+    const std::optional<size_t> moved = sim.index_of(tracked.id);
+    REQUIRE(moved.has_value());
+    REQUIRE(*moved != 123);
+    REQUIRE(sim.bodies()[*moved].pos == tracked.pos);
+
+    // Removing a body leaves every other where index_of() says, and its id unused for good.
+    const uint32_t gone = sim.bodies()[0].id;
+    sim.mutable_bodies().erase(sim.mutable_bodies().begin());
+    REQUIRE_FALSE(sim.index_of(gone).has_value());
+    REQUIRE(sim.bodies()[*sim.index_of(tracked.id)].pos == tracked.pos);
+
+    // A copy of a body takes a fresh id, as do one with none and one with an id never given.
+    sim.mutable_bodies().push_back(tracked);
+    sim.mutable_bodies().push_back(nbody::Body{ .mass = 1.f });
+    sim.mutable_bodies().push_back(nbody::Body{ .mass = 1.f, .id = 5000 });
+    const std::vector<nbody::Body>& bodies = sim.bodies();
+    REQUIRE(bodies[*sim.index_of(tracked.id)].pos == tracked.pos);
+    REQUIRE(*sim.index_of(tracked.id) < bodies.size() - 3);
+    REQUIRE(bodies[bodies.size() - 3].id == 1001);
+    REQUIRE(bodies[bodies.size() - 2].id == 1002);
+    REQUIRE(bodies[bodies.size() - 1].id == 1003);
+    REQUIRE(*sim.index_of(1003) == bodies.size() - 1);
+
+    // And stepping, which moves bodies but never between slots, leaves them all in place.
+    sim.set_reorder_every(2);
+    for (int step = 0; step < 5; ++step)
+        sim.update(1.f / 60.f);
+    for (size_t i = 0; i < sim.bodies().size(); ++i)
+        REQUIRE(*sim.index_of(sim.bodies()[i].id) == i);
+}
@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <optional>
 #include <vector>
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 #include "nbody/sim.h"
 #include "nbody/util.h"
 
@@ -11,6 +15,29 @@ namespace
         sim.mutable_bodies().resize(num);
         nbody::util::disk(sim.mutable_bodies().begin(), sim.mutable_bodies().end(), { .outer_radius = 100.f });
     }
+
+    // A close binary on a hierarchical step's finest level among bodies far off on its
+    // coarsest, so that the sub-steps between sum the binary alone. None has a radius.
+    void seed_binary(nbody::Sim& sim)
+    {
+        std::vector<nbody::Body>& bodies = sim.mutable_bodies();
+        bodies.resize(42);
+        for (size_t i = 0; i < bodies.size(); ++i)
+            bodies[i].radius = 0.f;
+        bodies[0].pos = { -1.f, 0.f, 0.f };
+        bodies[0].vel = { 0.f, -.5f, 0.f };
+        bodies[0].mass = 1.f;
+        bodies[1].pos = { 1.f, 0.f, 0.f };
+        bodies[1].vel = { 0.f, .5f, 0.f };
+        bodies[1].mass = 1.f;
+        for (size_t i = 2; i < bodies.size(); ++i)
+        {
+            const float angle = 2.f * nbody::pi * float(i) / float(bodies.size() - 2);
+            bodies[i].pos = { 200.f * std::cos(angle), 200.f * std::sin(angle), 0.f };
+            bodies[i].vel = { 0.f, 0.f, .01f };
+            bodies[i].mass = 1e-3f;
+        }
+    }
 }
 
 TEST_CASE("state survives a variant round trip", "[sim][variant]")
@@ -60,6 +87,15 @@ TEST_CASE("settings carry across a variant switch", "[sim][variant]")
     sim.set_theta(0.25f);
     sim.set_gravity(2.f);
     sim.set_wrap(false);
+    sim.set_quadrupole(true);
+    sim.set_block_targets(64);
+    sim.set_block_sources(512);
+    sim.set_symmetric(true);
+    sim.set_timestep_eta(.3f);
+    sim.set_time(42.);
+    sim.set_reorder_every(16);
+    sim.set_gpu_tree(true);
+    sim.set_frames_in_flight(3);
 
     REQUIRE(sim.set_variant(nbody::Variant::CpuBruteForce));
 
@@ -67,6 +103,15 @@ TEST_CASE("settings carry across a variant switch", "[sim][variant]")
     REQUIRE(sim.theta() == 0.25f);
     REQUIRE(sim.gravity() == 2.f);
     REQUIRE(sim.wrap() == false);
+    REQUIRE(sim.quadrupole() == true);
+    REQUIRE(sim.block_targets() == 64);
+    REQUIRE(sim.block_sources() == 512);
+    REQUIRE(sim.symmetric() == true);
+    REQUIRE(sim.timestep_eta() == .3f);
+    REQUIRE(sim.time() == 42.);
+    REQUIRE(sim.reorder_every() == 16);
+    REQUIRE(sim.gpu_tree() == true);
+    REQUIRE(sim.frames_in_flight() == 3);
 }
 
 TEST_CASE("switching to an unavailable variant is a no-op with a reason", "[sim][variant]")
@@ -215,6 +260,89 @@ TEST_CASE("barnes-hut approximates brute force", "[sim][variant]")
     REQUIRE(mean_error < 0.05);
 }
 
+TEST_CASE("quadrupole barnes-hut holds its error budget at a wider angle", "[sim][variant]")
+{
+    // The point of the quadrupole term: the same accuracy as the monopole at theta .5 while
+    // opening fewer nodes.
+    const size_t num = 512;
+
+    nbody::Sim sim;
+    seed_disk(sim, num);
+
+    REQUIRE(sim.set_variant(nbody::Variant::CpuBruteForce));
+    sim.accelerate();
+    const std::vector<nbody::Body> exact = sim.bodies();
+
+    REQUIRE(sim.set_variant(nbody::Variant::CpuBarnesHut));
+    sim.set_theta(.9f);
+    sim.set_quadrupole(true);
+    sim.accelerate();
+    const std::vector<nbody::Body> approx = sim.bodies();
+
+    REQUIRE(exact.size() == approx.size());
+
+    double total_error = 0;
+    size_t counted = 0;
+    for (size_t i = 0; i < exact.size(); ++i)
+    {
+        const float mag = std::sqrt(exact[i].acc.size_sq());
+        if (mag <= 0.f)
+            continue;
+        const nbody::Vector delta = approx[i].acc - exact[i].acc;
+        total_error += std::sqrt(delta.size_sq()) / mag;
+        ++counted;
+    }
+
+    REQUIRE(counted > 0);
+    const double mean_error = total_error / double(counted);
+    INFO("mean relative acceleration error: " << mean_error);
+    REQUIRE(mean_error < 0.05);
+}
+
+TEST_CASE("fmm approximates brute force", "[sim][variant]")
+{
+    // The same budget barnes-hut is held to, and a higher order should only tighten it.
+    // Enough bodies that most of the force arrives through the expansions rather than leaf
+    // to leaf.
+    const size_t num = 8192;
+
+    nbody::Sim sim;
+    seed_disk(sim, num);
+
+    REQUIRE(sim.set_variant(nbody::Variant::CpuBruteForce));
+    sim.accelerate();
+    const std::vector<nbody::Body> exact = sim.bodies();
+
+    REQUIRE(sim.set_variant(nbody::Variant::CpuFmm));
+    const auto mean_error = [&](const int order)
+    {
+        sim.set_fmm_order(order);
+        sim.accelerate();
+        const std::vector<nbody::Body>& approx = sim.bodies();
+        REQUIRE(exact.size() == approx.size());
+
+        double total_error = 0;
+        size_t counted = 0;
+        for (size_t i = 0; i < exact.size(); ++i)
+        {
+            const float mag = std::sqrt(exact[i].acc.size_sq());
+            if (mag <= 0.f)
+                continue;
+            const nbody::Vector delta = approx[i].acc - exact[i].acc;
+            total_error += std::sqrt(delta.size_sq()) / mag;
+            ++counted;
+        }
+        REQUIRE(counted > 0);
+        return total_error / double(counted);
+    };
+
+    const double low = mean_error(2);
+    const double high = mean_error(4);
+    INFO("mean relative acceleration error: order 2 " << low << ", order 4 " << high);
+    REQUIRE(low < 0.05);
+    REQUIRE(high < low);
+}
+
 TEST_CASE("every variant tolerates bodies with no radius", "[sim][variant]")
 {
     // Body::radius defaults to 0, and only brute force can skip self by index, so a body
@@ -290,3 +418,397 @@ TEST_CASE("every variant steps with no bodies", "[sim][variant]")
     }
     REQUIRE(tested >= 2);
 }
+
+TEST_CASE("fused barnes-hut update matches accelerate then integrate", "[sim][variant]")
+{
+    // CpuBarnesHutSolver::update() integrates each group as soon as its forces are summed.
+    // The forces read only the tree, so that must be the two passes exactly, bit for bit,
+    // massless bodies and all.
+    const bool quadrupole = GENERATE(false, true);
+    nbody::Sim fused;
+    nbody::Sim split;
+    for (nbody::Sim* sim : { &fused, &split })
+    {
+        seed_disk(*sim, 2048);
+        sim->mutable_bodies()[7].mass = 0;
+        sim->set_quadrupole(quadrupole);
+    }
+
+    const float dt = 1.f / 120.f;
+    for (int i = 0; i < 5; ++i)
+    {
+        fused.update(dt);
+        split.accelerate();
+        split.integrate(dt);
+    }
+
+    REQUIRE(fused.bodies().size() == split.bodies().size());
+    for (size_t i = 0; i < fused.bodies().size(); ++i)
+    {
+        INFO("body " << i);
+        REQUIRE(fused.bodies()[i].pos == split.bodies()[i].pos);
+        REQUIRE(fused.bodies()[i].vel == split.bodies()[i].vel);
+        REQUIRE(fused.bodies()[i].acc == split.bodies()[i].acc);
+    }
+}
+
+TEST_CASE("every variant steps leapfrog as kick-drift-kick", "[sim][variant]")
+{
+    // A light body on a loose orbit about a heavy one, stepped by each variant with
+    // State::integrator at leapfrog and, alongside, by hand. Two bodies are summed exactly
+    // by every variant, so any difference is in the stepping: a missed opening kick, a
+    // stale force, a drift where there should be none.
+    const float dt = 1.f / 30.f;
+    const float G = nbody::G;
+    const auto accelerations = [G](std::vector<nbody::Body>& bodies)
+    {
+        for (size_t i = 0; i < bodies.size(); ++i)
+        {
+            const nbody::Vector delta = bodies[1 - i].pos - bodies[i].pos;
+            const float d_sq = delta.size_sq();
+            bodies[i].acc = G * bodies[1 - i].mass * delta / (std::sqrt(d_sq) * d_sq);
+        }
+    };
+
+    std::vector<nbody::Body> expected = {
+        nbody::Body{ .pos = { 0.f, 0.f, 0.f }, .mass = 1000.f },
+        nbody::Body{ .pos = { 50.f, 0.f, 0.f }, .vel = { 0.f, 3.f, 0.f }, .mass = 1.f },
+    };
+    const std::vector<nbody::Body> initial = expected;
+
+    accelerations(expected);
+    for (int step = 0; step < 20; ++step)
+    {
+        for (nbody::Body& body : expected)
+        {
+            body.vel += body.acc * (.5f * dt);
+            body.pos += body.vel * dt;
+        }
+        accelerations(expected);
+        for (nbody::Body& body : expected)
+            body.vel += body.acc * (.5f * dt);
+    }
+
+    size_t tested = 0;
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        INFO(info.name);
+        ++tested;
+
+        nbody::Sim sim(info.variant);
+        sim.set_integrator(nbody::Integrator::Leapfrog);
+        sim.mutable_bodies() = initial;
+        for (int step = 0; step < 20; ++step)
+            sim.update(dt);
+
+        // Loose: the GPU's reciprocal square root, and the order of the host's own sums.
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            const nbody::Body& body = sim.bodies()[i];
+            REQUIRE(std::sqrt(body.pos.dist_sq(expected[i].pos)) < 1e-3f * 50.f);
+            REQUIRE(std::sqrt(body.vel.dist_sq(expected[i].vel)) < 1e-3f * 3.f);
+        }
+    }
+    REQUIRE(tested >= 3);
+}
+
+TEST_CASE("hierarchical steps with one level are leapfrog ones", "[sim][variant]")
+{
+    // With State::timestep_levels at zero every body takes the whole step, and the block
+    // scheme has nothing left to do but kick, drift and kick: the same arithmetic as
+    // leapfrog, so the same bodies bit for bit, on every variant that implements it.
+    for (const nbody::Variant variant : { nbody::Variant::CpuBarnesHut, nbody::Variant::CpuBruteForce, nbody::Variant::CpuFmm })
+    {
+        INFO(nbody::Sim::info(variant).name);
+        nbody::Sim leapfrog(variant);
+        nbody::Sim hierarchical(variant);
+        leapfrog.set_integrator(nbody::Integrator::Leapfrog);
+        hierarchical.set_integrator(nbody::Integrator::Hierarchical);
+        hierarchical.set_timestep_levels(0);
+        for (nbody::Sim* sim : { &leapfrog, &hierarchical })
+        {
+            seed_disk(*sim, 300);
+            for (int step = 0; step < 5; ++step)
+                sim->update(1.f / 60.f);
+        }
+
+        for (size_t i = 0; i < leapfrog.bodies().size(); ++i)
+        {
+            INFO("body " << i);
+            REQUIRE(leapfrog.bodies()[i].pos == hierarchical.bodies()[i].pos);
+            REQUIRE(leapfrog.bodies()[i].vel == hierarchical.bodies()[i].vel);
+        }
+    }
+}
+
+TEST_CASE("a hierarchical sub-step does not pull a body back to where it was", "[sim][variant]")
+{
+    // The binary's sub-steps are too few to refit the tree for. Neither body has a radius,
+    // so nothing but skipping its own slot stops each from being pulled toward the copy of
+    // itself the tree still holds. Brute force has no such copy to skip; barnes-hut still
+    // sums the partner where the last refit saw it, hence the loose bound.
+    const auto run = [](const nbody::Variant variant)
+    {
+        nbody::Sim sim(variant);
+        sim.set_integrator(nbody::Integrator::Hierarchical);
+        seed_binary(sim);
+        sim.update(1.f);
+        return sim.bodies();
+    };
+
+    const std::vector<nbody::Body> exact = run(nbody::Variant::CpuBruteForce);
+    const std::vector<nbody::Body> tree = run(nbody::Variant::CpuBarnesHut);
+    for (size_t i = 0; i < 2; ++i)
+    {
+        INFO("body " << i);
+        REQUIRE(std::sqrt(tree[i].pos.dist_sq(exact[i].pos)) < .05f);
+        REQUIRE(std::sqrt(tree[i].vel.dist_sq(exact[i].vel)) < .05f);
+    }
+}
+
+TEST_CASE("every variant bounds an adaptive step by the accelerations it sums", "[sim][variant]")
+{
+    // The CPU variants fold the bound into their force passes, each its own way, and the GPU
+    // ones scan the bodies they read back. Every way must come to the bound the bodies give,
+    // read after the fact; the symmetric brute-force sum is a path of its own.
+    size_t tested = 0;
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        for (const bool symmetric : { false, true })
+        {
+            if (symmetric && info.variant != nbody::Variant::CpuBruteForce)
+                continue;
+            INFO(info.name << (symmetric ? ", symmetric" : ""));
+            ++tested;
+
+            nbody::Sim sim(info.variant);
+            sim.set_symmetric(symmetric);
+            seed_disk(sim, 300);
+            sim.mutable_bodies()[7].radius = 0;   // bounds nothing
+
+            sim.accelerate();
+            float least = std::numeric_limits<float>::infinity();
+            for (const nbody::Body& body : sim.bodies())
+                if (body.radius > 0)
+                    least = std::min(least, body.radius / std::sqrt(body.acc.size_sq()));
+            const float expected = sim.timestep_eta() * std::sqrt(least);
+
+            const double before = sim.time();
+            const float dt = sim.step(1e9f);
+            REQUIRE(dt == expected);
+            REQUIRE(sim.time() == before + dt);
+
+            // and the cap, when it is the shorter
+            REQUIRE(sim.step(expected / 2) == expected / 2);
+        }
+    }
+    REQUIRE(tested >= 4);
+}
+
+TEST_CASE("every variant runs a batch as it steps one at a time", "[sim][variant]")
+{
+    // The same steps either way, so the same bodies: batching changes when they are handed
+    // back, not what the steps do. Loose only for the GPU, whose batch is one submission
+    // where the single steps are several, which nothing in the arithmetic should notice.
+    size_t tested = 0;
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        for (const nbody::Integrator integrator : { nbody::Integrator::Euler, nbody::Integrator::Leapfrog })
+        {
+            INFO(info.name << (integrator == nbody::Integrator::Euler ? ", euler" : ", leapfrog"));
+            ++tested;
+
+            nbody::Sim single(info.variant);
+            nbody::Sim batched(info.variant);
+            for (nbody::Sim* sim : { &single, &batched })
+            {
+                sim->set_integrator(integrator);
+                seed_disk(*sim, 200);
+            }
+
+            for (int step = 0; step < 10; ++step)
+                single.update(1.f / 60.f);
+
+            std::vector<double> observed;
+            batched.run(10, 1.f / 60.f, 4, [&observed](const nbody::Sim& sim)
+            {
+                observed.push_back(sim.time());
+            });
+
+            REQUIRE(observed.size() == 3);   // after 4, 8 and the last 2
+            REQUIRE(std::abs(observed[0] - 4. / 60.) < 1e-6);
+            REQUIRE(std::abs(observed[1] - 8. / 60.) < 1e-6);
+            REQUIRE(std::abs(batched.time() - single.time()) < 1e-6);
+
+            for (size_t i = 0; i < single.bodies().size(); ++i)
+            {
+                INFO("body " << i);
+                REQUIRE(std::sqrt(batched.bodies()[i].pos.dist_sq(single.bodies()[i].pos)) < 1e-4f);
+                REQUIRE(std::sqrt(batched.bodies()[i].vel.dist_sq(single.bodies()[i].vel)) < 1e-4f);
+            }
+        }
+    }
+    REQUIRE(tested >= 6);
+}
+
+TEST_CASE("every variant says what its last step cost", "[sim][variant]")
+{
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        INFO(info.name);
+
+        nbody::Sim sim(info.variant);
+        REQUIRE(sim.stats().steps == 0);
+
+        seed_disk(sim, 200);
+        sim.update(1.f / 60.f);
+        const nbody::StepStats one = sim.stats();
+        REQUIRE(one.steps == 1);
+        REQUIRE(one.host > 0.);
+
+        // A batch is reported whole, not its last step.
+        sim.run(10, 1.f / 60.f);
+        REQUIRE(sim.stats().steps == 10);
+
+        // Only a device keeps time of its own.
+        const bool gpu = info.variant == nbody::Variant::GpuBarnesHut || info.variant == nbody::Variant::GpuBruteForce ||
+                         info.variant == nbody::Variant::GpuBarnesHutSoA || info.variant == nbody::Variant::GpuBruteForceSoA;
+        if (!gpu)
+        {
+            REQUIRE_FALSE(one.device_timed);
+            REQUIRE(one.compute() == 0.);
+            REQUIRE(one.transfer() == 0.);
+        }
+    }
+}
+
+TEST_CASE("every variant steps the same with its bodies reordered", "[sim][variant]")
+{
+    // Reordering moves the bodies, not what happens to them: through the permutation, each
+    // should end where it would have. Only the order the forces are summed in can differ, and
+    // the close pairs in the disk grow that over the steps, so the bound is a ten-thousandth
+    // of the disk's radius.
+    size_t tested = 0;
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        for (const nbody::Integrator integrator : { nbody::Integrator::Euler, nbody::Integrator::Leapfrog })
+        {
+            INFO(info.name << (integrator == nbody::Integrator::Euler ? ", euler" : ", leapfrog"));
+            ++tested;
+
+            nbody::Sim plain(info.variant);
+            nbody::Sim sorted(info.variant);
+            for (nbody::Sim* sim : { &plain, &sorted })
+            {
+                sim->set_integrator(integrator);
+                seed_disk(*sim, 300);
+            }
+            sorted.set_reorder_every(3);
+
+            for (int step = 0; step < 7; ++step)
+            {
+                plain.update(1.f / 60.f);
+                sorted.update(1.f / 60.f);
+            }
+            plain.run(8, 1.f / 60.f);
+            sorted.run(8, 1.f / 60.f, 5, [](const nbody::Sim&) {});
+
+            const std::span<const uint32_t> permutation = sorted.permutation();
+            REQUIRE(permutation.size() == plain.bodies().size());
+            bool moved = false;
+            for (size_t i = 0; i < permutation.size(); ++i)
+            {
+                INFO("body " << i << ", put at " << permutation[i]);
+                const nbody::Body& expected = plain.bodies()[permutation[i]];
+                moved = moved || permutation[i] != i;
+                REQUIRE(std::sqrt(sorted.bodies()[i].pos.dist_sq(expected.pos)) < 1e-2f);
+                REQUIRE(std::sqrt(sorted.bodies()[i].vel.dist_sq(expected.vel)) < 1e-2f);
+            }
+            REQUIRE(moved);
+        }
+    }
+    REQUIRE(tested >= 6);
+}
+
+TEST_CASE("hierarchical sub-steps sum the same forces after a reorder", "[sim][variant]")
+{
+    // A reorder drops whatever the solver built over the old order. The binary's sub-steps
+    // sum it alone, few enough that a tree would not be refit for them, so they must notice
+    // the tree is gone rather than sum nothing. Barnes-hut then sums them over a fresher tree
+    // than it would have, which moves the binary a hundredth of its separation at most.
+    for (const nbody::Variant variant : { nbody::Variant::CpuBarnesHut, nbody::Variant::CpuBruteForce, nbody::Variant::CpuFmm })
+    {
+        INFO(nbody::Sim::info(variant).name);
+        nbody::Sim plain(variant);
+        nbody::Sim sorted(variant);
+        for (nbody::Sim* sim : { &plain, &sorted })
+        {
+            sim->set_integrator(nbody::Integrator::Hierarchical);
+            seed_binary(*sim);
+        }
+        sorted.set_reorder_every(1);
+
+        for (int step = 0; step < 3; ++step)
+        {
+            plain.update(1.f);
+            sorted.update(1.f);
+        }
+
+        const std::span<const uint32_t> permutation = sorted.permutation();
+        bool moved = false;
+        for (size_t i = 0; i < permutation.size(); ++i)
+        {
+            INFO("body " << i << ", put at " << permutation[i]);
+            const nbody::Body& expected = plain.bodies()[permutation[i]];
+            moved = moved || permutation[i] != i;
+            REQUIRE(std::sqrt(sorted.bodies()[i].acc.dist_sq(expected.acc)) < 1e-2f);
+            REQUIRE(std::sqrt(sorted.bodies()[i].pos.dist_sq(expected.pos)) < 2e-2f);
+            REQUIRE(std::sqrt(sorted.bodies()[i].vel.dist_sq(expected.vel)) < 2e-2f);
+        }
+        REQUIRE(moved);
+    }
+}
+
+TEST_CASE("body ids survive every variant and a round trip through all of them", "[sim][variant]")
+{
+    // The GPU variants hand whole bodies to the device and back, or take them apart and
+    // put them together again: either way an id must come back on the body it left with.
+    nbody::Sim sim;
+    seed_disk(sim, 500);
+    std::vector<uint32_t> ids;
+    for (const nbody::Body& body : sim.bodies())
+        ids.push_back(body.id);
+
+    size_t tested = 0;
+    for (const nbody::VariantInfo& info : nbody::Sim::variants())
+    {
+        if (!info.available)
+            continue;
+        INFO("variant: " << info.name);
+        REQUIRE(sim.set_variant(info.variant));
+        ++tested;
+
+        sim.update(1.f / 60.f);
+        sim.reorder();
+        sim.update(1.f / 60.f);
+
+        REQUIRE(sim.bodies().size() == ids.size());
+        for (const uint32_t id : ids)
+        {
+            const std::optional<size_t> index = sim.index_of(id);
+            REQUIRE(index.has_value());
+            REQUIRE(sim.bodies()[*index].id == id);
+        }
+    }
+    REQUIRE(tested >= 3);
+}